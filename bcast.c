@@ -0,0 +1,263 @@
+/*
+ * bcast.c - Shared broadcast log implementation.
+ *
+ * Written in 2020 by Paul Osmialowski <pawelo@king.net.pl>.
+ *
+ * To the extent possible under law, the author(s) have dedicated all
+ * copyright and related and neighboring rights to this software to
+ * the public domain worldwide. This software is distributed without
+ * any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication
+ * along with this software. If not, see
+ * <http://creativecommons.org/publicdomain/zero/1.0>.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include "slab.h"
+#include "bcast.h"
+
+static struct BcastSegment *bcastSegmentNew(uint64_t offset)
+{
+  struct BcastSegment *seg = NULL;
+
+  seg = (struct BcastSegment *)(slabGet());
+  if (!seg)
+    return NULL;
+  seg->next = NULL;
+  seg->refs = 0U;
+  seg->offset = offset;
+  seg->used = 0U;
+  return seg;
+}
+
+static void bcastSegmentRef(struct BcastSegment *seg)
+{
+  assert(seg);
+  seg->refs++;
+}
+
+static void bcastSegmentUnref(struct Bcast *log, struct BcastSegment *seg)
+{
+  struct BcastSegment *next = NULL;
+
+  while (seg) {
+    assert(seg->refs > 0U);
+    seg->refs--;
+    if (seg->refs)
+      return;
+    next = seg->next;
+    slabPut(seg);
+    assert(log->segments > 0U);
+    log->segments--;
+    seg = next;
+  }
+}
+
+int bcastInit(struct Bcast *log)
+{
+  assert(log);
+  memset(log, 0, sizeof(struct Bcast));
+  log->offset = 0U;
+  log->tail = bcastSegmentNew(log->offset);
+  if (!(log->tail))
+    return -1;
+  bcastSegmentRef(log->tail);
+  log->segments = 1U;
+  return 0;
+}
+
+void bcastFree(struct Bcast *log)
+{
+  assert(log);
+  if (log->tail)
+    bcastSegmentUnref(log, log->tail);
+  log->tail = NULL;
+}
+
+size_t bcastReserve(struct Bcast *log, uint8_t **data)
+{
+  struct BcastSegment *seg = NULL;
+
+  assert(log);
+  assert(log->tail);
+  assert(data);
+  if ((log->tail->used) == BCAST_SEGMENT_SIZE) {
+    seg = bcastSegmentNew(log->offset);
+    if (!seg)
+      return 0U;
+    log->segments++;
+    /* One reference from the predecessor, one from the log itself. */
+    seg->refs = 2U;
+    log->tail->next = seg;
+    seg = log->tail;
+    log->tail = log->tail->next;
+    bcastSegmentUnref(log, seg);
+  }
+  *data = log->tail->data + log->tail->used;
+  return BCAST_SEGMENT_SIZE - (log->tail->used);
+}
+
+void bcastCommit(struct Bcast *log, size_t size)
+{
+  assert(log);
+  assert(log->tail);
+  assert(!((log->tail->used + size) > BCAST_SEGMENT_SIZE));
+  log->tail->used += size;
+  log->offset += size;
+}
+
+int bcastWrite(struct Bcast *log, const uint8_t *data, size_t size)
+{
+  uint8_t *dst = NULL;
+  size_t n;
+
+  assert(log);
+  while (size) {
+    n = bcastReserve(log, &dst);
+    if (!n)
+      return -1;
+    if (n > size)
+      n = size;
+    memcpy(dst, data, n);
+    bcastCommit(log, n);
+    data += n;
+    size -= n;
+  }
+  return 0;
+}
+
+void bcastJoin(struct Bcast *log, struct BcastCursor *cursor)
+{
+  assert(log);
+  assert(log->tail);
+  assert(cursor);
+  cursor->log = log;
+  cursor->seg = log->tail;
+  cursor->offset = log->offset;
+  bcastSegmentRef(cursor->seg);
+}
+
+void bcastLeave(struct BcastCursor *cursor)
+{
+  assert(cursor);
+  if (cursor->seg)
+    bcastSegmentUnref(cursor->log, cursor->seg);
+  cursor->seg = NULL;
+  cursor->log = NULL;
+}
+
+size_t bcastPeek(struct BcastCursor *cursor, const uint8_t **data)
+{
+  struct BcastSegment *seg = NULL;
+  size_t skip;
+
+  assert(cursor);
+  assert(cursor->seg);
+  assert(data);
+  seg = cursor->seg;
+  skip = (size_t)((cursor->offset) - (seg->offset));
+  if ((skip == seg->used) && (seg->next)) {
+    bcastSegmentRef(seg->next);
+    cursor->seg = seg->next;
+    bcastSegmentUnref(cursor->log, seg);
+    seg = cursor->seg;
+    skip = 0U;
+  }
+  assert(!(skip > seg->used));
+  *data = seg->data + skip;
+  return seg->used - skip;
+}
+
+/*
+ * Point up to count iovecs at what the cursor has not read yet, across
+ * as many segments as it takes, but no further than limit bytes. Every
+ * segment past the cursor is held by the one before it, so they all
+ * stay put until the cursor moves on.
+ */
+size_t bcastPeekv(const struct BcastCursor *cursor, struct iovec *iov,
+                  size_t count, uint64_t limit)
+{
+  const struct BcastSegment *seg = NULL;
+  size_t skip;
+  size_t size;
+  size_t n = 0U;
+
+  assert(cursor);
+  assert(cursor->seg);
+  assert(iov);
+  seg = cursor->seg;
+  skip = (size_t)((cursor->offset) - (seg->offset));
+  for (; seg && (n < count) && limit; seg = seg->next, skip = 0U) {
+    assert(!(skip > seg->used));
+    size = (seg->used) - skip;
+    if (size > limit)
+      size = limit;
+    if (!size)
+      continue;
+    iov[n].iov_base = (void *)(seg->data + skip);
+    iov[n].iov_len = size;
+    limit -= size;
+    n++;
+  }
+  return n;
+}
+
+void bcastConsume(struct BcastCursor *cursor, size_t size)
+{
+  struct BcastSegment *seg = NULL;
+
+  assert(cursor);
+  assert(cursor->seg);
+  seg = cursor->seg;
+  assert(!((cursor->offset + size) > (seg->offset + seg->used)));
+  cursor->offset += size;
+  /* Let go of a fully read segment right away. */
+  if (((cursor->offset) == (seg->offset + seg->used)) && (seg->next)) {
+    bcastSegmentRef(seg->next);
+    cursor->seg = seg->next;
+    bcastSegmentUnref(cursor->log, seg);
+  }
+}
+
+/*
+ * Move a cursor forward to the given offset (no further than the end of
+ * the log), giving up on whatever it has not read up to there. Returns
+ * the number of bytes skipped.
+ */
+uint64_t bcastSkip(struct BcastCursor *cursor, uint64_t offset)
+{
+  struct Bcast *log = NULL;
+  struct BcastSegment *seg = NULL;
+  uint64_t skipped;
+
+  assert(cursor);
+  assert(cursor->seg);
+  log = cursor->log;
+  if (offset > (log->offset))
+    offset = log->offset;
+  if (!(offset > (cursor->offset)))
+    return 0U;
+  skipped = offset - (cursor->offset);
+  seg = cursor->seg;
+  while ((seg->next) && (!(offset < ((seg->offset) + (seg->used)))))
+    seg = seg->next;
+  if (seg != (cursor->seg)) {
+    bcastSegmentRef(seg);
+    bcastSegmentUnref(log, cursor->seg);
+    cursor->seg = seg;
+  }
+  cursor->offset = offset;
+  return skipped;
+}
+
+uint64_t bcastLag(const struct BcastCursor *cursor)
+{
+  assert(cursor);
+  assert(cursor->log);
+  return (cursor->log->offset) - (cursor->offset);
+}
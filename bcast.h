@@ -0,0 +1,75 @@
+/*
+ * bcast.h - Shared broadcast log interface.
+ *
+ * Written in 2020 by Paul Osmialowski <pawelo@king.net.pl>.
+ *
+ * To the extent possible under law, the author(s) have dedicated all
+ * copyright and related and neighboring rights to this software to
+ * the public domain worldwide. This software is distributed without
+ * any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication
+ * along with this software. If not, see
+ * <http://creativecommons.org/publicdomain/zero/1.0>.
+ */
+
+#ifndef __BCAST_H
+#define __BCAST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "slab.h"
+
+/*
+ * The log is a chain of fixed-size segments written once by a single
+ * producer and read by any number of readers, each at its own cursor.
+ *
+ * Every segment is reference counted: a reader holds a reference to
+ * the segment its cursor is in, a segment holds a reference to its
+ * successor and the log holds a reference to the segment being
+ * written. Hence a segment goes away as soon as the slowest reader has
+ * left it, dragging along every later segment nobody else refers to.
+ * Each segment takes up exactly one slab.
+ */
+struct BcastSegment
+{
+  struct BcastSegment *next;
+  size_t refs;
+  uint64_t offset;
+  size_t used;
+  uint8_t data[];
+};
+
+#define BCAST_SEGMENT_SIZE (SLAB_SIZE - sizeof(struct BcastSegment))
+
+struct Bcast
+{
+  struct BcastSegment *tail;
+  uint64_t offset;
+  size_t segments;
+};
+
+struct BcastCursor
+{
+  struct Bcast *log;
+  struct BcastSegment *seg;
+  uint64_t offset;
+};
+
+int bcastInit(struct Bcast *log);
+void bcastFree(struct Bcast *log);
+size_t bcastReserve(struct Bcast *log, uint8_t **data);
+void bcastCommit(struct Bcast *log, size_t size);
+int bcastWrite(struct Bcast *log, const uint8_t *data, size_t size);
+void bcastJoin(struct Bcast *log, struct BcastCursor *cursor);
+void bcastLeave(struct BcastCursor *cursor);
+size_t bcastPeek(struct BcastCursor *cursor, const uint8_t **data);
+size_t bcastPeekv(const struct BcastCursor *cursor, struct iovec *iov,
+                  size_t count, uint64_t limit);
+void bcastConsume(struct BcastCursor *cursor, size_t size);
+uint64_t bcastSkip(struct BcastCursor *cursor, uint64_t offset);
+uint64_t bcastLag(const struct BcastCursor *cursor);
+
+#endif /* __BCAST_H */
@@ -0,0 +1,649 @@
+/*
+ * bench.c - Load generator for stdiotelnetd.
+ *
+ * Written in 2020 by Paul Osmialowski <pawelo@king.net.pl>.
+ *
+ * To the extent possible under law, the author(s) have dedicated all
+ * copyright and related and neighboring rights to this software to
+ * the public domain worldwide. This software is distributed without
+ * any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication
+ * along with this software. If not, see
+ * <http://creativecommons.org/publicdomain/zero/1.0>.
+ */
+
+#include <stdio.h>
+#include <stddef.h> /* needed by libtelnet.h */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <libtelnet.h>
+
+#define FAIL -1
+
+/* Every line the producer writes is this long, time stamp included. */
+#define BENCH_RECORD 64U
+
+/* Producer output goes out at least this often, in microseconds. */
+#define BENCH_TICK 1000U
+
+/* Longest the connections are given to come up, in microseconds. */
+#define BENCH_RAMP_TIME 10000000U
+
+/* Time the connections are given to settle before measuring starts. */
+#define BENCH_WARMUP 500000U
+
+/* A keystroke not echoed back within that long counts as lost. */
+#define BENCH_ECHO_TIMEOUT 1000000U
+
+#define BENCH_BUFFER 65536U
+
+/*
+ * Connections not greeted by the server yet, kept below its listen backlog
+ * so that none waits for a SYN to be sent again.
+ */
+#define BENCH_RAMP 8U
+
+enum
+{
+  PARSE_IDLE = 0,
+  PARSE_SEQ,
+  PARSE_STAMP,
+  PARSE_PAD
+};
+
+struct Viewer
+{
+  int sock;
+  telnet_t *telnet;
+  const telnet_telopt_t *opts;
+  int connecting;
+  int closed;
+  int parse;
+  uint64_t seq;
+  uint64_t stamp;
+  uint64_t lastSeq;
+  uint64_t bytes;
+  uint64_t records;
+  uint64_t gaps;
+  uint64_t lagSum;
+  uint64_t lagMax;
+};
+
+struct Bench
+{
+  struct Viewer *viewers;
+  size_t count;
+  size_t connecting;
+  size_t up;
+  int ep;
+  uint64_t now;
+  int measuring;
+  /* Keystrokes go through the first viewer only. */
+  char pending;
+  uint64_t sentAt;
+  uint64_t lost;
+  uint64_t *echoes;
+  size_t nechoes;
+  size_t echoesSize;
+};
+
+static const telnet_telopt_t acceptOpts[] =
+{
+  { .telopt = TELNET_TELOPT_ECHO, .us = TELNET_WONT, .him = TELNET_DO },
+  { .telopt = TELNET_TELOPT_SGA, .us = TELNET_WONT, .him = TELNET_DO },
+  { .telopt = TELNET_TELOPT_NAWS, .us = TELNET_WILL, .him = TELNET_DONT },
+  { .telopt = TELNET_TELOPT_COMPRESS2, .us = TELNET_WONT, .him = TELNET_DO },
+  { .telopt = -1, .us = 0U, .him = 0U }
+};
+
+/* The same, leaving compression out. */
+static const telnet_telopt_t plainOpts[] =
+{
+  { .telopt = TELNET_TELOPT_ECHO, .us = TELNET_WONT, .him = TELNET_DO },
+  { .telopt = TELNET_TELOPT_SGA, .us = TELNET_WONT, .him = TELNET_DO },
+  { .telopt = TELNET_TELOPT_NAWS, .us = TELNET_WILL, .him = TELNET_DONT },
+  { .telopt = -1, .us = 0U, .him = 0U }
+};
+
+/* Anything the server asks for is turned down. */
+static const telnet_telopt_t refuseOpts[] =
+{
+  { .telopt = -1, .us = 0U, .him = 0U }
+};
+
+static struct Bench bench;
+
+static uint64_t benchClock(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (((uint64_t)(ts.tv_sec)) * 1000000U) + (ts.tv_nsec / 1000U);
+}
+
+/* A size with an optional K or M suffix, as in the TELNET_* variables. */
+static int benchSize(const char *arg, uint64_t *size)
+{
+  char *end = NULL;
+  unsigned long long value;
+
+  errno = 0;
+  value = strtoull(arg, &end, 10);
+  if (errno || (end == arg))
+    return -1;
+  switch (*end) {
+  case 'K':
+  case 'k':
+    value <<= 10;
+    end++;
+    break;
+  case 'M':
+  case 'm':
+    value <<= 20;
+    end++;
+    break;
+  default:
+    ;
+  }
+  if (*end)
+    return -1;
+  *size = value;
+  return 0;
+}
+
+static int compareValues(const void *a, const void *b)
+{
+  uint64_t x = *((const uint64_t *)(a));
+  uint64_t y = *((const uint64_t *)(b));
+
+  return (x > y) - (x < y);
+}
+
+static void samplesPrint(const char *what, uint64_t *v, size_t n)
+{
+  if (!n) {
+    printf("%s: no samples\n", what);
+    return;
+  }
+  qsort(v, n, sizeof(uint64_t), compareValues);
+  printf("%s: %zu samples, msec min %.3f p50 %.3f p90 %.3f p99 %.3f"
+         " p99.9 %.3f max %.3f\n", what, n, v[0] / 1e3, v[n / 2U] / 1e3,
+         v[(n * 9U) / 10U] / 1e3, v[(n * 99U) / 100U] / 1e3,
+         v[(n * 999U) / 1000U] / 1e3, v[n - 1U] / 1e3);
+}
+
+/*
+ * The producer: fixed size lines stamped with the time they were written,
+ * at the given rate, with whatever comes in echoed back right away.
+ */
+static int benchProduce(uint64_t rate)
+{
+  struct pollfd pfd;
+  char *buf = NULL;
+  char in[BENCH_BUFFER];
+  uint64_t start;
+  uint64_t now;
+  uint64_t due;
+  uint64_t seq = 0U;
+  size_t used;
+  ssize_t ssize;
+  int n;
+
+  buf = (char *)(malloc(BENCH_BUFFER));
+  if (!buf)
+    return FAIL;
+  pfd.fd = STDIN_FILENO;
+  pfd.events = POLLIN;
+  start = benchClock();
+  for (;;) {
+    if ((poll(&pfd, 1U, rate ? (BENCH_TICK / 1000U) : -1) > 0)
+        && (pfd.revents)) {
+      ssize = read(STDIN_FILENO, in, sizeof in);
+      if ((ssize < 0) && (errno == EINTR))
+        continue;
+      if (!(ssize > 0))
+        break;
+      if (write(STDOUT_FILENO, in, ssize) != ssize)
+        break;
+    }
+    now = benchClock();
+    due = ((now - start) * rate) / (1000000U * BENCH_RECORD);
+    used = 0U;
+    while ((seq < due) && ((BENCH_BUFFER - used) >= BENCH_RECORD)) {
+      n = snprintf(buf + used, BENCH_RECORD, "#%llu %llu",
+                   (unsigned long long)(seq), (unsigned long long)(now));
+      memset(buf + used + n, ' ', BENCH_RECORD - n - 1U);
+      buf[used + BENCH_RECORD - 1U] = '\n';
+      used += BENCH_RECORD;
+      seq++;
+    }
+    if (used && (write(STDOUT_FILENO, buf, used) != ((ssize_t)(used))))
+      break;
+  }
+  free(buf);
+  return 0;
+}
+
+static void benchRecord(struct Viewer *viewer)
+{
+  uint64_t lag;
+
+  if (!(bench.measuring))
+    return;
+  lag = ((bench.now) > (viewer->stamp)) ? ((bench.now) - (viewer->stamp))
+                                        : 0U;
+  if ((viewer->records) && ((viewer->seq) != ((viewer->lastSeq) + 1U)))
+    viewer->gaps++;
+  viewer->lastSeq = viewer->seq;
+  viewer->records++;
+  viewer->lagSum += lag;
+  if (lag > (viewer->lagMax))
+    viewer->lagMax = lag;
+}
+
+static void benchEcho(uint8_t c)
+{
+  uint64_t *echoes = NULL;
+  size_t size;
+
+  if ((!(bench.pending)) || (c != ((uint8_t)(bench.pending))))
+    return;
+  bench.pending = 0;
+  if (!(bench.measuring))
+    return;
+  if ((bench.nechoes) == (bench.echoesSize)) {
+    size = (bench.echoesSize) ? ((bench.echoesSize) * 2U) : 1024U;
+    echoes = (uint64_t *)(realloc(bench.echoes, size * sizeof(uint64_t)));
+    if (!echoes)
+      return;
+    bench.echoes = echoes;
+    bench.echoesSize = size;
+  }
+  bench.echoes[bench.nechoes++] = (bench.now) - (bench.sentAt);
+}
+
+static void benchData(struct Viewer *viewer, const uint8_t *data, size_t size)
+{
+  size_t i;
+  uint8_t c;
+
+  for (i = 0U; i < size; i++) {
+    c = data[i];
+    switch (viewer->parse) {
+    case PARSE_IDLE:
+      if (c == '#') {
+        viewer->parse = PARSE_SEQ;
+        viewer->seq = 0U;
+      } else if (viewer == bench.viewers) {
+        benchEcho(c);
+      }
+      break;
+    case PARSE_SEQ:
+      if ((c >= '0') && (c <= '9')) {
+        viewer->seq = ((viewer->seq) * 10U) + (c - '0');
+      } else if (c == ' ') {
+        viewer->parse = PARSE_STAMP;
+        viewer->stamp = 0U;
+      } else {
+        viewer->parse = PARSE_PAD;
+      }
+      break;
+    case PARSE_STAMP:
+      if ((c >= '0') && (c <= '9')) {
+        viewer->stamp = ((viewer->stamp) * 10U) + (c - '0');
+        break;
+      }
+      benchRecord(viewer);
+      viewer->parse = PARSE_PAD;
+      /* FALLTHROUGH */
+    case PARSE_PAD:
+      if (c == '\n')
+        viewer->parse = PARSE_IDLE;
+      break;
+    default:
+      assert(0);
+    }
+  }
+}
+
+static void benchSend(struct Viewer *viewer, const char *data, size_t size)
+{
+  ssize_t ssize;
+
+  if (viewer->closed)
+    return;
+  /* Replies are a few bytes each, a socket that cannot take them is dead. */
+  ssize = send(viewer->sock, data, size, MSG_NOSIGNAL);
+  if (ssize != ((ssize_t)(size)))
+    viewer->closed = !0;
+}
+
+static void benchEvents(telnet_t *telnet, telnet_event_t *ev, void *data)
+{
+  struct Viewer *viewer = ((struct Viewer *)(data));
+  const char naws[4] = { 0, 80, 0, 24 };
+
+  switch (ev->type) {
+  case TELNET_EV_DATA:
+    benchData(viewer, (const uint8_t *)(ev->data.buffer), ev->data.size);
+    break;
+  case TELNET_EV_SEND:
+    benchSend(viewer, ev->data.buffer, ev->data.size);
+    break;
+  case TELNET_EV_DO:
+    if ((ev->neg.telopt) == TELNET_TELOPT_NAWS)
+      telnet_subnegotiation(telnet, TELNET_TELOPT_NAWS, naws, sizeof naws);
+    break;
+  case TELNET_EV_ERROR:
+    viewer->closed = !0;
+    break;
+  default:
+    ;
+  }
+}
+
+static int benchConnect(struct Viewer *viewer, const struct sockaddr_in *addr,
+                        const telnet_telopt_t *opts)
+{
+  struct epoll_event ev;
+
+  viewer->sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                        0);
+  if (viewer->sock < 0)
+    return -1;
+  if ((connect(viewer->sock, (const struct sockaddr *)(addr),
+               sizeof(struct sockaddr_in)) < 0) && (errno != EINPROGRESS)) {
+    close(viewer->sock);
+    return -1;
+  }
+  viewer->opts = opts;
+  viewer->connecting = !0;
+  bench.connecting++;
+  memset(&ev, 0, sizeof ev);
+  ev.events = EPOLLOUT;
+  ev.data.ptr = viewer;
+  if (epoll_ctl(bench.ep, EPOLL_CTL_ADD, viewer->sock, &ev) < 0) {
+    close(viewer->sock);
+    bench.connecting--;
+    return -1;
+  }
+  return 0;
+}
+
+static void benchConnected(struct Viewer *viewer)
+{
+  struct epoll_event ev;
+  socklen_t len = sizeof(int);
+  int err = 0;
+  int one = 1;
+
+  if ((getsockopt(viewer->sock, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+      || err) {
+    viewer->closed = !0;
+    return;
+  }
+  setsockopt(viewer->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+  viewer->telnet = telnet_init(viewer->opts, benchEvents, 0U, viewer);
+  memset(&ev, 0, sizeof ev);
+  ev.events = EPOLLIN;
+  ev.data.ptr = viewer;
+  if ((!(viewer->telnet))
+      || (epoll_ctl(bench.ep, EPOLL_CTL_MOD, viewer->sock, &ev) < 0))
+    viewer->closed = !0;
+}
+
+/* A read at a time, so that no viewer keeps the others waiting. */
+static void benchReceive(struct Viewer *viewer, char *buf)
+{
+  ssize_t ssize;
+
+  ssize = recv(viewer->sock, buf, BENCH_BUFFER, 0);
+  if (ssize < 0) {
+    if ((errno != EAGAIN) && (errno != EINTR))
+      viewer->closed = !0;
+    return;
+  }
+  if (!ssize) {
+    viewer->closed = !0;
+    return;
+  }
+  /* The server says something first, so it has taken the connection. */
+  if (viewer->connecting) {
+    viewer->connecting = 0;
+    bench.connecting--;
+  }
+  if (bench.measuring)
+    viewer->bytes += ssize;
+  telnet_recv(viewer->telnet, buf, ssize);
+}
+
+static void benchRead(struct Viewer *viewer, char *buf)
+{
+  if (viewer->closed)
+    return;
+  if (!(viewer->telnet))
+    benchConnected(viewer);
+  else
+    benchReceive(viewer, buf);
+  if (!(viewer->closed))
+    return;
+  if (viewer->connecting) {
+    viewer->connecting = 0;
+    bench.connecting--;
+  }
+  /* Left be from now on, as at the end of file it would never go quiet. */
+  epoll_ctl(bench.ep, EPOLL_CTL_DEL, viewer->sock, NULL);
+}
+
+/* One keystroke at a time, each one waited for before the next. */
+static void benchType(uint64_t *nextKey, uint64_t interval, char *key)
+{
+  struct Viewer *typist = bench.viewers;
+
+  if (bench.pending) {
+    if (((bench.now) - (bench.sentAt)) < BENCH_ECHO_TIMEOUT)
+      return;
+    if (bench.measuring)
+      bench.lost++;
+    bench.pending = 0;
+  }
+  if (((bench.now) < (*nextKey)) || (typist->closed) || (!(typist->telnet)))
+    return;
+  *key = ((*key) >= 'z') ? 'a' : ((*key) + 1);
+  bench.pending = *key;
+  bench.sentAt = bench.now;
+  *nextKey = (bench.now) + interval;
+  telnet_send(typist->telnet, key, 1U);
+}
+
+static void benchReport(uint64_t elapsed)
+{
+  struct Viewer *viewer = NULL;
+  uint64_t *lags = NULL;
+  uint64_t bytes = 0U;
+  uint64_t gaps = 0U;
+  uint64_t worst = 0U;
+  size_t closed = 0U;
+  size_t n = 0U;
+  size_t i;
+
+  lags = (uint64_t *)(calloc(bench.count, sizeof(uint64_t)));
+  for (i = 0U; i < (bench.count); i++) {
+    viewer = &(bench.viewers[i]);
+    bytes += viewer->bytes;
+    gaps += viewer->gaps;
+    if (viewer->closed)
+      closed++;
+    if ((viewer->lagMax) > worst)
+      worst = viewer->lagMax;
+    if (lags && (viewer->records))
+      lags[n++] = (viewer->lagSum) / (viewer->records);
+  }
+  printf("connections: %zu, %zu up when measuring started, %zu closed"
+         " on the way\n", bench.count, bench.up, closed);
+  printf("delivered: %.3f MB/s (%llu bytes in %.3f s), %.3f MB/s a viewer\n",
+         (bytes / 1048576.0) / (elapsed / 1e6), (unsigned long long)(bytes),
+         elapsed / 1e6,
+         ((bytes / 1048576.0) / (elapsed / 1e6)) / (bench.count));
+  printf("gaps: %llu\n", (unsigned long long)(gaps));
+  samplesPrint("mean lag a viewer", lags, n);
+  printf("worst lag: msec %.3f\n", worst / 1e3);
+  samplesPrint("keystroke to echo", bench.echoes, bench.nechoes);
+  printf("keystrokes lost: %llu\n", (unsigned long long)(bench.lost));
+  free(lags);
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "Usage: %s [-a <address>] [-c <connections>]"
+          " [-d <seconds>] [-k <keystrokes/s>] [-r <refusing %%>] [-z]"
+          " <port>\n", name);
+  fprintf(stderr, "       %s -p <bytes/s>\n", name);
+}
+
+int main(int argc, char **argv)
+{
+  struct epoll_event events[256];
+  struct sockaddr_in addr;
+  struct rlimit rlim;
+  const telnet_telopt_t *opts = plainOpts;
+  const char *address = "127.0.0.1";
+  char *buf = NULL;
+  uint64_t value;
+  uint64_t conns = 100U;
+  uint64_t duration = 10U;
+  uint64_t keys = 10U;
+  uint64_t refuse = 0U;
+  uint64_t start = 0U;
+  uint64_t end = 0U;
+  uint64_t ramp;
+  uint64_t nextKey = 0U;
+  char key = 'z';
+  size_t i;
+  int opt;
+  int n;
+
+  while ((opt = getopt(argc, argv, "a:c:d:k:p:r:z")) != -1) {
+    if ((opt != 'a') && (opt != 'z')
+        && ((opt == '?') || (benchSize(optarg, &value) < 0))) {
+      usage(argv[0]);
+      return FAIL;
+    }
+    switch (opt) {
+    case 'a':
+      address = optarg;
+      break;
+    case 'c':
+      conns = value;
+      break;
+    case 'd':
+      duration = value;
+      break;
+    case 'k':
+      keys = value;
+      break;
+    case 'p':
+      return benchProduce(value);
+    case 'r':
+      refuse = value;
+      break;
+    case 'z':
+      opts = acceptOpts;
+      break;
+    default:
+      ;
+    }
+  }
+  if (((optind + 1) != argc) || (!conns) || (!duration) || (refuse > 100U)) {
+    usage(argv[0]);
+    return FAIL;
+  }
+  memset(&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(atoi(argv[optind]));
+  if ((!(addr.sin_port)) || (inet_pton(AF_INET, address, &(addr.sin_addr))
+                             != 1)) {
+    usage(argv[0]);
+    return FAIL;
+  }
+  /* Thousands of connections need as many descriptors as can be had. */
+  if (!getrlimit(RLIMIT_NOFILE, &rlim)) {
+    rlim.rlim_cur = rlim.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rlim);
+  }
+  memset(&bench, 0, sizeof bench);
+  bench.viewers = (struct Viewer *)(calloc(conns, sizeof(struct Viewer)));
+  buf = (char *)(malloc(BENCH_BUFFER));
+  bench.ep = epoll_create1(EPOLL_CLOEXEC);
+  if ((!(bench.viewers)) || (!buf) || ((bench.ep) < 0)) {
+    fprintf(stderr, "Out of resources.\n");
+    return FAIL;
+  }
+  /* Measuring starts a while after the last connection is up. */
+  bench.now = benchClock();
+  ramp = (bench.now) + BENCH_RAMP_TIME;
+  for (;;) {
+    while (((bench.count) < conns) && ((bench.connecting) < BENCH_RAMP)) {
+      if (benchConnect(&(bench.viewers[bench.count]), &addr,
+                       ((((bench.count) * 100U) / conns) < refuse)
+                         ? refuseOpts : opts) < 0) {
+        fprintf(stderr, "Connection %zu failed: %s\n", bench.count,
+                strerror(errno));
+        if (!(bench.count))
+          return FAIL;
+        conns = bench.count;
+        break;
+      }
+      bench.count++;
+    }
+    n = epoll_wait(bench.ep, events, sizeof events / sizeof events[0], 1);
+    bench.now = benchClock();
+    for (i = 0U; i < ((size_t)((n > 0) ? n : 0)); i++)
+      benchRead((struct Viewer *)(events[i].data.ptr), buf);
+    if ((!start) && ((((bench.count) == conns) && (!(bench.connecting)))
+                     || ((bench.now) >= ramp))) {
+      /* A server too busy to take them all in is measured as it is. */
+      conns = bench.count;
+      start = (bench.now) + BENCH_WARMUP;
+      end = start + (duration * 1000000U);
+    }
+    if (start && (!(bench.measuring)) && ((bench.now) >= start)) {
+      bench.measuring = !0;
+      start = bench.now;
+      for (i = 0U; i < (bench.count); i++)
+        bench.up += (bench.viewers[i].telnet) && (!(bench.viewers[i].closed))
+                    && (!(bench.viewers[i].connecting));
+    }
+    if (end && ((bench.now) >= end))
+      break;
+    if (keys)
+      benchType(&nextKey, 1000000U / keys, &key);
+  }
+  benchReport((bench.now) - start);
+  for (i = 0U; i < (bench.count); i++) {
+    if (bench.viewers[i].telnet)
+      telnet_free(bench.viewers[i].telnet);
+    close(bench.viewers[i].sock);
+  }
+  close(bench.ep);
+  free(buf);
+  free(bench.echoes);
+  free(bench.viewers);
+  return 0;
+}
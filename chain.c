@@ -0,0 +1,199 @@
+/*
+ * chain.c - Chained slab buffer implementation.
+ *
+ * Written in 2020 by Paul Osmialowski <pawelo@king.net.pl>.
+ *
+ * To the extent possible under law, the author(s) have dedicated all
+ * copyright and related and neighboring rights to this software to
+ * the public domain worldwide. This software is distributed without
+ * any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication
+ * along with this software. If not, see
+ * <http://creativecommons.org/publicdomain/zero/1.0>.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "slab.h"
+#include "chain.h"
+
+static struct ChainLink *chainLinkNew(void)
+{
+  struct ChainLink *link = NULL;
+
+  link = (struct ChainLink *)(slabGet());
+  if (!link)
+    return NULL;
+  link->next = NULL;
+  link->start = 0U;
+  link->end = 0U;
+  return link;
+}
+
+void chainInit(struct Chain *chain, size_t budget)
+{
+  assert(chain);
+  chain->head = NULL;
+  chain->tail = NULL;
+  chain->size = 0U;
+  chain->budget = budget;
+}
+
+void chainFree(struct Chain *chain)
+{
+  struct ChainLink *link = NULL;
+
+  assert(chain);
+  while (chain->head) {
+    link = chain->head;
+    chain->head = link->next;
+    slabPut(link);
+  }
+  chain->tail = NULL;
+  chain->size = 0U;
+}
+
+size_t chainSize(const struct Chain *chain)
+{
+  assert(chain);
+  return chain->size;
+}
+
+size_t chainRoom(const struct Chain *chain)
+{
+  assert(chain);
+  assert(!((chain->size) > (chain->budget)));
+  return (chain->budget) - (chain->size);
+}
+
+/* All or nothing, fails when the budget or the memory runs out. */
+int chainWrite(struct Chain *chain, const uint8_t *data, size_t size)
+{
+  struct ChainLink *link = NULL;
+  size_t n;
+
+  assert(chain);
+  if (size > chainRoom(chain))
+    return -1;
+  while (size) {
+    link = chain->tail;
+    if ((!link) || ((link->end) == CHAIN_LINK_SIZE)) {
+      link = chainLinkNew();
+      if (!link)
+        return -1;
+      if (chain->tail)
+        chain->tail->next = link;
+      else
+        chain->head = link;
+      chain->tail = link;
+    }
+    n = CHAIN_LINK_SIZE - (link->end);
+    if (n > size)
+      n = size;
+    memcpy(link->data + link->end, data, n);
+    link->end += n;
+    chain->size += n;
+    data += n;
+    size -= n;
+  }
+  return 0;
+}
+
+size_t chainPeek(const struct Chain *chain, const uint8_t **data)
+{
+  assert(chain);
+  assert(data);
+  if (!(chain->head))
+    return 0U;
+  *data = chain->head->data + chain->head->start;
+  return (chain->head->end) - (chain->head->start);
+}
+
+void chainConsume(struct Chain *chain, size_t size)
+{
+  struct ChainLink *link = NULL;
+  size_t n;
+
+  assert(chain);
+  assert(!(size > (chain->size)));
+  chain->size -= size;
+  while (chain->head) {
+    link = chain->head;
+    n = (link->end) - (link->start);
+    if (n > size)
+      n = size;
+    link->start += n;
+    size -= n;
+    /* A drained slab goes back to the pool right away. */
+    if (((link->start) == (link->end))
+        && (((link->end) == CHAIN_LINK_SIZE) || (!(chain->size)))) {
+      chain->head = link->next;
+      if (!(chain->head))
+        chain->tail = NULL;
+      slabPut(link);
+      continue;
+    }
+    if (!size)
+      break;
+  }
+  assert(!size);
+}
+
+/* Point up to count iovecs at the links, oldest first. */
+size_t chainIovec(const struct Chain *chain, struct iovec *iov, size_t count)
+{
+  const struct ChainLink *link = NULL;
+  size_t n = 0U;
+
+  assert(chain);
+  assert(iov);
+  for (link = chain->head; link && (n < count); link = link->next) {
+    if ((link->end) == (link->start))
+      continue;
+    iov[n].iov_base = (void *)(link->data + link->start);
+    iov[n].iov_len = (link->end) - (link->start);
+    n++;
+  }
+  return n;
+}
+
+ssize_t chainWritev(int fd, struct Chain *chain)
+{
+  struct iovec iov[CHAIN_IOV_MAX];
+  size_t count;
+  ssize_t n;
+
+  assert(chain);
+  count = chainIovec(chain, iov, CHAIN_IOV_MAX);
+  if (!count)
+    return 0;
+  n = writev(fd, iov, count);
+  if (n > 0)
+    chainConsume(chain, n);
+  return n;
+}
+
+ssize_t chainSendmsg(int sock, struct Chain *chain, int flags)
+{
+  struct iovec iov[CHAIN_IOV_MAX];
+  struct msghdr msg;
+  ssize_t n;
+
+  assert(chain);
+  memset(&msg, 0, sizeof msg);
+  msg.msg_iov = iov;
+  msg.msg_iovlen = chainIovec(chain, iov, CHAIN_IOV_MAX);
+  if (!(msg.msg_iovlen))
+    return 0;
+  n = sendmsg(sock, &msg, flags);
+  if (n > 0)
+    chainConsume(chain, n);
+  return n;
+}
@@ -0,0 +1,65 @@
+/*
+ * chain.h - Chained slab buffer interface.
+ *
+ * Written in 2020 by Paul Osmialowski <pawelo@king.net.pl>.
+ *
+ * To the extent possible under law, the author(s) have dedicated all
+ * copyright and related and neighboring rights to this software to
+ * the public domain worldwide. This software is distributed without
+ * any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication
+ * along with this software. If not, see
+ * <http://creativecommons.org/publicdomain/zero/1.0>.
+ */
+
+#ifndef __CHAIN_H
+#define __CHAIN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "slab.h"
+
+/* Most links handed to the kernel by a single call. */
+#ifndef CHAIN_IOV_MAX
+#define CHAIN_IOV_MAX 16U
+#endif
+
+struct ChainLink
+{
+  struct ChainLink *next;
+  size_t start;
+  size_t end;
+  uint8_t data[];
+};
+
+#define CHAIN_LINK_SIZE (SLAB_SIZE - sizeof(struct ChainLink))
+
+/*
+ * A FIFO of bytes kept in a list of slabs. It takes a slab from the pool
+ * whenever the last one fills up, up to a budget, and gives every slab
+ * back as soon as it is drained, so an idle chain holds no memory.
+ */
+struct Chain
+{
+  struct ChainLink *head;
+  struct ChainLink *tail;
+  size_t size;
+  size_t budget;
+};
+
+void chainInit(struct Chain *chain, size_t budget);
+void chainFree(struct Chain *chain);
+size_t chainSize(const struct Chain *chain);
+size_t chainRoom(const struct Chain *chain);
+int chainWrite(struct Chain *chain, const uint8_t *data, size_t size);
+size_t chainPeek(const struct Chain *chain, const uint8_t **data);
+void chainConsume(struct Chain *chain, size_t size);
+size_t chainIovec(const struct Chain *chain, struct iovec *iov, size_t count);
+ssize_t chainWritev(int fd, struct Chain *chain);
+ssize_t chainSendmsg(int sock, struct Chain *chain, int flags);
+
+#endif /* __CHAIN_H */
@@ -0,0 +1,96 @@
+/*
+ * config.c - Runtime configuration implementation.
+ *
+ * Written in 2020 by Paul Osmialowski <pawelo@king.net.pl>.
+ *
+ * To the extent possible under law, the author(s) have dedicated all
+ * copyright and related and neighboring rights to this software to
+ * the public domain worldwide. This software is distributed without
+ * any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication
+ * along with this software. If not, see
+ * <http://creativecommons.org/publicdomain/zero/1.0>.
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "debug.h"
+#include "config.h"
+
+/*
+ * Get a size from the environment, optionally suffixed with K, M or G
+ * (powers of 1024). Anything missing or malformed gives the fallback.
+ */
+size_t configSize(const char *name, size_t fallback)
+{
+  const char *env = NULL;
+  char *end = NULL;
+  unsigned long long value;
+
+  assert(name);
+  env = getenv(name);
+  if (!env)
+    return fallback;
+  value = strtoull(env, &end, 10);
+  if (end == env) {
+    D("Ignoring %s=%s.\n", name, env);
+    return fallback;
+  }
+  switch (*end) {
+  case 'g':
+  case 'G':
+    value <<= 10;
+    /* FALLTHROUGH */
+  case 'm':
+  case 'M':
+    value <<= 10;
+    /* FALLTHROUGH */
+  case 'k':
+  case 'K':
+    value <<= 10;
+    end++;
+    break;
+  default:
+    ;
+  }
+  if (*end) {
+    D("Ignoring %s=%s.\n", name, env);
+    return fallback;
+  }
+  return (size_t)(value);
+}
+
+/*
+ * Get the position of the value of an environment variable among the
+ * NULL-terminated choices.
+ */
+int configChoice(const char *name, const char *const *choices, int fallback)
+{
+  const char *env = NULL;
+  int i;
+
+  assert(name);
+  assert(choices);
+  env = getenv(name);
+  if (!env)
+    return fallback;
+  for (i = 0; choices[i]; i++) {
+    if (!strcmp(env, choices[i]))
+      return i;
+  }
+  D("Ignoring %s=%s.\n", name, env);
+  return fallback;
+}
+
+int configPolicy(const char *name, int fallback)
+{
+  /* In the order of the POLICY_* values. */
+  static const char *const policies[] = { "stall", "disconnect", "drop",
+                                          NULL };
+
+  return configChoice(name, policies, fallback);
+}
@@ -0,0 +1,42 @@
+/*
+ * config.h - Runtime configuration interface.
+ *
+ * Written in 2020 by Paul Osmialowski <pawelo@king.net.pl>.
+ *
+ * To the extent possible under law, the author(s) have dedicated all
+ * copyright and related and neighboring rights to this software to
+ * the public domain worldwide. This software is distributed without
+ * any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication
+ * along with this software. If not, see
+ * <http://creativecommons.org/publicdomain/zero/1.0>.
+ */
+
+#ifndef __CONFIG_H
+#define __CONFIG_H
+
+#include <stddef.h>
+
+/* Default for TELNET_RINGBUF_CAPACITY. */
+#ifndef RINGBUF_CAPACITY
+#define RINGBUF_CAPACITY 512U
+#endif
+
+/*
+ * What to do when one side produces faster than the other one drains:
+ * stop taking more in, disconnect the peer that does not keep up, or
+ * drop the oldest data (and count it).
+ */
+enum
+{
+  POLICY_STALL = 0,
+  POLICY_DISCONNECT,
+  POLICY_DROP
+};
+
+size_t configSize(const char *name, size_t fallback);
+int configChoice(const char *name, const char *const *choices, int fallback);
+int configPolicy(const char *name, int fallback);
+
+#endif /* __CONFIG_H */
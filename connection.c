@@ -13,6 +13,8 @@
  * <http://creativecommons.org/publicdomain/zero/1.0>.
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -23,153 +25,977 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #include "ringbuf.h"
 
 #include "debug.h"
+#include "log.h"
+#include "config.h"
 #include "connection.h"
 #include "telnetd.h"
+#include "metrics.h"
+#include "trace.h"
 
 #ifdef MAX_CONN
-static size_t conns = 0U;
+/* Shared by all the worker threads. */
+static atomic_size_t conns = 0U;
 #endif
 
-struct Connection *newConnection(const char *host, int sock)
+/*
+ * Connections are carved out of blocks of slots that stay around for as
+ * long as the program runs. A closed connection goes back on the free
+ * list together with its input ring, ready for the next client. The
+ * pool is shared by all the threads, as a connection is not always
+ * closed by the thread it was accepted on.
+ */
+struct ConnBlock
+{
+  struct ConnBlock *next;
+  struct Connection slots[CONN_POOL_BATCH];
+};
+
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static struct ConnBlock *poolBlocks = NULL;
+static struct Connection *poolFree = NULL;
+static size_t poolIdle = 0U;
+static atomic_size_t allocs = 0U;
+
+/* Called with poolLock held. */
+static int connPoolGrow(void)
+{
+  struct ConnBlock *block = NULL;
+  size_t i;
+
+  block = (struct ConnBlock *)(malloc(sizeof(struct ConnBlock)));
+  if (!block)
+    return -1;
+  atomic_fetch_add(&allocs, 1U);
+  memset(block, 0, sizeof(struct ConnBlock));
+  block->next = poolBlocks;
+  poolBlocks = block;
+  for (i = 0U; i < CONN_POOL_BATCH; i++) {
+    block->slots[i].sock = -1;
+    block->slots[i].rbIn = NULL;
+    block->slots[i].next = poolFree;
+    poolFree = &(block->slots[i]);
+  }
+  poolIdle += CONN_POOL_BATCH;
+  return 0;
+}
+
+static ringbuf_t connRingNew(void)
+{
+  ringbuf_t rb = ringbuf_new_mirrored(CONN_CHUNK_SIZE);
+
+  if (rb)
+    atomic_fetch_add(&allocs, 1U);
+  return rb;
+}
+
+static struct Connection *connGet(void)
+{
+  struct Connection *conn = NULL;
+  ringbuf_t rbIn = NULL;
+
+  pthread_mutex_lock(&poolLock);
+  if ((!poolFree) && (connPoolGrow() < 0)) {
+    pthread_mutex_unlock(&poolLock);
+    return NULL;
+  }
+  conn = poolFree;
+  poolFree = conn->next;
+  assert(poolIdle > 0U);
+  poolIdle--;
+  /* Cleared under the lock, the metrics dump looks at every slot. */
+  rbIn = conn->rbIn;
+  memset(conn, 0, sizeof(struct Connection));
+  conn->rbIn = rbIn;
+  pthread_mutex_unlock(&poolLock);
+  return conn;
+}
+
+static void connPut(struct Connection *conn)
+{
+  pthread_mutex_lock(&poolLock);
+  conn->next = poolFree;
+  poolFree = conn;
+  poolIdle++;
+  pthread_mutex_unlock(&poolLock);
+}
+
+/* Make sure that many connections can come in without allocating. */
+int connPoolReserve(size_t count)
+{
+  struct Connection *conn = NULL;
+  int ret = 0;
+
+  pthread_mutex_lock(&poolLock);
+  while ((poolIdle < count) && (!ret))
+    ret = connPoolGrow();
+  for (conn = poolFree; conn && (!ret); conn = conn->next) {
+    if (!(conn->rbIn)) {
+      conn->rbIn = connRingNew();
+      if (!(conn->rbIn))
+        ret = -1;
+    }
+  }
+  pthread_mutex_unlock(&poolLock);
+  return ret;
+}
+
+/* Only once every connection is closed and every thread is gone. */
+void connPoolFree(void)
+{
+  struct ConnBlock *block = NULL;
+  size_t i;
+
+  pthread_mutex_lock(&poolLock);
+  while (poolBlocks) {
+    block = poolBlocks;
+    poolBlocks = block->next;
+    for (i = 0U; i < CONN_POOL_BATCH; i++) {
+      if (block->slots[i].rbIn)
+        ringbuf_free(&(block->slots[i].rbIn));
+    }
+    free(block);
+  }
+  poolFree = NULL;
+  poolIdle = 0U;
+  pthread_mutex_unlock(&poolLock);
+}
+
+/* Only ever written by the thread serving the peer, no need to lock. */
+static void connBump(atomic_ullong *stat, uint64_t value)
+{
+  atomic_store_explicit(stat,
+                        atomic_load_explicit(stat, memory_order_relaxed)
+                        + value, memory_order_relaxed);
+}
+
+static void connSet(atomic_ullong *stat, uint64_t value)
+{
+  atomic_store_explicit(stat, value, memory_order_relaxed);
+}
+
+/* One more syscall pushing output to the peer. */
+static void connCount(struct Connection *conn, ssize_t sent)
+{
+  connBump(&(conn->stats.sends), 1U);
+  metricsAdd(METRIC_SENDS, 1U);
+  if (sent > 0) {
+    connBump(&(conn->stats.bytesOut), sent);
+    metricsAdd(METRIC_BYTES_OUT, sent);
+  }
+}
+
+/* The rest of what the metrics dump shows of the peer. */
+static void connPublish(struct Connection *conn)
+{
+  connSet(&(conn->stats.queued), connOutSize(conn));
+  connSet(&(conn->stats.lag), connLag(conn));
+  connSet(&(conn->stats.dropped), conn->outDropped);
+  connSet(&(conn->stats.inDropped), conn->inDropped);
+}
+
+/*
+ * The socket is full and whatever is queued has to wait for it, which
+ * is what the queue statistics count.
+ */
+static void connPark(struct Connection *conn)
+{
+  size_t queued = chainSize(&(conn->outq));
+
+  if ((!queued) || (conn->parked))
+    return;
+  conn->parked = !0;
+  conn->outQueued += queued;
+  if (queued > conn->outQueuedPeak)
+    conn->outQueuedPeak = queued;
+}
+
+/* Heap allocations made for the connections so far, by all the threads. */
+size_t connAllocs(void)
+{
+  return atomic_load(&allocs);
+}
+
+/*
+ * Socket options that go with the output profile. None of them matter
+ * enough to turn the peer away, and a peer that is not on TCP (a unix
+ * socket) does not take them at all.
+ */
+static void connTune(struct Connection *conn)
+{
+  int nodelay = ((conn->backpressure->net) == NET_INTERACTIVE);
+  int lowat = (int)(conn->backpressure->notsentLowat);
+
+  setsockopt(conn->sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof nodelay);
+#ifdef TCP_NOTSENT_LOWAT
+  if (lowat > 0)
+    setsockopt(conn->sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat,
+               sizeof lowat);
+#endif
+}
+
+/*
+ * With the bulk profile, a burst goes out corked into full segments.
+ * Not with completions, the burst is a single request anyway and would
+ * only go out once the cork is gone.
+ */
+static void connCork(struct Connection *conn, int cork)
+{
+  if (((conn->backpressure->net) != NET_BULK) || (conn->reactor))
+    return;
+  if ((!cork) == (!(conn->corked)))
+    return;
+  conn->corked = cork;
+  setsockopt(conn->sock, IPPROTO_TCP, TCP_CORK, &cork, sizeof cork);
+}
+
+/*
+ * Whether to leave the output in the log for a while longer, so that
+ * more of it goes out at once. Once the deadline has passed, the output
+ * keeps going out until the peer has caught up with the log.
+ */
+static int connHold(struct Connection *conn)
+{
+  uint64_t lag = connLag(conn);
+  uint64_t now;
+
+  if (!lag) {
+    conn->heldAt = 0U;
+    return 0;
+  }
+  if ((!(conn->backpressure->flushDelay))
+      || (lag >= (conn->backpressure->flushSize)))
+    return 0;
+  now = reactorClock();
+  if (!(conn->heldAt)) {
+    conn->heldAt = now;
+    return !0;
+  }
+  return (now - (conn->heldAt)) < (conn->backpressure->flushDelay);
+}
+
+struct Connection *newConnection(const char *host, int sock,
+                                 struct Encoders *encoders,
+                                 ringbuf_t rbNetToHost,
+                                 const struct Backpressure *backpressure)
 {
   struct Connection *conn = NULL;
 
   assert(host);
   assert(!(sock < 0));
-  D("\r\nNew connection from [%s] on socket %d.\r\n", host, sock);
-  conn = (struct Connection *)(malloc(sizeof(struct Connection)));
-  if (!conn)
+  assert(encoders);
+  assert(rbNetToHost);
+  assert(backpressure);
+  logWrite(LOG_INFO, "New connection from [%s] on socket %d.", host, sock);
+  conn = connGet();
+  if (!conn) {
+    close(sock);
     return NULL;
-  memset(conn, 0, sizeof(struct Connection));
+  }
   conn->next = NULL;
   snprintf(conn->host, sizeof conn->host, "%s", host);
   conn->sock = sock;
-  conn->rbHostToNet = NULL;
-  conn->rbNetToHost = NULL;
+  conn->profile = ENCODER_PLAIN;
+  conn->compress = 0;
+  conn->encoders = encoders;
+  conn->cursor.log = NULL;
+  conn->cursor.seg = NULL;
+  conn->rbNetToHost = rbNetToHost;
+  conn->session = NULL;
+  conn->inStalled = 0;
+  conn->backpressure = backpressure;
+  conn->outDropped = 0U;
+  conn->inDropped = 0U;
+  chainInit(&(conn->outq), backpressure->outBudget);
+  chainInit(&(conn->privq), backpressure->outBudget);
+  conn->splicePipe[0] = -1;
+  conn->splicePipe[1] = -1;
+  conn->spliced = 0U;
+  conn->syncPending = 0;
+  conn->syncAt = 0U;
+  conn->outQueued = 0U;
+  conn->outQueuedPeak = 0U;
+  conn->heldAt = 0U;
+  conn->corked = 0;
+  conn->parked = 0;
+  conn->iacOpen = 0;
   conn->telnet = NULL;
+  conn->reactor = NULL;
+  conn->sendQueued = 0U;
+  conn->sendTotal = 0U;
+  conn->sending = 0;
+  conn->cancelled = 0;
 #ifdef MAX_CONN
-  conns++;
-  if (conns > MAX_CONN) {
+  if ((atomic_fetch_add(&conns, 1U) + 1U) > MAX_CONN) {
+    metricsAdd(METRIC_REJECTED, 1U);
     connSendMsg(conn, "Too many connections!\n\r");
+    connFlush(conn);
     closeConnection(conn);
     return NULL;
   }
 #endif
-  conn->rbHostToNet = ringbuf_new(RINGBUF_CAPACITY);
-  if (!(conn->rbHostToNet)) {
+  connTune(conn);
+  encodersJoin(encoders, conn->profile, &(conn->cursor));
+  if (conn->rbIn)
+    ringbuf_reset(conn->rbIn);
+  else
+    conn->rbIn = connRingNew();
+  if (!(conn->rbIn)) {
     closeConnection(conn);
     return NULL;
   }
-  conn->rbNetToHost = ringbuf_new(RINGBUF_CAPACITY);
-  if (!(conn->rbNetToHost)) {
-    closeConnection(conn);
-    return NULL;
-  }
-  if ((telnetdInit(conn)) < 0) {
+  /* The negotiation may already find the peer gone. */
+  if (((telnetdInit(conn)) < 0) || ((conn->sock) < 0)) {
     closeConnection(conn);
     return NULL;
   }
+  metricsAdd(METRIC_ACCEPTED, 1U);
+  TRACE(TRACE_ADOPT, 0U, sock, 0U, 0U);
+  atomic_store_explicit(&(conn->stats.live), !0, memory_order_release);
   return conn;
 }
 
+static int connSendStored(struct Connection *conn)
+{
+  uint8_t header[ENCODER_STORED_HEADER_LEN];
+  const uint8_t *data = NULL;
+  size_t usize;
+
+  assert(conn->syncPending);
+  while ((usize = chainPeek(&(conn->privq), &data)) > 0U) {
+    if (usize > ENCODER_STORED_MAX)
+      usize = ENCODER_STORED_MAX;
+    encodersStored(header, usize);
+    if (connSend(conn, header, sizeof header) < 0)
+      return -1;
+    if (connSend(conn, data, usize) < 0)
+      return -1;
+    chainConsume(&(conn->privq), usize);
+  }
+  conn->syncPending = 0;
+  return 0;
+}
+
+/*
+ * In the escaped log IAC bytes only ever come in pairs, so an odd run of
+ * them at the end of what the peer got means it was cut off mid pair.
+ */
+static void connTrackIac(struct Connection *conn, const uint8_t *data,
+                         size_t size)
+{
+  size_t run = 0U;
+
+  if ((conn->profile) != ENCODER_PLAIN)
+    return;
+  while ((run < size) && (data[size - run - 1U] == TELNET_IAC))
+    run++;
+  if (run == size)
+    conn->iacOpen ^= (int)(run & 1U);
+  else
+    conn->iacOpen = (int)(run & 1U);
+}
+
+/*
+ * The other half of a pair the peer got cut off in has to go before
+ * anything else queued for it, or the peer takes the IAC for a command.
+ */
+static int connFinishIac(struct Connection *conn)
+{
+  const uint8_t *data = NULL;
+  ssize_t sent;
+
+  /* With completions, connSubmit() sends it on its own first. */
+  if (conn->reactor) {
+    if (!(conn->iacOpen))
+      return 0;
+    errno = EAGAIN;
+    return -1;
+  }
+  while (conn->iacOpen) {
+    if (!bcastPeek(&(conn->cursor), &data))
+      return 0;
+    sent = send(conn->sock, data, 1U, MSG_NOSIGNAL);
+    connCount(conn, sent);
+    if (sent < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN)
+        connPark(conn);
+      return -1;
+    }
+    connTrackIac(conn, data, 1U);
+    bcastConsume(&(conn->cursor), 1U);
+  }
+  return 0;
+}
+
+/* Take what the kernel took off the queue first and then off the log. */
+static void connConsume(struct Connection *conn, size_t sent, size_t queued)
+{
+  const uint8_t *data = NULL;
+  size_t usize;
+  size_t left;
+
+  usize = (sent < queued) ? sent : queued;
+  chainConsume(&(conn->outq), usize);
+  if (!(chainSize(&(conn->outq))))
+    conn->parked = 0;
+  for (left = sent - usize; left; left -= usize) {
+    usize = bcastPeek(&(conn->cursor), &data);
+    if (usize > left)
+      usize = left;
+    connTrackIac(conn, data, usize);
+    bcastConsume(&(conn->cursor), usize);
+  }
+}
+
+/*
+ * The same as connPush() with completions: the iovecs go to the kernel
+ * as a sendmsg request and what went out is taken off once it is done,
+ * by connSendDone(). Nothing else moves the output meanwhile, as the
+ * kernel may be at any of it.
+ */
+static int connSubmit(struct Connection *conn, uint64_t limit)
+{
+  struct iovec *iov = conn->sendIov;
+  size_t count = 0U;
+  size_t i;
+
+  if (conn->sending)
+    return 0;
+  conn->sendQueued = 0U;
+  /* The other half of a pair the peer got cut off in goes first. */
+  if (conn->iacOpen)
+    count = bcastPeekv(&(conn->cursor), iov, 1U, 1U);
+  if (!count) {
+    count = chainIovec(&(conn->outq), iov, CHAIN_IOV_MAX);
+    for (i = 0U; i < count; i++)
+      conn->sendQueued += iov[i].iov_len;
+    if ((conn->sendQueued) == chainSize(&(conn->outq)))
+      count += bcastPeekv(&(conn->cursor), iov + count,
+                          CHAIN_IOV_MAX - count, limit);
+  }
+  if (!count)
+    return 0;
+  conn->sendTotal = 0U;
+  for (i = 0U; i < count; i++)
+    conn->sendTotal += iov[i].iov_len;
+  memset(&(conn->sendMsg), 0, sizeof conn->sendMsg);
+  conn->sendMsg.msg_iov = iov;
+  conn->sendMsg.msg_iovlen = count;
+  if (reactorSend(conn->reactor, &(conn->watch), &(conn->sendMsg),
+                  MSG_NOSIGNAL) < 0)
+    return -1;
+  conn->sending = !0;
+  return 0;
+}
+
+/*
+ * Hand everything queued and then as much of the log as there is (up to
+ * limit bytes) to the kernel in a single call. Whatever the socket does
+ * not take stays where it was, the log backlog is never copied. Returns
+ * 1 when everything went and there may be more to push.
+ */
+static int connPush(struct Connection *conn, uint64_t limit)
+{
+  struct iovec iov[CHAIN_IOV_MAX];
+  struct msghdr msg;
+  size_t queued = 0U;
+  size_t total;
+  size_t count;
+  size_t i;
+  ssize_t sent;
+
+  if (conn->reactor)
+    return connSubmit(conn, limit);
+  if (conn->spliced) {
+    if (connFlush(conn) < 0)
+      return -1;
+    if (conn->spliced)
+      return 0;
+  }
+  if (connFinishIac(conn) < 0)
+    return (errno == EAGAIN) ? 0 : -1;
+  count = chainIovec(&(conn->outq), iov, CHAIN_IOV_MAX);
+  for (i = 0U; i < count; i++)
+    queued += iov[i].iov_len;
+  total = queued;
+  /* The log only goes after everything queued before it. */
+  if (queued == chainSize(&(conn->outq))) {
+    i = count;
+    count += bcastPeekv(&(conn->cursor), iov + count, CHAIN_IOV_MAX - count,
+                        limit);
+    for (; i < count; i++)
+      total += iov[i].iov_len;
+  }
+  if (!count)
+    return 0;
+  memset(&msg, 0, sizeof msg);
+  msg.msg_iov = iov;
+  msg.msg_iovlen = count;
+  sent = sendmsg(conn->sock, &msg, MSG_NOSIGNAL);
+  connCount(conn, sent);
+  if (sent < 0) {
+    if (errno == EAGAIN) {
+      connPark(conn);
+      return 0;
+    }
+    return (errno == EINTR) ? 1 : -1;
+  }
+  connConsume(conn, sent, queued);
+  TRACE(TRACE_SEND, conn->profile, conn->sock, sent, conn->cursor.offset);
+  if (((size_t)(sent)) < total) {
+    connPark(conn);
+    return 0;
+  }
+  return 1;
+}
+
+/*
+ * Skip a lagging peer to the end of the log, telling it so. The skip
+ * starts once the peer has the whole of the escape it may have been cut
+ * off in and ends where the encoder last finished a batch, so no IAC is
+ * left dangling before the marker.
+ */
+static int connDrop(struct Connection *conn)
+{
+  char marker[64];
+  uint64_t skipped;
+
+  /*
+   * Not under a send in flight, the kernel may be at the log. One stuck
+   * on a full socket is called off, the drop comes once it is back.
+   */
+  if (conn->sending) {
+    if (!(conn->cancelled))
+      reactorCancel(conn->reactor, &(conn->watch), REACTOR_SEND);
+    conn->cancelled = !0;
+    return 0;
+  }
+  if (connFinishIac(conn) < 0)
+    return (errno == EAGAIN) ? 0 : -1;
+  conn->iacOpen = 0;
+  skipped = bcastSkip(&(conn->cursor),
+                      encodersBoundary(conn->encoders, conn->profile));
+  conn->outDropped += skipped;
+  metricsAdd(METRIC_DROPPED, skipped);
+  logWrite(LOG_INFO, "Dropped %llu bytes for [%s] on socket %d.",
+           (unsigned long long)(skipped), conn->host, conn->sock);
+  snprintf(marker, sizeof marker, "\r\n[%llu bytes dropped]\r\n",
+           (unsigned long long)(skipped));
+  if (connSendMsg(conn, marker) < 0)
+    return -1;
+  return connFlush(conn);
+}
+
+/*
+ * What the backpressure policy makes of a peer lagging too far behind,
+ * once everything due for it has been pushed out.
+ */
+static int connLagCheck(struct Connection *conn)
+{
+  if (bcastLag(&(conn->cursor)) > (conn->backpressure->lagLimit)) {
+    switch (conn->backpressure->output) {
+    case POLICY_STALL:
+      /* The server stops taking host output in until it catches up. */
+      return 0;
+    case POLICY_DROP:
+      /* No way to skip through the shared deflate stream mid-block. */
+      if ((conn->profile) == ENCODER_PLAIN)
+        return connDrop(conn);
+      /* FALLTHROUGH */
+    default:
+      logWrite(LOG_WARN, "Connection from [%s] on socket %d lags behind.",
+               conn->host, conn->sock);
+      metricsAdd(METRIC_LAGGED, 1U);
+      return -1;
+    }
+  }
+  return 0;
+}
+
 int handleConnection(struct Connection *conn, int selected)
 {
   ssize_t rec;
+  const void *span;
+  uint64_t limit;
   size_t usize;
-  uint8_t buf[RINGBUF_CAPACITY];
+  size_t room;
+  size_t avail;
+  int held;
+  int ret;
 
   assert(conn);
   if ((conn->sock) < 0)
     return -1;
+  TRACE(TRACE_CONN, !!selected, conn->sock, 0U, 0U);
   if (selected) {
-    rec = recv(conn->sock, (void *)(buf), sizeof buf, MSG_NOSIGNAL);
-    if (rec <= 0)
+    /*
+     * Straight into the ring, and telnet_recv() right out of it, with
+     * the data going straight into the host-bound ring. What comes out
+     * of libtelnet is never longer than what went in, so unless old
+     * input is to be dropped, only take in what the host has room for.
+     */
+    room = ringbuf_bytes_free(conn->rbIn);
+    avail = ringbuf_bytes_free(conn->rbNetToHost);
+    if ((room > avail) && ((conn->backpressure->input) != POLICY_DROP)) {
+      if (avail) {
+        room = avail;
+      } else if ((conn->backpressure->input) == POLICY_STALL) {
+        if (!(conn->inStalled))
+          metricsAdd(METRIC_IN_STALLS, 1U);
+        conn->inStalled = !0;
+        return 0;
+      } else {
+        logWrite(LOG_WARN, "Host does not keep up with [%s] on socket %d.",
+                 conn->host, conn->sock);
+        return -1;
+      }
+    }
+    /* With completions, the data comes to connRecvDone() instead. */
+    if (conn->reactor) {
+      if (reactorBusy(&(conn->watch), REACTOR_RECV))
+        return 0;
+      return (reactorRecv(conn->reactor, &(conn->watch), room) < 0) ? -1 : 0;
+    }
+    rec = ringbuf_recvmsg(conn->sock, conn->rbIn, room, MSG_NOSIGNAL);
+    if (rec < 0) {
+      if (errno == EAGAIN)
+        return 0;
+      return (errno == EINTR) ? 1 : -1;
+    }
+    if (!rec)
       return -1;
-    telnet_recv(conn->telnet, (char *)buf, rec);
-  } else {
-    usize = connHostToNetSize(conn);
-    if (usize > 0) {
-      if ((connHostToNetGet(conn, buf, usize)) < 0)
+    TRACE(TRACE_RECV, 0U, conn->sock, rec, 0U);
+    connBump(&(conn->stats.bytesIn), rec);
+    metricsAdd(METRIC_BYTES_IN, rec);
+    while ((usize = ringbuf_peek(conn->rbIn, &span)) > 0U) {
+      telnet_recv(conn->telnet, (const char *)(span), usize);
+      if ((conn->sock) < 0)
         return -1;
-      telnet_send(conn->telnet, (char *)buf, usize);
+      ringbuf_consume(conn->rbIn, usize);
     }
+    return (rec == room) ? 1 : 0;
   }
-  return 0;
+  /* Only the lag is looked at until a send in flight is done. */
+  if (conn->sending)
+    return connLagCheck(conn);
+  /*
+   * Feed the shared host output only while the socket keeps up, the
+   * backlog of a slow peer stays in the log rather than in a private
+   * copy. Whatever got queued for the peer meanwhile goes along.
+   */
+  held = (!(connOutSize(conn))) && connHold(conn);
+  if ((!held) && connLag(conn))
+    connCork(conn, !0);
+  while (!held) {
+    if ((conn->syncPending) && ((conn->cursor.offset) == (conn->syncAt))) {
+      if (connSendStored(conn) < 0)
+        return -1;
+      continue;
+    }
+    limit = (conn->syncPending) ? ((conn->syncAt) - (conn->cursor.offset))
+                                : UINT64_MAX;
+    ret = connPush(conn, limit);
+    if (ret < 0)
+      return -1;
+    if (!ret)
+      break;
+  }
+  connCork(conn, 0);
+  if (!(connLag(conn)))
+    conn->heldAt = 0U;
+  connPublish(conn);
+  /*
+   * Once compression is asked for, move the peer over to the shared
+   * deflate stream, but only at a point where both streams are in step.
+   */
+  if ((conn->compress) && ((conn->profile) == ENCODER_PLAIN)
+      && (!(connOutSize(conn))) && (!(bcastLag(&(conn->cursor))))
+      && encodersSynced(conn->encoders)) {
+    telnet_subnegotiation(conn->telnet, TELNET_TELOPT_COMPRESS2, NULL, 0U);
+    if (connSend(conn, (const uint8_t *)(ENCODER_ZLIB_HEADER),
+                 ENCODER_ZLIB_HEADER_LEN) < 0)
+      return -1;
+    if (encodersSync(conn->encoders, ENCODER_COMPRESS2, &(conn->syncAt)) < 0)
+      return -1;
+    encodersLeave(conn->encoders, conn->profile, &(conn->cursor));
+    conn->profile = ENCODER_COMPRESS2;
+    encodersJoin(conn->encoders, conn->profile, &(conn->cursor));
+    assert((conn->cursor.offset) == (conn->syncAt));
+    if (connFlush(conn) < 0)
+      return -1;
+  }
+  return connLagCheck(conn);
 }
 
-int connHostToNetGet(struct Connection *conn, uint8_t *data, size_t size)
+/*
+ * What a receive made by handleConnection() came back with, when the
+ * peer is served by completions. The data goes to libtelnet the same
+ * way as out of the ring otherwise. Running out of buffers, the peer
+ * is only held up until the next receive.
+ */
+int connRecvDone(struct Connection *conn, const uint8_t *data, int res)
 {
   assert(conn);
-  assert(conn->rbHostToNet);
-  if (!(ringbuf_memcpy_from(data, conn->rbHostToNet, size)))
+  if ((conn->sock) < 0)
     return -1;
-  return 0;
+  if (res < 0)
+    return ((res == -EAGAIN) || (res == -EINTR) || (res == -ENOBUFS)
+            || (res == -ECANCELED)) ? 0 : -1;
+  if (!res)
+    return -1;
+  assert(data);
+  TRACE(TRACE_RECV, 0U, conn->sock, res, 0U);
+  connBump(&(conn->stats.bytesIn), res);
+  metricsAdd(METRIC_BYTES_IN, res);
+  telnet_recv(conn->telnet, (const char *)(data), res);
+  return ((conn->sock) < 0) ? -1 : 0;
 }
 
-int connHostToNetPut(struct Connection *conn, const uint8_t *data, size_t size)
+/* What a sendmsg request made by connSubmit() came back with. */
+int connSendDone(struct Connection *conn, int res)
 {
   assert(conn);
-  assert(conn->rbHostToNet);
-  if (!(ringbuf_memcpy_into(conn->rbHostToNet, data, size)))
+  assert(conn->sending);
+  conn->sending = 0;
+  conn->cancelled = 0;
+  if ((conn->sock) < 0)
     return -1;
-  return 0;
+  connCount(conn, res);
+  if (res < 0) {
+    if ((res != -EAGAIN) && (res != -EINTR) && (res != -ECANCELED))
+      return -1;
+    connPark(conn);
+  } else {
+    connConsume(conn, res, conn->sendQueued);
+    TRACE(TRACE_SEND, conn->profile, conn->sock, res, conn->cursor.offset);
+    if (((size_t)(res)) < (conn->sendTotal))
+      connPark(conn);
+  }
+  /* Before the next send goes out, or a lagging peer is never dropped. */
+  return connLagCheck(conn);
 }
 
-int connNetToHostGet(struct Connection *conn, uint8_t *data, size_t size)
+int connNetToHostPut(struct Connection *conn, const uint8_t *data, size_t size)
 {
+  size_t avail;
+
   assert(conn);
   assert(conn->rbNetToHost);
-  if (!(ringbuf_memcpy_from(data, conn->rbNetToHost, size)))
+  avail = ringbuf_bytes_free(conn->rbNetToHost);
+  if (size > avail) {
+    /* Only ever let in by POLICY_DROP, make room by losing the oldest. */
+    metricsAdd(METRIC_IN_DROPPED, size - avail);
+    if (size > ringbuf_capacity(conn->rbNetToHost)) {
+      conn->inDropped += size - ringbuf_capacity(conn->rbNetToHost);
+      data += size - ringbuf_capacity(conn->rbNetToHost);
+      size = ringbuf_capacity(conn->rbNetToHost);
+    }
+    conn->inDropped += size - avail;
+    ringbuf_consume(conn->rbNetToHost, size - avail);
+  }
+  if (!(ringbuf_memcpy_into(conn->rbNetToHost, data, size)))
     return -1;
   return 0;
 }
 
-int connNetToHostPut(struct Connection *conn, const uint8_t *data, size_t size)
+uint64_t connLag(const struct Connection *conn)
 {
   assert(conn);
-  assert(conn->rbNetToHost);
-  if (!(ringbuf_memcpy_into(conn->rbNetToHost, data, size)))
-    return -1;
-  return 0;
+  if (!(conn->cursor.seg))
+    return 0U;
+  return bcastLag(&(conn->cursor));
 }
 
-size_t connHostToNetSize(const struct Connection *conn)
+/* When the output held back is due to go out, 0 when nothing is held. */
+uint64_t connFlushAt(const struct Connection *conn)
 {
   assert(conn);
-  assert(conn->rbHostToNet);
-  return ringbuf_bytes_used(conn->rbHostToNet);
+  if (!(conn->heldAt))
+    return 0U;
+  return (conn->heldAt) + (conn->backpressure->flushDelay);
 }
 
-size_t connNetToHostSize(const struct Connection *conn)
+size_t connOutSize(const struct Connection *conn)
 {
   assert(conn);
-  assert(conn->rbNetToHost);
-  return ringbuf_bytes_used(conn->rbNetToHost);
+  return (conn->spliced) + chainSize(&(conn->outq));
 }
 
-int connSend(struct Connection *conn, const uint8_t *data, size_t size)
+/*
+ * Whether host output may bypass the log on its way to this peer: the
+ * peer has to see the host output as it is and be done with everything
+ * sent to it before.
+ */
+int connSpliceReady(const struct Connection *conn)
+{
+  assert(conn);
+  return ((conn->profile) == ENCODER_PLAIN) && (!(conn->compress))
+         && (!(conn->syncPending)) && (!(connOutSize(conn)))
+         && (!(connLag(conn)));
+}
+
+/*
+ * Duplicate what the host pipe fd starts with into the pipe of the peer
+ * and splice it to the socket from there. Whatever the pipe does not
+ * take is sent from the data scanned out of it the usual way.
+ */
+int connTee(struct Connection *conn, int fd, const uint8_t *data,
+            size_t size)
+{
+  ssize_t teed;
+
+  assert(conn);
+  assert(data);
+  if ((conn->sock) < 0)
+    return -1;
+  if (((conn->splicePipe[0]) < 0)
+      && (pipe2(conn->splicePipe, O_NONBLOCK | O_CLOEXEC) < 0)) {
+    conn->splicePipe[0] = -1;
+    conn->splicePipe[1] = -1;
+  }
+  teed = 0;
+  if (!((conn->splicePipe[1]) < 0)) {
+    teed = tee(fd, conn->splicePipe[1], size, SPLICE_F_NONBLOCK);
+    if (teed < 0)
+      teed = 0;
+  }
+  conn->spliced += teed;
+  if (connFlush(conn) < 0)
+    return -1;
+  if (((size_t)(teed)) < size)
+    return connSend(conn, data + teed, size - teed);
+  return 0;
+}
+
+/*
+ * There is no MSG_NOSIGNAL for splice(), a peer gone away would raise
+ * the SIGPIPE that otherwise tells the host went away.
+ */
+static ssize_t connSplice(struct Connection *conn)
+{
+  static const struct timespec now = { 0, 0 };
+  sigset_t pipeset;
+  sigset_t oldset;
+  ssize_t sent;
+  int err;
+
+  sigemptyset(&pipeset);
+  sigaddset(&pipeset, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &pipeset, &oldset);
+  sent = splice(conn->splicePipe[0], NULL, conn->sock, NULL, conn->spliced,
+                SPLICE_F_NONBLOCK | SPLICE_F_MOVE);
+  err = errno;
+  connCount(conn, sent);
+  if ((sent < 0) && (err == EPIPE))
+    sigtimedwait(&pipeset, NULL, &now);
+  pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+  errno = err;
+  return sent;
+}
+
+int connFlush(struct Connection *conn)
 {
   ssize_t sent;
 
   assert(conn);
   if ((conn->sock) < 0)
     return -1;
-  while (size) {
-    sent = send(conn->sock, data, size, MSG_NOSIGNAL);
-    if (sent == -1) {
-      if (errno != EAGAIN)
+  /* Nothing is ever spliced with completions. */
+  if (conn->reactor)
+    return connSubmit(conn, 0U);
+  while (conn->spliced) {
+    sent = connSplice(conn);
+    if (sent < 0) {
+      if (errno == EAGAIN)
+        return 0;
+      if (errno != EINTR)
         return -1;
     } else {
-      if (sent > size)
+      if (!sent)
         return -1;
-      size -= sent;
-      data += sent;
+      TRACE(TRACE_SPLICE, 0U, conn->sock, sent, 0U);
+      conn->spliced -= sent;
     }
   }
+  if ((connOutSize(conn) > 0U) && (connFinishIac(conn) < 0))
+    return (errno == EAGAIN) ? 0 : -1;
+  while (connOutSize(conn) > 0U) {
+    sent = chainSendmsg(conn->sock, &(conn->outq), MSG_NOSIGNAL);
+    connCount(conn, sent);
+    if (sent > 0)
+      TRACE(TRACE_SEND, conn->profile, conn->sock, sent, conn->cursor.offset);
+    if (sent < 0) {
+      if (errno == EAGAIN) {
+        connPark(conn);
+        return 0;
+      }
+      if (errno != EINTR)
+        return -1;
+    }
+  }
+  conn->parked = 0;
+  return 0;
+}
+
+/*
+ * Queue bytes up for the peer. They go out in order with the next push,
+ * along with everything else that piles up for the peer by then, in a
+ * single call.
+ */
+int connSend(struct Connection *conn, const uint8_t *data, size_t size)
+{
+  size_t queued;
+
+  assert(conn);
+  if ((conn->sock) < 0)
+    return -1;
+  if (chainWrite(&(conn->outq), data, size) < 0) {
+    logWrite(LOG_WARN, "Output queue of [%s] on socket %d overflown.",
+             conn->host, conn->sock);
+    metricsAdd(METRIC_OVERFLOWS, 1U);
+    return -1;
+  }
+  if (conn->parked) {
+    conn->outQueued += size;
+    queued = chainSize(&(conn->outq));
+    if (queued > conn->outQueuedPeak)
+      conn->outQueuedPeak = queued;
+  }
+  return 0;
+}
+
+/*
+ * Bytes produced by the private libtelnet state of a peer. Once the peer
+ * reads the shared deflate stream they can only go in as stored blocks
+ * at the next point where the stream has no history.
+ */
+int connSendControl(struct Connection *conn, const uint8_t *data,
+                    size_t size)
+{
+  assert(conn);
+  if ((conn->profile) != ENCODER_COMPRESS2)
+    return connSend(conn, data, size);
+  if ((conn->sock) < 0)
+    return -1;
+  if (chainWrite(&(conn->privq), data, size) < 0)
+    return -1;
+  if (!(conn->syncPending)) {
+    if (encodersSync(conn->encoders, conn->profile, &(conn->syncAt)) < 0)
+      return -1;
+    conn->syncPending = !0;
+  }
   return 0;
 }
 
@@ -182,30 +1008,155 @@ int connSendMsg(struct Connection *conn, const char *msg)
 
 void killConnection(struct Connection *conn)
 {
+  int sock;
+  int live;
+
   assert(conn);
-  D("\r\nClosing connection from [%s] on socket %d.\r\n",
-    conn->host, conn->sock);
-  telnetdStop(conn);
-  if (conn->sock >= 0)
-    close(conn->sock);
+  if (!((conn->sock) < 0))
+    logWrite(LOG_INFO, "Closing connection from [%s] on socket %d"
+             " (%zu bytes queued, %zu peak, %llu dropped, %llu input dropped,"
+             " %llu sends).",
+             conn->host, conn->sock, conn->outQueued, conn->outQueuedPeak,
+             (unsigned long long)(conn->outDropped),
+             (unsigned long long)(conn->inDropped),
+             (unsigned long long)(atomic_load_explicit(&(conn->stats.sends),
+                                                       memory_order_relaxed)));
+  /*
+   * Gone from the metrics dump before the slot gets torn down, under the
+   * lock the dump holds while it copies the address and the socket out.
+   */
+  pthread_mutex_lock(&poolLock);
+  live = atomic_exchange_explicit(&(conn->stats.live), 0,
+                                  memory_order_release);
+  sock = conn->sock;
   conn->sock = -1;
   conn->host[0] = 0;
+  pthread_mutex_unlock(&poolLock);
+  if (live)
+    metricsAdd(METRIC_CLOSED, 1U);
+  if (sock >= 0) {
+    TRACE(TRACE_CLOSE, 0U, sock, 0U, 0U);
+    close(sock);
+  }
 }
 
 void closeConnection(struct Connection *conn)
 {
   assert(conn);
   killConnection(conn);
-  if (conn->rbHostToNet)
-    ringbuf_free(&(conn->rbHostToNet));
-  conn->rbHostToNet = NULL;
-  if (conn->rbNetToHost)
-    ringbuf_free(&(conn->rbNetToHost));
+  /* Not in killConnection(), it may be called from within libtelnet. */
+  telnetdStop(conn);
+  encodersLeave(conn->encoders, conn->profile, &(conn->cursor));
   conn->rbNetToHost = NULL;
-  conn->next = NULL;
-  free(conn);
+  conn->session = NULL;
+  chainFree(&(conn->outq));
+  chainFree(&(conn->privq));
+  if (!((conn->splicePipe[0]) < 0)) {
+    close(conn->splicePipe[0]);
+    close(conn->splicePipe[1]);
+  }
+  conn->splicePipe[0] = -1;
+  conn->splicePipe[1] = -1;
+  conn->spliced = 0U;
+  /* The input ring stays with the slot. */
+  connPut(conn);
 #ifdef MAX_CONN
-  assert(conns > 0U);
-  conns--;
+  assert(atomic_load(&conns) > 0U);
+  atomic_fetch_sub(&conns, 1U);
 #endif
 }
+
+/* What the metrics dump shows of every peer, in the order of ConnStats. */
+#define CONN_METRICS 7U
+
+static const struct
+{
+  const char *name;
+  const char *type;
+} connMetrics[CONN_METRICS] = {
+  { "conn_received_bytes_total", "counter" },
+  { "conn_sent_bytes_total", "counter" },
+  { "conn_sends_total", "counter" },
+  { "conn_queued_bytes", "gauge" },
+  { "conn_lag_bytes", "gauge" },
+  { "conn_dropped_bytes_total", "counter" },
+  { "conn_input_dropped_bytes_total", "counter" }
+};
+
+/* A live peer as seen by the metrics dump. */
+struct ConnSnapshot
+{
+  char host[MAX_HOST_LEN + 1U];
+  int sock;
+  uint64_t values[CONN_METRICS];
+};
+
+/*
+ * Called with poolLock held, so that no slot changes hands meanwhile and
+ * no live peer gets its address or socket cleared. Those of a slot are
+ * only written while it is not live, before newConnection() publishes it.
+ */
+static int connSnapshot(struct Connection *conn, struct ConnSnapshot *snap)
+{
+  struct ConnStats *stats = &(conn->stats);
+
+  if (!atomic_load_explicit(&(stats->live), memory_order_acquire))
+    return 0;
+  memcpy(snap->host, conn->host, sizeof snap->host);
+  snap->host[MAX_HOST_LEN] = 0;
+  snap->sock = conn->sock;
+  snap->values[0] = atomic_load_explicit(&(stats->bytesIn),
+                                         memory_order_relaxed);
+  snap->values[1] = atomic_load_explicit(&(stats->bytesOut),
+                                         memory_order_relaxed);
+  snap->values[2] = atomic_load_explicit(&(stats->sends),
+                                         memory_order_relaxed);
+  snap->values[3] = atomic_load_explicit(&(stats->queued),
+                                         memory_order_relaxed);
+  snap->values[4] = atomic_load_explicit(&(stats->lag),
+                                         memory_order_relaxed);
+  snap->values[5] = atomic_load_explicit(&(stats->dropped),
+                                         memory_order_relaxed);
+  snap->values[6] = atomic_load_explicit(&(stats->inDropped),
+                                         memory_order_relaxed);
+  return !0;
+}
+
+/* Every live peer of every thread, labelled with its address and socket. */
+void connMetricsWrite(FILE *out)
+{
+  struct ConnSnapshot *snaps = NULL;
+  struct ConnBlock *block = NULL;
+  size_t slots = 0U;
+  size_t count = 0U;
+  size_t i;
+  size_t j;
+
+  assert(out);
+  pthread_mutex_lock(&poolLock);
+  for (block = poolBlocks; block; block = block->next)
+    slots += CONN_POOL_BATCH;
+  if (slots)
+    snaps = (struct ConnSnapshot *)(malloc(slots
+                                           * sizeof(struct ConnSnapshot)));
+  for (block = poolBlocks; block && snaps; block = block->next) {
+    for (i = 0U; i < CONN_POOL_BATCH; i++) {
+      if (connSnapshot(&(block->slots[i]), &(snaps[count])))
+        count++;
+    }
+  }
+  pthread_mutex_unlock(&poolLock);
+  if (slots && (!snaps))
+    return;
+  fprintf(out, "# TYPE " METRICS_PREFIX "connections gauge\n");
+  fprintf(out, METRICS_PREFIX "connections %zu\n", count);
+  for (j = 0U; count && (j < CONN_METRICS); j++) {
+    fprintf(out, "# TYPE " METRICS_PREFIX "%s %s\n", connMetrics[j].name,
+            connMetrics[j].type);
+    for (i = 0U; i < count; i++)
+      fprintf(out, METRICS_PREFIX "%s{peer=\"%s\",socket=\"%d\"} %llu\n",
+              connMetrics[j].name, snaps[i].host, snaps[i].sock,
+              (unsigned long long)(snaps[i].values[j]));
+  }
+  free(snaps);
+}
@@ -18,6 +18,8 @@
 
 #include <stddef.h> /* needed by libtelnet.h */
 #include <stdint.h>
+#include <stdio.h>
+#include <stdatomic.h>
 #include <libtelnet.h>
 
 #include <sys/socket.h> /* MSG_NOSIGNAL */
@@ -27,29 +29,168 @@
 #endif
 
 #include "ringbuf.h"
+#include "chain.h"
+#include "reactor.h"
+#include "bcast.h"
+#include "encoder.h"
 
 #define MAX_HOST_LEN 127U
 
+/* Largest piece of data received or spliced in at once. */
+#define CONN_CHUNK_SIZE 512U
+
+/* Default for TELNET_OUTQ_BUDGET. */
+#ifndef OUTQ_CAPACITY
+#define OUTQ_CAPACITY 65536U
+#endif
+
+/* Connection slots allocated at once whenever the pool runs dry. */
+#ifndef CONN_POOL_BATCH
+#define CONN_POOL_BATCH 8U
+#endif
+
+/* Connection slots set up before the first client comes in. */
+#ifndef CONN_POOL_RESERVE
+#ifdef MAX_CONN
+#define CONN_POOL_RESERVE MAX_CONN
+#else
+#define CONN_POOL_RESERVE CONN_POOL_BATCH
+#endif
+#endif
+
+#ifndef LAG_LIMIT
+#define LAG_LIMIT 1048576U
+#endif
+
+/*
+ * How output is pushed out to the peers: as soon as possible with the
+ * Nagle algorithm off (interactive), or in full segments, corked while
+ * a burst goes out (bulk). Either way, output is held back in the log
+ * for up to TELNET_FLUSH_DELAY milliseconds unless TELNET_FLUSH_SIZE
+ * bytes pile up first, so that a program writing a byte at a time does
+ * not cost a segment per byte per peer.
+ */
+enum
+{
+  NET_INTERACTIVE = 0,
+  NET_BULK
+};
+
+#ifndef FLUSH_DELAY_INTERACTIVE
+#define FLUSH_DELAY_INTERACTIVE 2U
+#endif
+
+#ifndef FLUSH_SIZE_INTERACTIVE
+#define FLUSH_SIZE_INTERACTIVE 1024U
+#endif
+
+#ifndef FLUSH_DELAY_BULK
+#define FLUSH_DELAY_BULK 20U
+#endif
+
+#ifndef FLUSH_SIZE_BULK
+#define FLUSH_SIZE_BULK 16384U
+#endif
+
+/* Default for TELNET_NOTSENT_LOWAT with the interactive profile. */
+#ifndef NOTSENT_LOWAT_INTERACTIVE
+#define NOTSENT_LOWAT_INTERACTIVE 16384U
+#endif
+
+struct Session;
+
+/*
+ * What a peer has been up to, kept by the thread serving it and read by
+ * the metrics dump from whichever thread. Only live slots are read.
+ */
+struct ConnStats
+{
+  atomic_int live;
+  atomic_ullong bytesIn;
+  atomic_ullong bytesOut;
+  atomic_ullong sends;
+  atomic_ullong queued;
+  atomic_ullong lag;
+  atomic_ullong dropped;
+  atomic_ullong inDropped;
+};
+
+/* Shared by all the peers of a server. */
+struct Backpressure
+{
+  int input;
+  int output;
+  uint64_t lagLimit;
+  size_t outBudget;
+  int net;
+  uint64_t flushDelay;
+  size_t flushSize;
+  size_t notsentLowat;
+};
+
 struct Connection
 {
   struct Connection *next;
   char host[MAX_HOST_LEN + 1U];
   int sock;
-  ringbuf_t rbHostToNet;
-  ringbuf_t rbNetToHost;
+  int profile;
+  int compress;
+  struct Encoders *encoders;
+  struct BcastCursor cursor;
+  ringbuf_t rbIn;
+  ringbuf_t rbNetToHost; /* not owned, shared by all the server's peers */
+  struct Session *session; /* not owned, the peer's own program if any */
+  int inStalled;
+  const struct Backpressure *backpressure;
+  uint64_t outDropped;
+  uint64_t inDropped;
+  struct Chain outq;
+  struct Chain privq;
+  int splicePipe[2];
+  size_t spliced;
+  int syncPending;
+  uint64_t syncAt;
+  size_t outQueued;
+  size_t outQueuedPeak;
+  uint64_t heldAt;
+  int corked;
+  int parked;
+  int iacOpen; /* the peer got the first half of an escaped IAC only */
+  struct ConnStats stats;
   telnet_t *telnet;
+  struct Watch watch;
+  struct Reactor *reactor; /* set once the peer is served by completions */
+  struct msghdr sendMsg;
+  struct iovec sendIov[CHAIN_IOV_MAX];
+  size_t sendQueued; /* of the send in flight, how much came from outq */
+  size_t sendTotal;
+  int sending;
+  int cancelled; /* the send in flight was asked to go, to drop the lag */
 };
 
-struct Connection *newConnection(const char *host, int sock);
+int connPoolReserve(size_t count);
+void connPoolFree(void);
+size_t connAllocs(void);
+void connMetricsWrite(FILE *out);
+struct Connection *newConnection(const char *host, int sock,
+                                 struct Encoders *encoders,
+                                 ringbuf_t rbNetToHost,
+                                 const struct Backpressure *backpressure);
 int handleConnection(struct Connection *conn, int selected);
+int connRecvDone(struct Connection *conn, const uint8_t *data, int res);
+int connSendDone(struct Connection *conn, int res);
 int connSend(struct Connection *conn, const uint8_t *data, size_t size);
+int connFlush(struct Connection *conn);
+int connSendControl(struct Connection *conn, const uint8_t *data,
+                    size_t size);
 int connSendMsg(struct Connection *conn, const char *msg);
-int connHostToNetGet(struct Connection *conn, uint8_t *data, size_t size);
-int connHostToNetPut(struct Connection *conn, const uint8_t *data, size_t size);
-int connNetToHostGet(struct Connection *conn, uint8_t *data, size_t size);
 int connNetToHostPut(struct Connection *conn, const uint8_t *data, size_t size);
-size_t connHostToNetSize(const struct Connection *conn);
-size_t connNetToHostSize(const struct Connection *conn);
+size_t connOutSize(const struct Connection *conn);
+int connSpliceReady(const struct Connection *conn);
+int connTee(struct Connection *conn, int fd, const uint8_t *data,
+            size_t size);
+uint64_t connLag(const struct Connection *conn);
+uint64_t connFlushAt(const struct Connection *conn);
 void killConnection(struct Connection *conn);
 void closeConnection(struct Connection *conn);
 
@@ -0,0 +1,201 @@
+/*
+ * control.c - Local control socket implementation.
+ *
+ * Written in 2020 by Paul Osmialowski <pawelo@king.net.pl>.
+ *
+ * To the extent possible under law, the author(s) have dedicated all
+ * copyright and related and neighboring rights to this software to
+ * the public domain worldwide. This software is distributed without
+ * any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication
+ * along with this software. If not, see
+ * <http://creativecommons.org/publicdomain/zero/1.0>.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+
+#include "debug.h"
+#include "control.h"
+#include "connection.h" /* MSG_NOSIGNAL */
+#include "reactor.h"
+
+static void controlClose(struct ControlClient *client)
+{
+  struct Control *control = client->control;
+  struct ControlClient **link = &(control->clients);
+
+  while (*link != client)
+    link = &((*link)->next);
+  *link = client->next;
+  control->count--;
+  if (client->watch.handler)
+    reactorDel(control->reactor, &(client->watch));
+  close(client->sock);
+  free(client->text);
+  free(client);
+}
+
+/* Whatever the socket takes now, the reader goes once it has it all. */
+static int controlWrite(struct Watch *watch, uint32_t events, void *ctx)
+{
+  struct ControlClient *client = ((struct ControlClient *)(watch->data));
+  ssize_t ssize;
+
+  assert(client);
+  while ((client->sent) < (client->size)) {
+    ssize = send(client->sock, client->text + client->sent,
+                 (client->size) - (client->sent), MSG_NOSIGNAL);
+    if (ssize < 0) {
+      if (errno == EAGAIN)
+        return 0;
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    client->sent += ssize;
+  }
+  controlClose(client);
+  return 0;
+}
+
+/*
+ * The dump is put together in memory first and goes out as the reader
+ * takes it, so that a reader that does not keep up never holds the loop.
+ */
+static void controlServe(struct Control *control, int sock)
+{
+  struct ControlClient *client = NULL;
+  struct ControlClient *oldest = NULL;
+  FILE *out = NULL;
+
+  client = (struct ControlClient *)(calloc(1U, sizeof(struct ControlClient)));
+  if (!client) {
+    close(sock);
+    return;
+  }
+  client->control = control;
+  client->sock = sock;
+  out = open_memstream(&(client->text), &(client->size));
+  if (out) {
+    control->dump(out, control->arg);
+    if (fclose(out))
+      out = NULL;
+  }
+  if (!out) {
+    close(sock);
+    free(client->text);
+    free(client);
+    return;
+  }
+  if (!((control->count) < CONTROL_CLIENTS)) {
+    for (oldest = control->clients; oldest->next; oldest = oldest->next)
+      ;
+    controlClose(oldest);
+  }
+  client->next = control->clients;
+  control->clients = client;
+  control->count++;
+  client->watch.fd = sock;
+  client->watch.events = EPOLLOUT;
+  client->watch.handler = controlWrite;
+  client->watch.data = client;
+  if (reactorAdd(control->reactor, &(client->watch)) < 0) {
+    client->watch.handler = NULL;
+    controlClose(client);
+  }
+}
+
+static int controlAccept(struct Watch *watch, uint32_t events, void *ctx)
+{
+  struct Control *control = ((struct Control *)(watch->data));
+  int sock;
+
+  assert(control);
+  sock = accept4(control->sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (sock < 0)
+    return ((errno == EINTR) || (errno == ECONNABORTED)) ? 1 : 0;
+  controlServe(control, sock);
+  return 1;
+}
+
+/* A stale socket left behind by an earlier run is replaced. */
+int controlInit(struct Control *control, const char *path,
+                struct Reactor *reactor, ControlDump dump, void *arg)
+{
+  struct sockaddr_un sa;
+
+  assert(control);
+  assert(path);
+  assert(reactor);
+  assert(dump);
+  memset(control, 0, sizeof(struct Control));
+  control->sock = -1;
+  control->reactor = reactor;
+  control->clients = NULL;
+  control->count = 0U;
+  control->dump = dump;
+  control->arg = arg;
+  if (!(strlen(path) < sizeof control->path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  memset(&sa, 0, sizeof sa);
+  sa.sun_family = AF_UNIX;
+  snprintf(sa.sun_path, sizeof sa.sun_path, "%s", path);
+  control->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                         0);
+  if ((control->sock) < 0)
+    return -1;
+  unlink(path);
+  if ((bind(control->sock, (struct sockaddr *)(&sa), sizeof sa) < 0)
+      || (listen(control->sock, 8) < 0)) {
+    controlStop(control, reactor);
+    return -1;
+  }
+  snprintf(control->path, sizeof control->path, "%s", path);
+  /* The peer addresses are nobody else's business. */
+  chmod(path, S_IRUSR | S_IWUSR);
+  control->watch.fd = control->sock;
+  control->watch.events = EPOLLIN;
+  control->watch.handler = controlAccept;
+  control->watch.data = control;
+  if (reactorAdd(reactor, &(control->watch)) < 0) {
+    control->watch.handler = NULL;
+    controlStop(control, reactor);
+    return -1;
+  }
+  D("\r\nControl socket at %s.\r\n", path);
+  return 0;
+}
+
+void controlStop(struct Control *control, struct Reactor *reactor)
+{
+  assert(control);
+  assert(reactor);
+  while (control->clients)
+    controlClose(control->clients);
+  if (control->watch.handler)
+    reactorDel(reactor, &(control->watch));
+  control->watch.handler = NULL;
+  if (!((control->sock) < 0))
+    close(control->sock);
+  control->sock = -1;
+  if (control->path[0])
+    unlink(control->path);
+  control->path[0] = 0;
+}
@@ -0,0 +1,66 @@
+/*
+ * control.h - Local control socket interface.
+ *
+ * Written in 2020 by Paul Osmialowski <pawelo@king.net.pl>.
+ *
+ * To the extent possible under law, the author(s) have dedicated all
+ * copyright and related and neighboring rights to this software to
+ * the public domain worldwide. This software is distributed without
+ * any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication
+ * along with this software. If not, see
+ * <http://creativecommons.org/publicdomain/zero/1.0>.
+ */
+
+#ifndef __CONTROL_H
+#define __CONTROL_H
+
+#include <stdio.h>
+#include <sys/un.h>
+
+#include "reactor.h"
+
+/* Readers served at once, the oldest one is let go to make room. */
+#ifndef CONTROL_CLIENTS
+#define CONTROL_CLIENTS 8U
+#endif
+
+typedef void (*ControlDump)(FILE *out, void *arg);
+
+struct Control;
+
+/* A reader being handed its dump, as far as its socket takes it. */
+struct ControlClient
+{
+  struct ControlClient *next;
+  struct Control *control;
+  int sock;
+  char *text;
+  size_t size;
+  size_t sent;
+  struct Watch watch;
+};
+
+/*
+ * A Unix domain socket that hands whoever connects to it a dump of the
+ * metrics and hangs up, so that e.g. `socat - UNIX-CONNECT:<path>` is
+ * all it takes to have a look.
+ */
+struct Control
+{
+  int sock;
+  char path[sizeof(((struct sockaddr_un *)(0))->sun_path)];
+  struct Watch watch;
+  struct Reactor *reactor;
+  struct ControlClient *clients; /* the newest first */
+  size_t count;
+  ControlDump dump;
+  void *arg;
+};
+
+int controlInit(struct Control *control, const char *path,
+                struct Reactor *reactor, ControlDump dump, void *arg);
+void controlStop(struct Control *control, struct Reactor *reactor);
+
+#endif /* __CONTROL_H */
@@ -18,9 +18,9 @@
 #define __DEBUG_H
 
 #ifdef DEBUG
-#include <stdio.h>
+#include "log.h"
 
-#define D(...) fprintf(stderr, __VA_ARGS__)
+#define D(...) logWrite(LOG_DEBUG, __VA_ARGS__)
 #else
 #define D(...)
 #endif
@@ -0,0 +1,271 @@
+/*
+ * encoder.c - Shared telnet output encoders implementation.
+ *
+ * Written in 2020 by Paul Osmialowski <pawelo@king.net.pl>.
+ *
+ * To the extent possible under law, the author(s) have dedicated all
+ * copyright and related and neighboring rights to this software to
+ * the public domain worldwide. This software is distributed without
+ * any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication
+ * along with this software. If not, see
+ * <http://creativecommons.org/publicdomain/zero/1.0>.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <zlib.h>
+
+#include "bcast.h"
+#include "encoder.h"
+#include "trace.h"
+
+#define IAC 255U
+
+static int encodePlain(struct Encoder *enc, const uint8_t *data, size_t size)
+{
+  static const uint8_t iac[] = { IAC, IAC };
+  const uint8_t *found = NULL;
+  size_t n;
+
+  while (size) {
+    found = (const uint8_t *)(memchr(data, IAC, size));
+    n = found ? ((size_t)(found - data)) : size;
+    if (bcastWrite(&(enc->log), data, n) < 0)
+      return -1;
+    data += n;
+    size -= n;
+    if (found) {
+      if (bcastWrite(&(enc->log), iac, sizeof iac) < 0)
+        return -1;
+      data++;
+      size--;
+    }
+  }
+  return 0;
+}
+
+static int encodeDeflate(struct Encoder *enc, const uint8_t *data,
+                         size_t size, int flush)
+{
+  uint8_t *out = NULL;
+  size_t avail;
+  int ret;
+
+  enc->zs.next_in = (Bytef *)(data);
+  enc->zs.avail_in = size;
+  do {
+    avail = bcastReserve(&(enc->log), &out);
+    if (!avail)
+      return -1;
+    enc->zs.next_out = out;
+    enc->zs.avail_out = avail;
+    ret = deflate(&(enc->zs), flush);
+    if ((ret != Z_OK) && (ret != Z_BUF_ERROR))
+      return -1;
+    bcastCommit(&(enc->log), avail - (enc->zs.avail_out));
+  } while ((enc->zs.avail_in) || (!(enc->zs.avail_out)));
+  return 0;
+}
+
+static int encoderEncode(struct Encoder *enc, int profile,
+                         const uint8_t *data, size_t size)
+{
+  switch (profile) {
+  case ENCODER_PLAIN:
+    return encodePlain(enc, data, size);
+  case ENCODER_COMPRESS2:
+    enc->pending = !0;
+    return encodeDeflate(enc, data, size, Z_NO_FLUSH);
+  default:
+    assert(0);
+  }
+  return -1;
+}
+
+static int encoderFlush(struct Encoder *enc, int profile)
+{
+  if (!(enc->pending))
+    return 0;
+  enc->pending = 0;
+  switch (profile) {
+  case ENCODER_COMPRESS2:
+    return encodeDeflate(enc, NULL, 0U, Z_SYNC_FLUSH);
+  default:
+    ;
+  }
+  return 0;
+}
+
+/*
+ * A profile is worth encoding as long as it or any profile fed from it
+ * has members.
+ */
+static int encoderWanted(const struct Encoders *encoders, int profile)
+{
+  int i;
+
+  for (i = profile; i < ENCODER_MAX; i++) {
+    if (encoders->enc[i].members)
+      return !0;
+  }
+  return 0;
+}
+
+int encodersInit(struct Encoders *encoders)
+{
+  int i;
+
+  assert(encoders);
+  memset(encoders, 0, sizeof(struct Encoders));
+  if (bcastInit(&(encoders->enc[ENCODER_RAW].log)) < 0)
+    return -1;
+  for (i = ENCODER_RAW + 1; i < ENCODER_MAX; i++) {
+    if (bcastInit(&(encoders->enc[i].log)) < 0) {
+      encodersStop(encoders);
+      return -1;
+    }
+    bcastJoin(&(encoders->enc[i - 1].log), &(encoders->enc[i].source));
+  }
+  if (deflateInit2(&(encoders->enc[ENCODER_COMPRESS2].zs),
+                   Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    encodersStop(encoders);
+    return -1;
+  }
+  encoders->enc[ENCODER_COMPRESS2].pending = 0;
+  encoders->enc[ENCODER_COMPRESS2].synced = 0U;
+  return 0;
+}
+
+void encodersStop(struct Encoders *encoders)
+{
+  int i;
+
+  assert(encoders);
+  if (encoders->enc[ENCODER_COMPRESS2].zs.state)
+    deflateEnd(&(encoders->enc[ENCODER_COMPRESS2].zs));
+  for (i = ENCODER_MAX - 1; i > ENCODER_RAW; i--) {
+    bcastLeave(&(encoders->enc[i].source));
+    bcastFree(&(encoders->enc[i].log));
+  }
+  bcastFree(&(encoders->enc[ENCODER_RAW].log));
+}
+
+int encodersRun(struct Encoders *encoders)
+{
+  struct Encoder *enc = NULL;
+  const uint8_t *data = NULL;
+  size_t size;
+  int fed;
+  int i;
+
+  assert(encoders);
+  for (i = ENCODER_RAW + 1; i < ENCODER_MAX; i++) {
+    enc = &(encoders->enc[i]);
+    fed = 0;
+    while ((size = bcastPeek(&(enc->source), &data)) > 0U) {
+      /* Nobody to encode for, just keep up with the host output. */
+      if (encoderWanted(encoders, i)) {
+        fed = !0;
+        if (encoderEncode(enc, i, data, size) < 0)
+          return -1;
+      }
+      bcastConsume(&(enc->source), size);
+    }
+    if (encoderFlush(enc, i) < 0)
+      return -1;
+    enc->boundary = enc->log.offset;
+    if (fed)
+      TRACE(TRACE_ENCODE, i, -1, enc->source.offset, enc->log.offset);
+  }
+  return 0;
+}
+
+int encodersSynced(const struct Encoders *encoders)
+{
+  int i;
+
+  assert(encoders);
+  for (i = ENCODER_RAW + 1; i < ENCODER_MAX; i++) {
+    if (bcastLag(&(encoders->enc[i].source)))
+      return 0;
+  }
+  return !0;
+}
+
+/*
+ * Get an offset in the log of a profile where the stream can be picked
+ * up without any history, forcing a Z_FULL_FLUSH when needed.
+ */
+int encodersSync(struct Encoders *encoders, int profile, uint64_t *offset)
+{
+  struct Encoder *enc = NULL;
+
+  assert(encoders);
+  assert(offset);
+  assert((profile >= 0) && (profile < ENCODER_MAX));
+  enc = &(encoders->enc[profile]);
+  if ((profile == ENCODER_COMPRESS2)
+      && ((enc->synced) != (enc->log.offset))) {
+    enc->pending = 0;
+    if (encodeDeflate(enc, NULL, 0U, Z_FULL_FLUSH) < 0)
+      return -1;
+    enc->synced = enc->log.offset;
+  }
+  *offset = enc->log.offset;
+  return 0;
+}
+
+/*
+ * An offset in the log of a profile no escape sequence straddles, as an
+ * encoder that fails half way through a batch may leave one cut short.
+ */
+uint64_t encodersBoundary(const struct Encoders *encoders, int profile)
+{
+  assert(encoders);
+  assert((profile >= 0) && (profile < ENCODER_MAX));
+  return encoders->enc[profile].boundary;
+}
+
+void encodersStored(uint8_t *header, size_t size)
+{
+  assert(header);
+  assert(!(size > ENCODER_STORED_MAX));
+  header[0] = 0U; /* BFINAL = 0, BTYPE = 00, padded to a byte */
+  header[1] = size & 0xffU;
+  header[2] = (size >> 8) & 0xffU;
+  header[3] = (~size) & 0xffU;
+  header[4] = ((~size) >> 8) & 0xffU;
+}
+
+struct Bcast *encodersLog(struct Encoders *encoders, int profile)
+{
+  assert(encoders);
+  assert((profile >= 0) && (profile < ENCODER_MAX));
+  return &(encoders->enc[profile].log);
+}
+
+void encodersJoin(struct Encoders *encoders, int profile,
+                  struct BcastCursor *cursor)
+{
+  assert(encoders);
+  assert((profile >= 0) && (profile < ENCODER_MAX));
+  bcastJoin(&(encoders->enc[profile].log), cursor);
+  encoders->enc[profile].members++;
+}
+
+void encodersLeave(struct Encoders *encoders, int profile,
+                   struct BcastCursor *cursor)
+{
+  assert(encoders);
+  assert((profile >= 0) && (profile < ENCODER_MAX));
+  if (!(cursor->seg))
+    return;
+  bcastLeave(cursor);
+  assert(encoders->enc[profile].members > 0U);
+  encoders->enc[profile].members--;
+}
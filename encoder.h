@@ -0,0 +1,90 @@
+/*
+ * encoder.h - Shared telnet output encoders interface.
+ *
+ * Written in 2020 by Paul Osmialowski <pawelo@king.net.pl>.
+ *
+ * To the extent possible under law, the author(s) have dedicated all
+ * copyright and related and neighboring rights to this software to
+ * the public domain worldwide. This software is distributed without
+ * any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication
+ * along with this software. If not, see
+ * <http://creativecommons.org/publicdomain/zero/1.0>.
+ */
+
+#ifndef __ENCODER_H
+#define __ENCODER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <zlib.h>
+
+#include "bcast.h"
+
+/*
+ * Output profiles. Connections that negotiated the same options see
+ * the same bytes on the wire, so the host output is encoded once per
+ * profile and every member of a profile reads the encoded log.
+ *
+ * Each profile is fed by the one before it: ENCODER_RAW is the host
+ * output as it is, ENCODER_PLAIN is the same with IAC bytes escaped
+ * (which is all telnet_send() does while no compression is active)
+ * and ENCODER_COMPRESS2 is the plain stream run through a single
+ * deflate stream shared by all MCCP2 peers.
+ */
+enum
+{
+  ENCODER_RAW = 0,
+  ENCODER_PLAIN,
+  ENCODER_COMPRESS2,
+  ENCODER_MAX
+};
+
+/*
+ * The shared deflate stream is headerless, every peer joining it gets
+ * this zlib header of its own, followed by the stream taken from a
+ * Z_FULL_FLUSH point on.
+ */
+#define ENCODER_ZLIB_HEADER "\x78\x9c"
+#define ENCODER_ZLIB_HEADER_LEN 2U
+
+/*
+ * A non-final stored deflate block header, to be followed by the
+ * 16-bit length and its complement. Private bytes are spliced into
+ * the shared stream at Z_FULL_FLUSH points as such blocks.
+ */
+#define ENCODER_STORED_HEADER_LEN 5U
+#define ENCODER_STORED_MAX 65535U
+
+struct Encoder
+{
+  struct Bcast log;
+  struct BcastCursor source;
+  size_t members;
+  int pending;
+  uint64_t synced;
+  uint64_t boundary; /* end of the last batch encoded in full */
+  z_stream zs;
+};
+
+struct Encoders
+{
+  struct Encoder enc[ENCODER_MAX];
+};
+
+int encodersInit(struct Encoders *encoders);
+void encodersStop(struct Encoders *encoders);
+int encodersRun(struct Encoders *encoders);
+int encodersSynced(const struct Encoders *encoders);
+int encodersSync(struct Encoders *encoders, int profile, uint64_t *offset);
+uint64_t encodersBoundary(const struct Encoders *encoders, int profile);
+void encodersStored(uint8_t *header, size_t size);
+struct Bcast *encodersLog(struct Encoders *encoders, int profile);
+void encodersJoin(struct Encoders *encoders, int profile,
+                  struct BcastCursor *cursor);
+void encodersLeave(struct Encoders *encoders, int profile,
+                   struct BcastCursor *cursor);
+
+#endif /* __ENCODER_H */
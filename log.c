@@ -0,0 +1,423 @@
+/*
+ * log.c - Asynchronous logging implementation.
+ *
+ * Written in 2020 by Paul Osmialowski <pawelo@king.net.pl>.
+ *
+ * To the extent possible under law, the author(s) have dedicated all
+ * copyright and related and neighboring rights to this software to
+ * the public domain worldwide. This software is distributed without
+ * any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication
+ * along with this software. If not, see
+ * <http://creativecommons.org/publicdomain/zero/1.0>.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <assert.h>
+#include <time.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+
+#include "log.h"
+#include "config.h"
+#include "metrics.h"
+
+/* How often the writer owns up to records dropped, at most. */
+#define LOG_REPORT_MS 1000
+
+/* Room for a whole line: time stamp, level, message and line end. */
+#define LOG_OUT_MAX (LOG_LINE_MAX + 64U)
+
+#ifdef DEBUG
+#define LOG_LEVEL LOG_DEBUG
+#else
+#define LOG_LEVEL LOG_WARN
+#endif
+
+/*
+ * A bounded queue any thread can put records in without locking, each
+ * cell carrying a sequence number that tells whose turn it is: the
+ * producer that claimed the position, or the writer thread once the
+ * record is complete. A thread that finds the queue full drops its
+ * record and counts it rather than wait.
+ */
+struct LogCell
+{
+  atomic_size_t seq;
+  int level;
+  struct timespec time;
+  char text[LOG_LINE_MAX];
+  char *block; /* written out as it is instead, see logBlock() */
+  size_t blockSize;
+};
+
+static const char *const levels[LOG_LEVELS + 1] = {
+  "error", "warn", "info", "debug", NULL
+};
+
+static struct LogCell cells[LOG_QUEUE];
+static atomic_size_t enqueuePos = 0U;
+static size_t dequeuePos = 0U;
+static int logLevel = LOG_LEVEL;
+static size_t logRate = LOG_RATE;
+static const char *eol = "\n";
+static atomic_int running = 0;
+static atomic_int idle = 0;
+static atomic_int stop = 0;
+static atomic_ullong window = 0U;
+static atomic_size_t windowCount = 0U;
+static atomic_ullong dropped = 0U;
+static int wakefd = -1;
+static pthread_t writer;
+
+/* Whatever the writer thread has to say, it can wait for the descriptor. */
+static void logOut(const char *data, size_t size)
+{
+  struct pollfd pfd;
+  ssize_t ssize;
+
+  pfd.fd = STDERR_FILENO;
+  pfd.events = POLLOUT;
+  while (size) {
+    ssize = write(STDERR_FILENO, data, size);
+    if (ssize < 0) {
+      if (errno == EAGAIN) {
+        poll(&pfd, 1U, -1);
+        continue;
+      }
+      if (errno == EINTR)
+        continue;
+      return;
+    }
+    data += ssize;
+    size -= ssize;
+  }
+}
+
+/* The message goes without whatever line ends it came with. */
+static size_t logFormat(char *out, int level, const struct timespec *time,
+                        const char *text)
+{
+  struct tm tm;
+  size_t len;
+  int n;
+
+  while ((*text == '\r') || (*text == '\n'))
+    text++;
+  len = strlen(text);
+  while (len && ((text[len - 1U] == '\r') || (text[len - 1U] == '\n')))
+    len--;
+  localtime_r(&(time->tv_sec), &tm);
+  n = snprintf(out, LOG_OUT_MAX,
+               "%04d-%02d-%02d %02d:%02d:%02d.%03ld %s: %.*s%s",
+               tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour,
+               tm.tm_min, tm.tm_sec, (time->tv_nsec) / 1000000L,
+               levels[level], (int)(len), text, eol);
+  if (n < 0)
+    return 0U;
+  return (((size_t)(n)) < LOG_OUT_MAX) ? ((size_t)(n)) : (LOG_OUT_MAX - 1U);
+}
+
+/* One record to be written out, or NULL when there are none yet. */
+static struct LogCell *logPeek(void)
+{
+  struct LogCell *cell = &(cells[dequeuePos & (LOG_QUEUE - 1U)]);
+
+  if (atomic_load_explicit(&(cell->seq), memory_order_acquire)
+      != (dequeuePos + 1U))
+    return NULL;
+  return cell;
+}
+
+static void logRelease(struct LogCell *cell)
+{
+  atomic_store_explicit(&(cell->seq), dequeuePos + LOG_QUEUE,
+                        memory_order_release);
+  dequeuePos++;
+}
+
+/* Everything queued goes out in as few writes as it takes. */
+static void logDrain(char *buf, size_t size)
+{
+  struct LogCell *cell = NULL;
+  size_t used = 0U;
+
+  while ((cell = logPeek())) {
+    if (cell->block) {
+      logOut(buf, used);
+      used = 0U;
+      logOut(cell->block, cell->blockSize);
+      free(cell->block);
+      cell->block = NULL;
+      logRelease(cell);
+      continue;
+    }
+    if ((size - used) < LOG_OUT_MAX) {
+      logOut(buf, used);
+      used = 0U;
+    }
+    used += logFormat(buf + used, cell->level, &(cell->time), cell->text);
+    logRelease(cell);
+  }
+  logOut(buf, used);
+}
+
+static void logReport(uint64_t *reported)
+{
+  struct timespec ts;
+  char line[LOG_OUT_MAX];
+  char text[64];
+  uint64_t now = atomic_load(&dropped);
+
+  if (now == *reported)
+    return;
+  snprintf(text, sizeof text, "%llu log records dropped.",
+           (unsigned long long)(now - *reported));
+  *reported = now;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  logOut(line, logFormat(line, LOG_WARN, &ts, text));
+}
+
+/*
+ * The writer sleeps until a producer kicks it, which only happens when
+ * it said it is going to sleep, so a busy log costs no syscalls at all
+ * on the threads that write to it.
+ */
+static void *logMain(void *arg)
+{
+  struct pollfd pfd;
+  uint64_t reported = 0U;
+  uint64_t count;
+  char *buf = (char *)(arg);
+
+  pfd.fd = wakefd;
+  pfd.events = POLLIN;
+  for (;;) {
+    logDrain(buf, LOG_QUEUE * LOG_OUT_MAX);
+    logReport(&reported);
+    if (atomic_load(&stop))
+      break;
+    atomic_store(&idle, !0);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (logPeek() || atomic_load(&stop)) {
+      atomic_store(&idle, 0);
+      continue;
+    }
+    if (poll(&pfd, 1U, LOG_REPORT_MS) > 0) {
+      while ((read(wakefd, &count, sizeof count) < 0) && (errno == EINTR))
+        ;
+    }
+  }
+  logDrain(buf, LOG_QUEUE * LOG_OUT_MAX);
+  logReport(&reported);
+  free(buf);
+  return NULL;
+}
+
+static void logKick(void)
+{
+  uint64_t one = 1U;
+
+  atomic_thread_fence(memory_order_seq_cst);
+  if (!atomic_exchange(&idle, 0))
+    return;
+  while ((write(wakefd, &one, sizeof one) < 0) && (errno == EINTR))
+    ;
+}
+
+/*
+ * Until the writer thread is up (and once it is gone), records are
+ * written out right away. To be called before any other thread starts.
+ */
+int logInit(void)
+{
+  sigset_t all;
+  sigset_t old;
+  char *buf = NULL;
+  size_t i;
+  int ret;
+
+  logLevel = configChoice("TELNET_LOG_LEVEL", levels, LOG_LEVEL);
+  logRate = configSize("TELNET_LOG_RATE", LOG_RATE);
+  eol = isatty(STDERR_FILENO) ? "\r\n" : "\n";
+  for (i = 0U; i < LOG_QUEUE; i++) {
+    atomic_init(&(cells[i].seq), i);
+    cells[i].block = NULL;
+  }
+  atomic_store(&enqueuePos, 0U);
+  dequeuePos = 0U;
+  buf = (char *)(malloc(LOG_QUEUE * LOG_OUT_MAX));
+  if (!buf)
+    return -1;
+  wakefd = eventfd(0U, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (wakefd < 0) {
+    free(buf);
+    return -1;
+  }
+  /* Signals are for the event loop thread only. */
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  ret = pthread_create(&writer, NULL, logMain, buf);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (ret) {
+    close(wakefd);
+    wakefd = -1;
+    free(buf);
+    return -1;
+  }
+  atomic_store(&running, !0);
+  return 0;
+}
+
+/* Once every other thread is gone, whatever is still queued goes out. */
+void logStop(void)
+{
+  uint64_t one = 1U;
+
+  if (!atomic_load(&running))
+    return;
+  atomic_store(&running, 0);
+  atomic_store(&stop, !0);
+  while ((write(wakefd, &one, sizeof one) < 0) && (errno == EINTR))
+    ;
+  pthread_join(writer, NULL);
+  close(wakefd);
+  wakefd = -1;
+}
+
+/* A window of a second, with a budget of logRate records. */
+static int logThrottled(void)
+{
+  struct timespec ts;
+  uint64_t seen;
+
+  if (!logRate)
+    return 0;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  seen = atomic_load_explicit(&window, memory_order_relaxed);
+  if ((seen != ((uint64_t)(ts.tv_sec)))
+      && atomic_compare_exchange_strong(&window, &seen,
+                                        (uint64_t)(ts.tv_sec)))
+    atomic_store_explicit(&windowCount, 0U, memory_order_relaxed);
+  return atomic_fetch_add_explicit(&windowCount, 1U, memory_order_relaxed)
+         >= logRate;
+}
+
+static void logDrop(void)
+{
+  atomic_fetch_add_explicit(&dropped, 1U, memory_order_relaxed);
+  metricsAdd(METRIC_LOG_DROPPED, 1U);
+}
+
+/* Claim the next free cell, NULL when the queue is full. */
+static struct LogCell *logClaim(size_t *pos)
+{
+  struct LogCell *cell = NULL;
+  size_t seq;
+
+  *pos = atomic_load_explicit(&enqueuePos, memory_order_relaxed);
+  for (;;) {
+    cell = &(cells[(*pos) & (LOG_QUEUE - 1U)]);
+    seq = atomic_load_explicit(&(cell->seq), memory_order_acquire);
+    if (seq == (*pos)) {
+      if (atomic_compare_exchange_weak_explicit(&enqueuePos, pos,
+                                                (*pos) + 1U,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed))
+        return cell;
+    } else if (seq < (*pos)) {
+      return NULL;
+    } else {
+      *pos = atomic_load_explicit(&enqueuePos, memory_order_relaxed);
+    }
+  }
+}
+
+/*
+ * Errors always get through as long as there is room in the queue, the
+ * rest only within the rate limit.
+ */
+void logWrite(int level, const char *fmt, ...)
+{
+  struct LogCell *cell = NULL;
+  struct timespec ts;
+  char text[LOG_LINE_MAX];
+  char line[LOG_OUT_MAX];
+  va_list ap;
+  size_t pos;
+
+  assert((level >= 0) && (level < LOG_LEVELS));
+  assert(fmt);
+  if (level > logLevel)
+    return;
+  if (!atomic_load_explicit(&running, memory_order_acquire)) {
+    va_start(ap, fmt);
+    vsnprintf(text, sizeof text, fmt, ap);
+    va_end(ap);
+    clock_gettime(CLOCK_REALTIME, &ts);
+    logOut(line, logFormat(line, level, &ts, text));
+    return;
+  }
+  if ((level > LOG_ERROR) && logThrottled()) {
+    logDrop();
+    return;
+  }
+  cell = logClaim(&pos);
+  if (!cell) {
+    logDrop();
+    return;
+  }
+  cell->level = level;
+  clock_gettime(CLOCK_REALTIME, &(cell->time));
+  va_start(ap, fmt);
+  vsnprintf(cell->text, sizeof cell->text, fmt, ap);
+  va_end(ap);
+  atomic_store_explicit(&(cell->seq), pos + 1U, memory_order_release);
+  logKick();
+}
+
+/*
+ * Hand a block of text (allocated with malloc(), e.g. by a memstream)
+ * over to the writer thread, to go out whole and in order with the
+ * records, with no time stamp or level. The log frees it.
+ */
+void logBlock(char *block, size_t size)
+{
+  struct LogCell *cell = NULL;
+  size_t pos;
+
+  assert(block);
+  if (!atomic_load_explicit(&running, memory_order_acquire)) {
+    logOut(block, size);
+    free(block);
+    return;
+  }
+  cell = logClaim(&pos);
+  if (!cell) {
+    logDrop();
+    free(block);
+    return;
+  }
+  cell->block = block;
+  cell->blockSize = size;
+  atomic_store_explicit(&(cell->seq), pos + 1U, memory_order_release);
+  logKick();
+}
+
+uint64_t logDropped(void)
+{
+  return atomic_load(&dropped);
+}
@@ -0,0 +1,54 @@
+/*
+ * log.h - Asynchronous logging interface.
+ *
+ * Written in 2020 by Paul Osmialowski <pawelo@king.net.pl>.
+ *
+ * To the extent possible under law, the author(s) have dedicated all
+ * copyright and related and neighboring rights to this software to
+ * the public domain worldwide. This software is distributed without
+ * any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication
+ * along with this software. If not, see
+ * <http://creativecommons.org/publicdomain/zero/1.0>.
+ */
+
+#ifndef __LOG_H
+#define __LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Records waiting for the writer thread, a power of two. */
+#ifndef LOG_QUEUE
+#define LOG_QUEUE 1024U
+#endif
+
+/* Longest message kept, anything past it is cut off. */
+#ifndef LOG_LINE_MAX
+#define LOG_LINE_MAX 256U
+#endif
+
+/* Default for TELNET_LOG_RATE, records let through a second. */
+#ifndef LOG_RATE
+#define LOG_RATE 1000U
+#endif
+
+/* In the order of TELNET_LOG_LEVEL choices, each includes the ones above. */
+enum
+{
+  LOG_ERROR = 0,
+  LOG_WARN,
+  LOG_INFO,
+  LOG_DEBUG,
+  LOG_LEVELS
+};
+
+int logInit(void);
+void logStop(void);
+void logWrite(int level, const char *fmt, ...)
+  __attribute__((format(printf, 2, 3)));
+void logBlock(char *block, size_t size);
+uint64_t logDropped(void);
+
+#endif /* __LOG_H */
@@ -0,0 +1,91 @@
+/*
+ * mailbox.c - Lock-free single-producer single-consumer queue
+ *             implementation.
+ *
+ * Written in 2020 by Paul Osmialowski <pawelo@king.net.pl>.
+ *
+ * To the extent possible under law, the author(s) have dedicated all
+ * copyright and related and neighboring rights to this software to
+ * the public domain worldwide. This software is distributed without
+ * any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication
+ * along with this software. If not, see
+ * <http://creativecommons.org/publicdomain/zero/1.0>.
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <assert.h>
+
+#include "mailbox.h"
+
+int mailboxInit(struct Mailbox *mailbox, size_t capacity)
+{
+  size_t size = 1U;
+
+  assert(mailbox);
+  assert(capacity > 0U);
+  while (size < capacity)
+    size <<= 1;
+  mailbox->slots = (void **)(calloc(size, sizeof(void *)));
+  if (!(mailbox->slots))
+    return -1;
+  mailbox->mask = size - 1U;
+  atomic_init(&(mailbox->head), 0U);
+  atomic_init(&(mailbox->tail), 0U);
+  return 0;
+}
+
+void mailboxFree(struct Mailbox *mailbox)
+{
+  assert(mailbox);
+  free(mailbox->slots);
+  mailbox->slots = NULL;
+}
+
+int mailboxPush(struct Mailbox *mailbox, void *msg)
+{
+  size_t head;
+  size_t tail;
+
+  assert(mailbox);
+  assert(msg);
+  head = atomic_load_explicit(&(mailbox->head), memory_order_relaxed);
+  tail = atomic_load_explicit(&(mailbox->tail), memory_order_acquire);
+  if ((head - tail) > (mailbox->mask))
+    return -1;
+  mailbox->slots[head & (mailbox->mask)] = msg;
+  atomic_store_explicit(&(mailbox->head), head + 1U, memory_order_release);
+  return 0;
+}
+
+void *mailboxPeek(struct Mailbox *mailbox)
+{
+  size_t head;
+  size_t tail;
+
+  assert(mailbox);
+  tail = atomic_load_explicit(&(mailbox->tail), memory_order_relaxed);
+  head = atomic_load_explicit(&(mailbox->head), memory_order_acquire);
+  if (head == tail)
+    return NULL;
+  return mailbox->slots[tail & (mailbox->mask)];
+}
+
+void *mailboxPop(struct Mailbox *mailbox)
+{
+  size_t head;
+  size_t tail;
+  void *msg = NULL;
+
+  assert(mailbox);
+  tail = atomic_load_explicit(&(mailbox->tail), memory_order_relaxed);
+  head = atomic_load_explicit(&(mailbox->head), memory_order_acquire);
+  if (head == tail)
+    return NULL;
+  msg = mailbox->slots[tail & (mailbox->mask)];
+  atomic_store_explicit(&(mailbox->tail), tail + 1U, memory_order_release);
+  return msg;
+}
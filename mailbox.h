@@ -0,0 +1,43 @@
+/*
+ * mailbox.h - Lock-free single-producer single-consumer queue interface.
+ *
+ * Written in 2020 by Paul Osmialowski <pawelo@king.net.pl>.
+ *
+ * To the extent possible under law, the author(s) have dedicated all
+ * copyright and related and neighboring rights to this software to
+ * the public domain worldwide. This software is distributed without
+ * any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication
+ * along with this software. If not, see
+ * <http://creativecommons.org/publicdomain/zero/1.0>.
+ */
+
+#ifndef __MAILBOX_H
+#define __MAILBOX_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+#define MAILBOX_CACHELINE 64U
+
+/*
+ * A bounded queue of pointers passed from exactly one producer thread
+ * to exactly one consumer thread. The indices only ever grow, each
+ * one is written by one side only and lives on its own cache line.
+ */
+struct Mailbox
+{
+  _Alignas(MAILBOX_CACHELINE) atomic_size_t head;
+  _Alignas(MAILBOX_CACHELINE) atomic_size_t tail;
+  _Alignas(MAILBOX_CACHELINE) size_t mask;
+  void **slots;
+};
+
+int mailboxInit(struct Mailbox *mailbox, size_t capacity);
+void mailboxFree(struct Mailbox *mailbox);
+int mailboxPush(struct Mailbox *mailbox, void *msg);
+void *mailboxPeek(struct Mailbox *mailbox);
+void *mailboxPop(struct Mailbox *mailbox);
+
+#endif /* __MAILBOX_H */
@@ -20,19 +20,66 @@
 #include <string.h>
 #include <signal.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/types.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <unistd.h>
 
 #include "debug.h"
+#include "log.h"
+#include "config.h"
 #include "server.h"
+#include "connection.h"
+#include "reactor.h"
+#include "worker.h"
 #include "rawtty.h"
 #include "spawn.h"
+#include "telnetd.h"
+#include "slab.h"
+#include "session.h"
+#include "metrics.h"
+#include "control.h"
+#include "trace.h"
 
 #define FAIL -1
 
+/* Defaults for --self-bench. */
+#define SELF_BENCH_VIEWERS 4U
+#define SELF_BENCH_SECONDS 5U
+
+/* Host output made up at once, a pipe's worth as if read from a program. */
+#define SELF_BENCH_CHUNK 65536U
+
+/*
+ * Default for TELNET_DRAIN_TIMEOUT, milliseconds given to the clients to
+ * take in what is due for them once the program is gone.
+ */
+#ifndef DRAIN_TIMEOUT
+#define DRAIN_TIMEOUT 10000U
+#endif
+
+/* How often to look, workers do not tell when they are done. */
+#define DRAIN_CHECK 10
+
+struct Host
+{
+  int fdin;
+  int fdout;
+  int isRaw;
+  int done;
+  int draining; /* the program is gone, only its output is still read */
+  struct Watch in;
+  struct Watch out;
+  struct ReactorOut toHost; /* with completions, input on its way */
+};
+
 static volatile int quit = 0;
+static volatile int ended = 0;
+static volatile int dump = 0;
+static volatile int snapshot = 0;
 
 static void sigHandler(int sig)
 {
@@ -40,153 +87,712 @@ static void sigHandler(int sig)
   quit = !0;
 }
 
+/*
+ * With sessions, a program going away only ends the session it had.
+ * Otherwise, what it wrote last still goes out before the server ends.
+ */
+static void sigChild(int sig)
+{
+  sig = sig;
+  ended = !0;
+}
+
+static void sigDump(int sig)
+{
+  sig = sig;
+  dump = !0;
+}
+
+static void sigTrace(int sig)
+{
+  sig = sig;
+  snapshot = !0;
+}
+
+/* Everything there is to know, on SIGUSR1 or the control socket. */
+static void hostMetrics(FILE *out, void *arg)
+{
+  struct Server *server = ((struct Server *)(arg));
+
+  metricsWrite(out);
+  serverMetricsWrite(server, out);
+  connMetricsWrite(out);
+}
+
+/*
+ * On SIGUSR1, put together in memory and handed over to the log writer,
+ * so that a slow stderr holds up neither the loop nor the log lines.
+ */
+static void hostDump(struct Server *server)
+{
+  char *text = NULL;
+  size_t size = 0U;
+  FILE *out = NULL;
+
+  out = open_memstream(&text, &size);
+  if (!out) {
+    logWrite(LOG_ERROR, "Cannot dump metrics.");
+    return;
+  }
+  hostMetrics(out, server);
+  if (fclose(out)) {
+    logWrite(LOG_ERROR, "Cannot dump metrics.");
+    free(text);
+    return;
+  }
+  logBlock(text, size);
+}
+
+static int hostFlush(struct Server *server, struct Host *host)
+{
+  ssize_t ssize;
+
+  if (host->draining)
+    return 0;
+  /* With completions, what is written comes back to hostComplete(). */
+  if (host->in.complete)
+    return serverNetToHostSubmit(server,
+                                 ((host->fdin) == (host->fdout)) ? &(host->in)
+                                                                 : &(host->out),
+                                 &(host->toHost));
+  while (serverNetToHostSize(server) > 0U) {
+    ssize = serverNetToHostWrite(server, host->fdout);
+    if (ssize > 0)
+      TRACE(TRACE_HOST_WRITE, 0U, host->fdout, ssize, 0U);
+    if (ssize < 0) {
+      if (errno == EAGAIN)
+        return 0;
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    if (!ssize)
+      return -1;
+  }
+  return 0;
+}
+
+static int hostRead(struct Watch *watch, uint32_t events, void *ctx)
+{
+  struct Server *server = ((struct Server *)(ctx));
+  struct Host *host = ((struct Host *)(watch->data));
+  uint8_t *buf = NULL;
+  size_t usize;
+  ssize_t ssize;
+
+  if (serverHostToNetStalled(server))
+    return 0;
+  /* With completions, what is read comes back to hostComplete(). */
+  if (watch->complete) {
+    if (reactorBusy(watch, REACTOR_READ))
+      return 0;
+    usize = serverHostToNetReserve(server, &buf);
+    if (!usize) {
+      logWrite(LOG_ERROR, "Ringbuf failure (OUT).");
+      return -1;
+    }
+    return reactorRead(&(server->reactor), watch, buf, usize);
+  }
+  ssize = serverHostToNetSplice(server, host->fdin);
+  if (ssize < 0) {
+    logWrite(LOG_ERROR, "Splice failure (OUT).");
+    return -1;
+  }
+  if (ssize > 0) {
+    TRACE(TRACE_HOST_SPLICE, 0U, host->fdin, ssize, 0U);
+    return 1;
+  }
+  usize = serverHostToNetReserve(server, &buf);
+  if (!usize) {
+    logWrite(LOG_ERROR, "Ringbuf failure (OUT).");
+    return -1;
+  }
+  ssize = read(host->fdin, buf, usize);
+  if (ssize < 0) {
+    if (errno == EAGAIN)
+      return 0;
+    if (errno == EINTR)
+      return 1;
+  }
+  if (!(ssize > 0)) {
+    host->done = !0;
+    return 0;
+  }
+  if (host->isRaw) {
+    if (memchr(buf, 0, ssize)) {
+      host->done = !0;
+      return 0;
+    }
+  }
+  serverHostToNetCommit(server, ssize);
+  TRACE(TRACE_HOST_READ, 0U, host->fdin, ssize,
+        encodersLog(&(server->encoders), ENCODER_RAW)->offset);
+  /* The end may have come along with the last edge, read on to see it. */
+  return ((ssize == usize) || (host->draining)) ? 1 : 0;
+}
+
+static int hostWrite(struct Watch *watch, uint32_t events, void *ctx)
+{
+  if (hostFlush((struct Server *)(ctx), (struct Host *)(watch->data)) < 0) {
+    logWrite(LOG_ERROR, "Write error.");
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * What the requests hostRead() and hostFlush() made came back with. The
+ * host output was read right into the log, in the very place the next
+ * reserve hands out again.
+ */
+static int hostComplete(struct Watch *watch, int op, int res,
+                        const uint8_t *data, void *ctx)
+{
+  struct Server *server = ((struct Server *)(ctx));
+  struct Host *host = ((struct Host *)(watch->data));
+  int again = (res == -EAGAIN) || (res == -EINTR) || (res == -ECANCELED);
+  uint8_t *buf = NULL;
+
+  if (op == REACTOR_WRITE) {
+    if (host->draining)
+      return 0;
+    if (res > 0) {
+      host->toHost.done += res;
+      TRACE(TRACE_HOST_WRITE, 0U, host->fdout, res, 0U);
+    }
+    if (((!(res > 0)) && (!again)) || (hostFlush(server, host) < 0)) {
+      logWrite(LOG_ERROR, "Write error.");
+      return -1;
+    }
+    return 0;
+  }
+  if (again) {
+    reactorPend(&(server->reactor), watch, EPOLLIN);
+    return 0;
+  }
+  if (!(res > 0)) {
+    host->done = !0;
+    return 0;
+  }
+  serverHostToNetReserve(server, &buf);
+  if ((host->isRaw) && memchr(buf, 0, res)) {
+    host->done = !0;
+    return 0;
+  }
+  serverHostToNetCommit(server, res);
+  TRACE(TRACE_HOST_READ, 0U, host->fdin, res,
+        encodersLog(&(server->encoders), ENCODER_RAW)->offset);
+  reactorPend(&(server->reactor), watch, EPOLLIN);
+  return 0;
+}
+
+/*
+ * The program went away or closed its output: nothing more goes to it,
+ * but what it wrote is still read up to the end and given a while to
+ * reach the clients. Returns when to give up on them.
+ */
+static uint64_t hostDrain(struct Server *server, struct Host *host,
+                          uint64_t drainAt)
+{
+  if (!(host->draining)) {
+    host->draining = !0;
+    drainAt = reactorClock() + configSize("TELNET_DRAIN_TIMEOUT",
+                                          DRAIN_TIMEOUT);
+    if ((host->fdin) != (host->fdout))
+      reactorDel(&(server->reactor), &(host->out));
+    if (!(host->done))
+      reactorPend(&(server->reactor), &(host->in), host->in.events);
+  }
+  if ((host->done) && (server->hostWatch)) {
+    serverHostToNetWatch(server, NULL);
+    reactorDel(&(server->reactor), &(host->in));
+  }
+  return drainAt;
+}
+
+/* Both ways over one descriptor (a terminal), which takes a single watch. */
+static int hostEvent(struct Watch *watch, uint32_t events, void *ctx)
+{
+  if (events & EPOLLOUT) {
+    if (hostWrite(watch, events, ctx) < 0)
+      return -1;
+  }
+  if (events & (~EPOLLOUT))
+    return hostRead(watch, events, ctx);
+  return 0;
+}
+
+/* The far end of a connection, taking in whatever it is sent. */
+struct Viewer
+{
+  int fd;
+  uint64_t bytes;
+  struct Watch watch;
+};
+
+static int viewerRead(struct Watch *watch, uint32_t events, void *ctx)
+{
+  static uint8_t buf[SELF_BENCH_CHUNK];
+  struct Viewer *viewer = ((struct Viewer *)(watch->data));
+  ssize_t ssize;
+
+  ssize = read(viewer->fd, buf, sizeof buf);
+  if (ssize < 0) {
+    if (errno == EAGAIN)
+      return 0;
+    if (errno == EINTR)
+      return 1;
+  }
+  if (!(ssize > 0))
+    return 0;
+  viewer->bytes += ssize;
+  return (ssize == sizeof buf) ? 1 : 0;
+}
+
+static double selfBenchCpu(const struct timeval *tv)
+{
+  return (tv->tv_sec) + ((tv->tv_usec) / 1e6);
+}
+
+/*
+ * The server on its own, with no network and no program: connections
+ * are socket pairs whose other ends are drained by the same event loop,
+ * and host output is made up as fast as the slowest of them takes it.
+ */
+static int selfBench(size_t count, uint64_t seconds)
+{
+  struct Server server;
+  struct Viewer *viewers = NULL;
+  struct rusage usage;
+  uint8_t *chunk = NULL;
+  uint64_t start;
+  uint64_t elapsed;
+  uint64_t loops = 0U;
+  uint64_t fed = 0U;
+  uint64_t least = UINT64_MAX;
+  uint64_t most = 0U;
+  uint64_t total = 0U;
+  size_t adopted = 0U;
+  size_t i;
+  int sv[2];
+  int retval = 0;
+
+  if ((!count) || (!seconds)) {
+    logWrite(LOG_ERROR, "Invalid self-bench setup.");
+    return FAIL;
+  }
+  /* Unless told otherwise, every viewer is to take everything. */
+  setenv("TELNET_OUTPUT_POLICY", "stall", 0);
+  memset(&server, 0, sizeof server);
+  viewers = (struct Viewer *)(calloc(count, sizeof(struct Viewer)));
+  chunk = (uint8_t *)(malloc(SELF_BENCH_CHUNK));
+  if ((!viewers) || (!chunk) || serverInit(&server, 0U)) {
+    logWrite(LOG_ERROR, "Cannot start server.");
+    free(viewers);
+    free(chunk);
+    return FAIL;
+  }
+  for (i = 0U; i < count; i++)
+    viewers[i].fd = -1;
+  for (i = 0U; i < SELF_BENCH_CHUNK; i++)
+    chunk[i] = ((i % 64U) == 63U) ? '\n' : ('!' + (i % 64U));
+  if (connPoolReserve(CONN_POOL_RESERVE) < 0)
+    retval = FAIL;
+  for (i = 0U; (i < count) && (!retval); i++) {
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0,
+                   sv) < 0) {
+      retval = FAIL;
+      break;
+    }
+    viewers[i].fd = sv[1];
+    viewers[i].watch.fd = sv[1];
+    viewers[i].watch.events = EPOLLIN;
+    viewers[i].watch.handler = viewerRead;
+    viewers[i].watch.data = &(viewers[i]);
+    if (reactorAdd(&(server.reactor), &(viewers[i].watch)) < 0) {
+      viewers[i].watch.handler = NULL;
+      close(sv[0]);
+      retval = FAIL;
+      break;
+    }
+    if (serverAdopt(&server, sv[0], "socketpair", metricsClock()) < 0) {
+      logWrite(LOG_WARN, "Viewer %zu not taken in.", i);
+      if (!adopted)
+        retval = FAIL;
+      break;
+    }
+    adopted++;
+  }
+  if (retval)
+    logWrite(LOG_ERROR, "Cannot set up connections.");
+  else if (adopted < count)
+    logWrite(LOG_WARN, "Only %zu of %zu viewers taken in.", adopted, count);
+  start = metricsClock();
+  elapsed = 0U;
+  while ((!retval) && adopted && (elapsed < (seconds * 1000000U))) {
+    if (!serverHostToNetStalled(&server)) {
+      if (serverHostToNetPut(&server, chunk, SELF_BENCH_CHUNK) < 0) {
+        retval = FAIL;
+        break;
+      }
+      fed += SELF_BENCH_CHUNK;
+      server.timeout = 0;
+    } else if ((server.timeout < 0) || (server.timeout > 100)) {
+      server.timeout = 100;
+    }
+    if (serverStep(&server)) {
+      retval = FAIL;
+      break;
+    }
+    loops++;
+    elapsed = metricsClock() - start;
+  }
+  getrusage(RUSAGE_SELF, &usage);
+  for (i = 0U; i < adopted; i++) {
+    if ((viewers[i].bytes) < least)
+      least = viewers[i].bytes;
+    if ((viewers[i].bytes) > most)
+      most = viewers[i].bytes;
+    total += viewers[i].bytes;
+  }
+  if ((!retval) && adopted) {
+    printf("viewers: %zu\n", adopted);
+    printf("seconds: %.3f\n", elapsed / 1e6);
+    printf("loops: %llu (%.0f/s)\n", (unsigned long long)(loops),
+           loops / (elapsed / 1e6));
+    printf("fed: %.3f MB/s\n", (fed / 1048576.0) / (elapsed / 1e6));
+    printf("viewer: min %.3f MB/s, mean %.3f MB/s, max %.3f MB/s\n",
+           (least / 1048576.0) / (elapsed / 1e6),
+           ((total / 1048576.0) / (elapsed / 1e6)) / adopted,
+           (most / 1048576.0) / (elapsed / 1e6));
+    printf("cpu: user %.3f s, system %.3f s\n",
+           selfBenchCpu(&(usage.ru_utime)), selfBenchCpu(&(usage.ru_stime)));
+  }
+  for (i = 0U; i < count; i++) {
+    if (viewers[i].watch.handler)
+      reactorDel(&(server.reactor), &(viewers[i].watch));
+  }
+  serverStop(&server);
+  for (i = 0U; i < count; i++) {
+    if (!(viewers[i].fd < 0))
+      close(viewers[i].fd);
+  }
+  connPoolFree();
+  free(viewers);
+  free(chunk);
+  return retval;
+}
+
 int main(int argc, char **argv)
 {
-  int isRaw = 0;
   pid_t spawned = 0;
-  int fdin = fileno(stdin);
-  int fdout = fileno(stdout);
   uint16_t waitport;
   struct Server server;
+  struct Workers workers;
+  struct Host host;
+  struct Sessions sessions;
+  struct Control control;
   struct termios oldtermios;
-  fd_set fds;
-  struct timeval tv;
+  sigset_t sigs;
+  sigset_t oldsigs;
+  int flagsin;
+  int flagsout;
+  size_t nworkers;
   size_t sigDone;
-  size_t usize;
-  ssize_t ssize;
-  uint8_t buf[RINGBUF_CAPACITY];
-  const uint8_t *bufptr;
+  uint64_t drainAt;
+  uint64_t now;
+  int perSession;
   int retval;
+  const char *controlPath = getenv("TELNET_CONTROL");
+  const char *tracePath = getenv("TELNET_TRACE");
 
   memset(&server, 0, sizeof server);
+  memset(&workers, 0, sizeof workers);
+  memset(&host, 0, sizeof host);
+  memset(&sessions, 0, sizeof sessions);
+  memset(&control, 0, sizeof control);
+  control.sock = -1;
   memset(&oldtermios, 0, sizeof oldtermios);
+  host.fdin = fileno(stdin);
+  host.fdout = fileno(stdout);
   if (argc == 1) {
     fprintf(stderr, "Usage: %s <waitport> [<cmd> [-- [<args>]]]\n", argv[0]);
+    fprintf(stderr, "       %s --self-bench [<viewers> [<seconds>]]\n",
+            argv[0]);
     return FAIL;
   }
+  if (!strcmp(argv[1], "--self-bench")) {
+    if (logInit() < 0)
+      logWrite(LOG_WARN, "Cannot start logging thread.");
+    retval = selfBench((argc > 2) ? strtoul(argv[2], NULL, 10)
+                                  : SELF_BENCH_VIEWERS,
+                       (argc > 3) ? strtoull(argv[3], NULL, 10)
+                                  : SELF_BENCH_SECONDS);
+    metricsFree();
+    slabTrim();
+    logStop();
+    return retval;
+  }
   if (!(argc > 1))
     return FAIL;
   waitport = atoi(argv[1]);
   if (!(waitport > 0)) {
-    fprintf(stderr, "Invalid wait port.\n");
+    logWrite(LOG_ERROR, "Invalid wait port.");
     return FAIL;
   }
+  nworkers = configSize("TELNET_WORKERS", 0U);
+  if (nworkers > WORKER_MAX) {
+    logWrite(LOG_ERROR, "Too many workers.");
+    return FAIL;
+  }
+  if ((argc > 2) && (getenv("TELNET_SESSIONS")) && (getenv("TELNET_PTY"))) {
+    logWrite(LOG_ERROR, "TELNET_PTY cannot be used with TELNET_SESSIONS.");
+    return FAIL;
+  }
+  /* Before any other thread is around, so that none of them gets signals. */
+  if (logInit() < 0)
+    logWrite(LOG_WARN, "Cannot start logging thread.");
   D("Starting %s on port %u.\n", argv[0], waitport);
+  /* Before any other thread is around to look at it. */
+  if (tracePath
+      && (traceInit(tracePath, configSize("TELNET_TRACE_RECORDS",
+                                          TRACE_RECORDS)) < 0)) {
+    logWrite(LOG_ERROR, "Cannot set up tracing.");
+    logStop();
+    return FAIL;
+  }
   if (serverInit(&server, waitport)) {
-    fprintf(stderr, "Cannot start server.\n");
+    logWrite(LOG_ERROR, "Cannot start server.");
+    logStop();
     return FAIL;
   }
-  if (argc > 2) {
-    spawned = spawn(argv[2], argc - 2, argv + 2, &fdout, &fdin);
+  if (connPoolReserve(CONN_POOL_RESERVE) < 0) {
+    logWrite(LOG_ERROR, "Cannot set up connections.");
+    serverStop(&server);
+    connPoolFree();
+    logStop();
+    return FAIL;
+  }
+  perSession = (argc > 2) && (getenv("TELNET_SESSIONS"));
+  if (perSession) {
+    /* Spawned by the session pool once the signals are blocked. */
+    host.fdin = -1;
+    host.fdout = -1;
+  } else if ((argc > 2) && (getenv("TELNET_PTY"))) {
+    spawned = spawnPty(argv[2], argc - 2, argv + 2, &(host.fdin));
+    host.fdout = host.fdin;
+    if (!(spawned < 0))
+      telnetdPty(host.fdin);
+  } else if (argc > 2) {
+    spawned = spawn(argv[2], argc - 2, argv + 2, &(host.fdout),
+                    &(host.fdin));
+  }
+  if ((argc > 2) && (!perSession)) {
     if (spawned < 0) {
-      fprintf(stderr, "Could not execute your command.\n");
+      logWrite(LOG_ERROR, "Could not execute your command.");
       serverStop(&server);
+      connPoolFree();
+      logStop();
       return FAIL;
     }
   }
   sigDone = 0U;
+  sigemptyset(&sigs);
   do {
-    if (SIG_ERR == signal(SIGPIPE, sigHandler))
+    /* A session program going away must not take the server along. */
+    if (SIG_ERR == signal(SIGPIPE, perSession ? SIG_IGN : sigHandler))
       break;
+    sigaddset(&sigs, SIGPIPE);
     sigDone++;
     if (SIG_ERR == signal(SIGTERM, sigHandler))
       break;
+    sigaddset(&sigs, SIGTERM);
     sigDone++;
     if (SIG_ERR == signal(SIGQUIT, sigHandler))
       break;
+    sigaddset(&sigs, SIGQUIT);
     sigDone++;
     if (SIG_ERR == signal(SIGINT, sigHandler))
       break;
+    sigaddset(&sigs, SIGINT);
     sigDone++;
     if (SIG_ERR == signal(SIGHUP, sigHandler))
       break;
+    sigaddset(&sigs, SIGHUP);
+    sigDone++;
+    if (SIG_ERR == signal(SIGCHLD, sigChild))
+      break;
+    sigaddset(&sigs, SIGCHLD);
     sigDone++;
-    if (SIG_ERR == signal(SIGCHLD, sigHandler))
+    if (SIG_ERR == signal(SIGUSR1, sigDump))
       break;
+    sigaddset(&sigs, SIGUSR1);
+    sigDone++;
+    if (SIG_ERR == signal(SIGUSR2, sigTrace))
+      break;
+    sigaddset(&sigs, SIGUSR2);
     sigDone++;
   } while (0);
-  if (sigDone < 6U) {
-    fprintf(stderr, "Cannot arm signals.\n");
+  if (sigDone < 8U) {
+    logWrite(LOG_ERROR, "Cannot arm signals.");
     if (spawned)
       kill(spawned, SIGKILL);
     serverStop(&server);
+    connPoolFree();
+    logStop();
     return FAIL;
   }
-  if ((!spawned) && (!(getenv("TELNET_TELOPT_LINEMODE")))) {
-    isRaw = !((rawtty(fdin, &oldtermios)) < 0);
-    if (isRaw) {
+  if ((!spawned) && (!perSession)
+      && (!(getenv("TELNET_TELOPT_LINEMODE")))) {
+    host.isRaw = !((rawtty(host.fdin, &oldtermios)) < 0);
+    if (host.isRaw) {
       D("Raw TTY mode entered. Press Ctrl+2 to quit.\r\n");
     } else {
-      fprintf(stderr, "Cannot set raw tty.\n");
+      logWrite(LOG_WARN, "Cannot set raw tty.");
     }
   }
+  /*
+   * Signals are only let in while the event loop sleeps, so that a
+   * quit request can never slip in between the check and the wait.
+   */
+  sigprocmask(SIG_BLOCK, &sigs, &oldsigs);
+  reactorSigmask(&(server.reactor), &oldsigs);
   retval = 0;
-  while (!quit) {
-    FD_ZERO(&fds);
-    FD_SET(fdin, &fds);
-    tv.tv_sec = 0;
-    tv.tv_usec = 10;
-    if (select(fdin + 1, &fds, NULL, NULL, &tv)) {
-      if ((!quit) && (FD_ISSET(fdin, &fds))) {
-        buf[0] = 0U;
-        ssize = read(fdin, buf, sizeof buf);
-        if (ssize > 0) {
-          if (isRaw) {
-            if (memchr(buf, 0, ssize))
-              break;
-          }
-          if ((serverHostToNetPut(&server, buf, ssize)) < 0) {
-            fprintf(stderr, "Ringbuf failure (OUT).\n");
-            retval = FAIL;
-            break;
-          }
-        } else {
-          break;
-        }
-      }
+  flagsin = -1;
+  flagsout = -1;
+  if (perSession) {
+    if (sessionsInit(&sessions, configSize("TELNET_SESSIONS", SESSION_POOL),
+                     argc - 2, argv + 2) < 0) {
+      logWrite(LOG_ERROR, "Could not execute your command.");
+      retval = FAIL;
+    } else {
+      server.sessions = &sessions;
     }
-    usize = serverNetToHostSize(&server);
-    if (usize > sizeof buf) {
-      fprintf(stderr, "Internal error: buffer too small.\n");
+  } else {
+    flagsin = fcntl(host.fdin, F_GETFL);
+    flagsout = fcntl(host.fdout, F_GETFL);
+    fcntl(host.fdin, F_SETFL, flagsin | O_NONBLOCK);
+    fcntl(host.fdout, F_SETFL, flagsout | O_NONBLOCK);
+  }
+  host.in.fd = host.fdin;
+  host.in.events = EPOLLIN;
+  host.in.handler = hostRead;
+  host.in.data = &host;
+  host.out.fd = host.fdout;
+  host.out.events = EPOLLOUT;
+  host.out.handler = hostWrite;
+  host.out.data = &host;
+  if ((host.fdin) == (host.fdout)) {
+    host.in.events = EPOLLIN | EPOLLOUT;
+    host.in.handler = hostEvent;
+  }
+  if ((!retval) && (!perSession) && reactorCompletes(&(server.reactor))) {
+    host.in.complete = hostComplete;
+    host.out.complete = hostComplete;
+  }
+  if ((!retval) && (!perSession))
+    serverHostToNetWatch(&server, &(host.in));
+  if ((!retval) && (!perSession)
+      && ((reactorAdd(&(server.reactor), &(host.in)) < 0)
+          || (((host.fdin) != (host.fdout))
+              && (reactorAdd(&(server.reactor), &(host.out)) < 0)))) {
+    logWrite(LOG_ERROR, "Cannot watch host descriptors.");
+    retval = FAIL;
+  }
+  /* Started with the signals blocked, so that only this thread gets them. */
+  if ((!retval) && (nworkers > 0U)) {
+    if (workersInit(&workers, &server, nworkers) < 0) {
+      logWrite(LOG_ERROR, "Cannot start workers.");
       retval = FAIL;
-      break;
     }
-    if (usize > 0) {
-      buf[0] = 0U;
-      if ((serverNetToHostGet(&server, buf, usize)) < 0) {
-        fprintf(stderr, "Ringbuf failure (IN).\n");
-        retval = FAIL;
+  }
+  if ((!retval) && controlPath
+      && (controlInit(&control, controlPath, &(server.reactor), hostMetrics,
+                      &server) < 0)) {
+    logWrite(LOG_ERROR, "Cannot set up control socket.");
+    retval = FAIL;
+  }
+  if ((!retval) && (!nworkers) && (!perSession)
+      && (getenv("TELNET_SPLICE"))) {
+    if (serverSpliceInit(&server, host.fdin) < 0) {
+      logWrite(LOG_WARN, "Host output cannot be spliced.");
+    }
+  }
+  drainAt = 0U;
+  while ((!quit) && (!retval)) {
+    if (host.draining) {
+      if ((host.done) && (!(serverBacklog(&server))))
         break;
-      }
-      bufptr = buf;
-      while (usize) {
-        ssize = write(fdout, bufptr, usize);
-        if (ssize < 0) {
-          if (errno != EAGAIN)
-            break;
-        }
-        if (ssize > usize)
-          break;
-        usize -= ssize;
-        bufptr += ssize;
-      }
-      if (usize) {
-        fprintf(stderr, "Write error.\n");
-        retval = FAIL;
+      now = reactorClock();
+      if (!(now < drainAt)) {
+        logWrite(LOG_WARN, "Leaving %llu bytes unsent.",
+                 (unsigned long long)(serverBacklog(&server)));
         break;
       }
+      if ((server.timeout < 0) || (server.timeout > DRAIN_CHECK))
+        server.timeout = DRAIN_CHECK;
     }
     if (serverStep(&server)) {
-      fprintf(stderr, "Emergency exit.\n");
+      logWrite(LOG_ERROR, "Emergency exit.");
+      retval = FAIL;
+      break;
+    }
+    if (ended) {
+      ended = 0;
+      if (perSession)
+        sessionsReap();
+      else
+        drainAt = hostDrain(&server, &host, drainAt);
+    }
+    if (dump) {
+      dump = 0;
+      hostDump(&server);
+    }
+    if (snapshot) {
+      snapshot = 0;
+      if (traceWrite() < 0) {
+        logWrite(LOG_ERROR, "Cannot write trace out.");
+      }
+    }
+    if (perSession)
+      continue;
+    if (hostFlush(&server, &host) < 0) {
+      logWrite(LOG_ERROR, "Write error.");
       retval = FAIL;
       break;
     }
+    if (host.done)
+      drainAt = hostDrain(&server, &host, drainAt);
   }
+  if (!(flagsin < 0))
+    fcntl(host.fdin, F_SETFL, flagsin);
+  if (!(flagsout < 0))
+    fcntl(host.fdout, F_SETFL, flagsout);
   if (spawned)
     kill(spawned, retval ? SIGKILL : SIGINT);
-  if (isRaw)
-    ttyreset(fdin, &oldtermios);
+  if (host.isRaw)
+    ttyreset(host.fdin, &oldtermios);
+  if (server.workers)
+    workersStop(&workers);
+  controlStop(&control, &(server.reactor));
+  /* Nothing is to be read into the log once it is gone. */
+  if (!perSession) {
+    reactorDel(&(server.reactor), &(host.in));
+    if ((host.fdin) != (host.fdout))
+      reactorDel(&(server.reactor), &(host.out));
+  }
   serverStop(&server);
-  D("\r\nNatural end.\r\n");
+  if (server.sessions)
+    sessionsStop(&sessions);
+  D("\r\nNatural end (%zu slab, %zu connection allocations, %llu sends)."
+    "\r\n", slabAllocs(), connAllocs(),
+    (unsigned long long)(metricsGet(METRIC_SENDS)));
+  if (traceWrite() < 0)
+    logWrite(LOG_ERROR, "Cannot write trace out.");
+  traceFree();
+  connPoolFree();
+  metricsFree();
+  slabTrim();
+  logStop();
   return retval;
 }
@@ -0,0 +1,216 @@
+/*
+ * metrics.c - Counters and histograms implementation.
+ *
+ * Written in 2020 by Paul Osmialowski <pawelo@king.net.pl>.
+ *
+ * To the extent possible under law, the author(s) have dedicated all
+ * copyright and related and neighboring rights to this software to
+ * the public domain worldwide. This software is distributed without
+ * any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication
+ * along with this software. If not, see
+ * <http://creativecommons.org/publicdomain/zero/1.0>.
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "metrics.h"
+
+/*
+ * Every thread counts into a shard of its own, so that the hot paths
+ * never share a cache line. Shards stay around once a thread is gone,
+ * its counts still belong to the totals; the dump adds them all up.
+ */
+struct MetricsShard
+{
+  struct MetricsShard *next;
+  atomic_ullong counters[METRIC_MAX];
+  atomic_ullong buckets[HISTO_MAX][METRICS_BUCKETS];
+  atomic_ullong sums[HISTO_MAX];
+};
+
+static const char *const counterNames[METRIC_MAX] = {
+  "accepted_total",
+  "rejected_total",
+  "closed_total",
+  "received_bytes_total",
+  "sent_bytes_total",
+  "sends_total",
+  "overflows_total",
+  "lagged_total",
+  "dropped_bytes_total",
+  "input_stalls_total",
+  "input_dropped_bytes_total",
+  "ring_full_total",
+  "loops_total",
+  "log_dropped_total"
+};
+
+static const char *const histoNames[HISTO_MAX] = {
+  "loop_seconds",
+  "adopt_seconds"
+};
+
+static pthread_mutex_t shardsLock = PTHREAD_MUTEX_INITIALIZER;
+static struct MetricsShard *shards = NULL;
+/* Shared by the threads that could not get a shard of their own. */
+static struct MetricsShard spare;
+static _Thread_local struct MetricsShard *shard = NULL;
+
+static struct MetricsShard *metricsShard(void)
+{
+  struct MetricsShard *mine = shard;
+
+  if (mine)
+    return mine;
+  mine = (struct MetricsShard *)(calloc(1U, sizeof(struct MetricsShard)));
+  if (!mine) {
+    shard = &spare;
+    return shard;
+  }
+  pthread_mutex_lock(&shardsLock);
+  mine->next = shards;
+  shards = mine;
+  pthread_mutex_unlock(&shardsLock);
+  shard = mine;
+  return mine;
+}
+
+void metricsAdd(int metric, uint64_t value)
+{
+  assert((metric >= 0) && (metric < METRIC_MAX));
+  atomic_fetch_add_explicit(&(metricsShard()->counters[metric]), value,
+                            memory_order_relaxed);
+}
+
+/*
+ * The bucket of a value is the smallest power of two not below it, the
+ * last bucket takes whatever is too long for the others.
+ */
+void metricsObserve(int histo, uint64_t usec)
+{
+  struct MetricsShard *mine = metricsShard();
+  unsigned bucket = 0U;
+
+  assert((histo >= 0) && (histo < HISTO_MAX));
+  while ((bucket < (METRICS_BUCKETS - 1U)) && ((1ULL << bucket) < usec))
+    bucket++;
+  atomic_fetch_add_explicit(&(mine->buckets[histo][bucket]), 1U,
+                            memory_order_relaxed);
+  atomic_fetch_add_explicit(&(mine->sums[histo]), usec,
+                            memory_order_relaxed);
+}
+
+/* The sums below are taken with shardsLock held. */
+static uint64_t metricsCounter(int metric)
+{
+  const struct MetricsShard *each = NULL;
+  uint64_t sum = atomic_load_explicit(&(spare.counters[metric]),
+                                      memory_order_relaxed);
+
+  for (each = shards; each; each = each->next)
+    sum += atomic_load_explicit(&(each->counters[metric]),
+                                memory_order_relaxed);
+  return sum;
+}
+
+static uint64_t metricsBucket(int histo, unsigned bucket)
+{
+  const struct MetricsShard *each = NULL;
+  uint64_t sum = atomic_load_explicit(&(spare.buckets[histo][bucket]),
+                                      memory_order_relaxed);
+
+  for (each = shards; each; each = each->next)
+    sum += atomic_load_explicit(&(each->buckets[histo][bucket]),
+                                memory_order_relaxed);
+  return sum;
+}
+
+static uint64_t metricsTotal(int histo)
+{
+  const struct MetricsShard *each = NULL;
+  uint64_t sum = atomic_load_explicit(&(spare.sums[histo]),
+                                      memory_order_relaxed);
+
+  for (each = shards; each; each = each->next)
+    sum += atomic_load_explicit(&(each->sums[histo]), memory_order_relaxed);
+  return sum;
+}
+
+uint64_t metricsGet(int metric)
+{
+  uint64_t sum;
+
+  assert((metric >= 0) && (metric < METRIC_MAX));
+  pthread_mutex_lock(&shardsLock);
+  sum = metricsCounter(metric);
+  pthread_mutex_unlock(&shardsLock);
+  return sum;
+}
+
+/* Microseconds on a clock that does not jump. */
+uint64_t metricsClock(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (((uint64_t)(ts.tv_sec)) * 1000000U) + (ts.tv_nsec / 1000L);
+}
+
+/* In the Prometheus text format, histograms in seconds. */
+void metricsWrite(FILE *out)
+{
+  uint64_t count;
+  int i;
+  unsigned j;
+
+  assert(out);
+  pthread_mutex_lock(&shardsLock);
+  for (i = 0; i < METRIC_MAX; i++) {
+    fprintf(out, "# TYPE " METRICS_PREFIX "%s counter\n", counterNames[i]);
+    fprintf(out, METRICS_PREFIX "%s %llu\n", counterNames[i],
+            (unsigned long long)(metricsCounter(i)));
+  }
+  for (i = 0; i < HISTO_MAX; i++) {
+    fprintf(out, "# TYPE " METRICS_PREFIX "%s histogram\n", histoNames[i]);
+    count = 0U;
+    for (j = 0U; j < (METRICS_BUCKETS - 1U); j++) {
+      count += metricsBucket(i, j);
+      fprintf(out, METRICS_PREFIX "%s_bucket{le=\"%.6f\"} %llu\n",
+              histoNames[i], ((double)(1ULL << j)) / 1e6,
+              (unsigned long long)(count));
+    }
+    count += metricsBucket(i, METRICS_BUCKETS - 1U);
+    fprintf(out, METRICS_PREFIX "%s_bucket{le=\"+Inf\"} %llu\n",
+            histoNames[i], (unsigned long long)(count));
+    fprintf(out, METRICS_PREFIX "%s_sum %.6f\n", histoNames[i],
+            ((double)(metricsTotal(i))) / 1e6);
+    fprintf(out, METRICS_PREFIX "%s_count %llu\n", histoNames[i],
+            (unsigned long long)(count));
+  }
+  pthread_mutex_unlock(&shardsLock);
+}
+
+/* Only once every thread is gone. */
+void metricsFree(void)
+{
+  struct MetricsShard *each = NULL;
+
+  pthread_mutex_lock(&shardsLock);
+  while (shards) {
+    each = shards;
+    shards = each->next;
+    free(each);
+  }
+  pthread_mutex_unlock(&shardsLock);
+  shard = NULL;
+}
@@ -0,0 +1,64 @@
+/*
+ * metrics.h - Counters and histograms interface.
+ *
+ * Written in 2020 by Paul Osmialowski <pawelo@king.net.pl>.
+ *
+ * To the extent possible under law, the author(s) have dedicated all
+ * copyright and related and neighboring rights to this software to
+ * the public domain worldwide. This software is distributed without
+ * any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication
+ * along with this software. If not, see
+ * <http://creativecommons.org/publicdomain/zero/1.0>.
+ */
+
+#ifndef __METRICS_H
+#define __METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* Prefix of every metric name in the dump. */
+#define METRICS_PREFIX "stdiotelnetd_"
+
+/* Histogram buckets, powers of two microseconds, the last one unbounded. */
+#ifndef METRICS_BUCKETS
+#define METRICS_BUCKETS 24U
+#endif
+
+/* Counters kept by all the threads, summed up in the dump. */
+enum
+{
+  METRIC_ACCEPTED = 0, /* connections let in */
+  METRIC_REJECTED,     /* connections turned away over MAX_CONN */
+  METRIC_CLOSED,
+  METRIC_BYTES_IN,
+  METRIC_BYTES_OUT,
+  METRIC_SENDS,        /* syscalls pushing output to the peers */
+  METRIC_OVERFLOWS,    /* output queues that ran over their budget */
+  METRIC_LAGGED,       /* peers past the lag limit */
+  METRIC_DROPPED,      /* output bytes skipped for lagging peers */
+  METRIC_IN_STALLS,    /* peers not read from as the host did not keep up */
+  METRIC_IN_DROPPED,   /* input bytes thrown away for the same reason */
+  METRIC_RING_FULL,    /* waits for room between the threads */
+  METRIC_LOOPS,
+  METRIC_LOG_DROPPED,  /* log records not written out */
+  METRIC_MAX
+};
+
+enum
+{
+  HISTO_LOOP = 0, /* event loop turns, from the wakeup to the next wait */
+  HISTO_ADOPT,    /* new connections, from accept() to being served */
+  HISTO_MAX
+};
+
+void metricsAdd(int metric, uint64_t value);
+void metricsObserve(int histo, uint64_t usec);
+uint64_t metricsGet(int metric);
+uint64_t metricsClock(void);
+void metricsWrite(FILE *out);
+void metricsFree(void);
+
+#endif /* __METRICS_H */
@@ -0,0 +1,329 @@
+/*
+ * microbench.c - Microbenchmarks of the ring buffers and the telnet codec.
+ *
+ * Written in 2020 by Paul Osmialowski <pawelo@king.net.pl>.
+ *
+ * To the extent possible under law, the author(s) have dedicated all
+ * copyright and related and neighboring rights to this software to
+ * the public domain worldwide. This software is distributed without
+ * any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication
+ * along with this software. If not, see
+ * <http://creativecommons.org/publicdomain/zero/1.0>.
+ */
+
+#include <stdio.h>
+#include <stddef.h> /* needed by libtelnet.h */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libtelnet.h>
+
+#include "ringbuf.h"
+
+#define FAIL -1
+
+/* Default time spent on each case, in milliseconds. */
+#define MICRO_TIME 100U
+
+#define MICRO_CHUNK_MAX 16384U
+
+static const size_t chunks[] = { 1U, 16U, 64U, 256U, 1024U, 4096U, 16384U };
+
+#define MICRO_CHUNKS (sizeof chunks / sizeof chunks[0])
+
+/*
+ * Where in the ring a chunk lands: at the start of the buffer, with half
+ * of it before the end of the buffer and the rest wrapped around, or with
+ * all of it but a single byte wrapped around.
+ */
+enum
+{
+  WRAP_NONE = 0,
+  WRAP_HALF,
+  WRAP_ONE,
+  WRAP_MAX
+};
+
+static const char *const wraps[WRAP_MAX] = { "none", "half", "one" };
+
+/* Percentage of the bytes that are IAC (and so escaped on the wire). */
+static const unsigned iacs[] = { 0U, 1U, 10U, 50U };
+
+#define MICRO_IACS (sizeof iacs / sizeof iacs[0])
+
+struct Micro
+{
+  ringbuf_t src;
+  ringbuf_t dst;
+  telnet_t *telnet;
+  uint8_t *data;
+  uint8_t *out;
+  size_t chunk;
+  uint64_t sink;
+};
+
+typedef void (*MicroOp)(struct Micro *micro);
+
+static const telnet_telopt_t noOpts[] =
+{
+  { .telopt = -1, .us = 0U, .him = 0U }
+};
+
+static uint64_t microClock(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (((uint64_t)(ts.tv_sec)) * 1000000000U) + ts.tv_nsec;
+}
+
+/*
+ * Every case runs on a ring exactly one chunk big, so that each chunk put
+ * in and taken out leaves the ring where it was and every single one of
+ * them lands at the same place.
+ */
+static void microSeek(ringbuf_t rb, size_t chunk, int wrap)
+{
+  size_t offset = 0U;
+
+  if (wrap == WRAP_HALF)
+    offset = chunk - (chunk / 2U);
+  else if (wrap == WRAP_ONE)
+    offset = chunk - 1U;
+  ringbuf_reset(rb);
+  if (offset) {
+    ringbuf_memset(rb, 0, offset);
+    ringbuf_consume(rb, offset);
+  }
+}
+
+static void opMemset(struct Micro *micro)
+{
+  ringbuf_memset(micro->dst, 'a', micro->chunk);
+  ringbuf_consume(micro->dst, micro->chunk);
+}
+
+static void opMemcpyInto(struct Micro *micro)
+{
+  ringbuf_memcpy_into(micro->dst, micro->data, micro->chunk);
+  ringbuf_consume(micro->dst, micro->chunk);
+}
+
+/* The ring gets filled with ringbuf_memset(), see the memset case. */
+static void opMemcpyFrom(struct Micro *micro)
+{
+  ringbuf_memset(micro->dst, 'a', micro->chunk);
+  ringbuf_memcpy_from(micro->out, micro->dst, micro->chunk);
+}
+
+/* The source ring gets filled the same way. */
+static void opCopy(struct Micro *micro)
+{
+  ringbuf_memset(micro->src, 'a', micro->chunk);
+  ringbuf_copy(micro->dst, micro->src, micro->chunk);
+  ringbuf_consume(micro->dst, micro->chunk);
+}
+
+/* The ring stays as it is, only the last byte is the one looked for. */
+static void opFindchr(struct Micro *micro)
+{
+  micro->sink += ringbuf_findchr(micro->dst, '\n', 0U);
+}
+
+static void opTelnetSend(struct Micro *micro)
+{
+  telnet_send(micro->telnet, (const char *)(micro->data), micro->chunk);
+}
+
+static void opTelnetRecv(struct Micro *micro)
+{
+  telnet_recv(micro->telnet, (const char *)(micro->data), micro->chunk);
+}
+
+static void microEvents(telnet_t *telnet, telnet_event_t *ev, void *data)
+{
+  struct Micro *micro = ((struct Micro *)(data));
+
+  if (((ev->type) == TELNET_EV_DATA) || ((ev->type) == TELNET_EV_SEND))
+    micro->sink += ev->data.size;
+}
+
+/* Spread the IACs evenly, the same way on every run. */
+static void microFill(uint8_t *data, size_t size, unsigned iac, int wire)
+{
+  uint32_t seed = 1U;
+  size_t i;
+
+  for (i = 0U; i < size; i++) {
+    seed = (seed * 1103515245U) + 12345U;
+    data[i] = 'a' + ((seed >> 16) % 26U);
+    if (((seed >> 8) % 100U) >= iac)
+      continue;
+    if (!wire) {
+      data[i] = TELNET_IAC;
+    } else if ((i + 1U) < size) {
+      data[i] = TELNET_IAC;
+      data[++i] = TELNET_IAC;
+    }
+  }
+}
+
+/* Doubling the number of operations until a run takes long enough. */
+static void microRun(const char *name, MicroOp op, struct Micro *micro,
+                     const char *wrap, const char *iac, uint64_t target)
+{
+  uint64_t ops = 1U;
+  uint64_t start;
+  uint64_t elapsed;
+  uint64_t i;
+
+  for (;;) {
+    start = microClock();
+    for (i = 0U; i < ops; i++)
+      op(micro);
+    elapsed = microClock() - start;
+    if ((elapsed >= target) || (ops >= (UINT64_MAX / 2U)))
+      break;
+    ops *= 2U;
+  }
+  if (!elapsed)
+    elapsed = 1U;
+  printf("%s,%zu,%s,%s,%llu,%llu,%.3f,%.3f\n", name, micro->chunk, wrap, iac,
+         (unsigned long long)(ops),
+         (unsigned long long)(ops * (micro->chunk)),
+         ((double)(elapsed)) / ops,
+         ((ops * (micro->chunk)) / 1048576.0) / (elapsed / 1e9));
+  fflush(stdout);
+}
+
+static int microRings(struct Micro *micro, const char *filter,
+                      uint64_t target)
+{
+  static const struct
+  {
+    const char *name;
+    MicroOp op;
+  } cases[] = {
+    { "ringbuf_memset", opMemset },
+    { "ringbuf_memcpy_into", opMemcpyInto },
+    { "ringbuf_memcpy_from", opMemcpyFrom },
+    { "ringbuf_copy", opCopy },
+    { "ringbuf_findchr", opFindchr }
+  };
+  size_t i;
+  size_t j;
+  int wrap;
+
+  for (i = 0U; i < (sizeof cases / sizeof cases[0]); i++) {
+    if (filter && strncmp(cases[i].name, filter, strlen(filter)))
+      continue;
+    for (j = 0U; j < MICRO_CHUNKS; j++) {
+      micro->chunk = chunks[j];
+      for (wrap = WRAP_NONE; wrap < WRAP_MAX; wrap++) {
+        /* A chunk too small to be split lands in one piece anyway. */
+        if ((wrap != WRAP_NONE) && ((micro->chunk) < 2U))
+          continue;
+        micro->src = ringbuf_new(micro->chunk);
+        micro->dst = ringbuf_new(micro->chunk);
+        if ((!(micro->src)) || (!(micro->dst)))
+          return -1;
+        microSeek(micro->src, micro->chunk, wrap);
+        microSeek(micro->dst, micro->chunk, wrap);
+        if ((cases[i].op) == opFindchr) {
+          ringbuf_memset(micro->dst, 'a', (micro->chunk) - 1U);
+          ringbuf_memcpy_into(micro->dst, "\n", 1U);
+        }
+        microRun(cases[i].name, cases[i].op, micro, wraps[wrap], "-",
+                 target);
+        ringbuf_free(&(micro->src));
+        ringbuf_free(&(micro->dst));
+      }
+    }
+  }
+  return 0;
+}
+
+static int microTelnet(struct Micro *micro, const char *filter,
+                       uint64_t target)
+{
+  static const struct
+  {
+    const char *name;
+    MicroOp op;
+    int wire;
+  } cases[] = {
+    { "telnet_send", opTelnetSend, 0 },
+    { "telnet_recv", opTelnetRecv, !0 }
+  };
+  char iac[16];
+  size_t i;
+  size_t j;
+  size_t k;
+
+  for (i = 0U; i < (sizeof cases / sizeof cases[0]); i++) {
+    if (filter && strncmp(cases[i].name, filter, strlen(filter)))
+      continue;
+    for (j = 0U; j < MICRO_CHUNKS; j++) {
+      micro->chunk = chunks[j];
+      for (k = 0U; k < MICRO_IACS; k++) {
+        microFill(micro->data, micro->chunk, iacs[k], cases[i].wire);
+        micro->telnet = telnet_init(noOpts, microEvents, 0U, micro);
+        if (!(micro->telnet))
+          return -1;
+        snprintf(iac, sizeof iac, "%u", iacs[k]);
+        microRun(cases[i].name, cases[i].op, micro, "-", iac, target);
+        telnet_free(micro->telnet);
+        micro->telnet = NULL;
+      }
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  struct Micro micro;
+  const char *filter = NULL;
+  uint64_t target = MICRO_TIME;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "f:t:")) != -1) {
+    switch (opt) {
+    case 'f':
+      filter = optarg;
+      break;
+    case 't':
+      target = strtoull(optarg, NULL, 10);
+      if (target)
+        break;
+      /* FALLTHROUGH */
+    default:
+      fprintf(stderr, "Usage: %s [-f <case prefix>] [-t <msec per case>]\n",
+              argv[0]);
+      return FAIL;
+    }
+  }
+  memset(&micro, 0, sizeof micro);
+  micro.data = (uint8_t *)(malloc(MICRO_CHUNK_MAX));
+  micro.out = (uint8_t *)(malloc(MICRO_CHUNK_MAX));
+  if ((!(micro.data)) || (!(micro.out))) {
+    fprintf(stderr, "Out of memory.\n");
+    return FAIL;
+  }
+  memset(micro.data, 'a', MICRO_CHUNK_MAX);
+  /* Bytes are the ones handed in: data to send, or what came off the wire. */
+  printf("case,chunk,wrap,iac_percent,ops,bytes,ns_per_op,mb_per_s\n");
+  if ((microRings(&micro, filter, target * 1000000U) < 0)
+      || (microTelnet(&micro, filter, target * 1000000U) < 0)) {
+    fprintf(stderr, "Out of memory.\n");
+    return FAIL;
+  }
+  free(micro.data);
+  free(micro.out);
+  return 0;
+}
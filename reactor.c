@@ -0,0 +1,618 @@
+/*
+ * reactor.c - Edge-triggered event loop implementation.
+ *
+ * Written in 2020 by Paul Osmialowski <pawelo@king.net.pl>.
+ *
+ * To the extent possible under law, the author(s) have dedicated all
+ * copyright and related and neighboring rights to this software to
+ * the public domain worldwide. This software is distributed without
+ * any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication
+ * along with this software. If not, see
+ * <http://creativecommons.org/publicdomain/zero/1.0>.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <linux/io_uring.h>
+
+#include "reactor.h"
+#include "uring.h"
+#include "metrics.h"
+
+static void reactorMark(struct Reactor *reactor, struct Watch *watch,
+                        uint32_t events)
+{
+  watch->pendingEvents |= events;
+  if (watch->pending)
+    return;
+  watch->pending = !0;
+  watch->nextPending = NULL;
+  if (reactor->pendingTail)
+    reactor->pendingTail->nextPending = watch;
+  else
+    reactor->pending = watch;
+  reactor->pendingTail = watch;
+}
+
+/* Where the watch and what the request is for go in the user data. */
+#define REACTOR_OP_MASK 7U
+
+static uint64_t reactorTag(const struct Watch *watch, int op)
+{
+  assert(!(((uintptr_t)(watch)) & REACTOR_OP_MASK));
+  return (uint64_t)(((uintptr_t)(watch)) | ((uintptr_t)(op)));
+}
+
+static unsigned reactorInflight(const struct Watch *watch)
+{
+  unsigned count = 0U;
+  int op;
+
+  for (op = 0; op < REACTOR_OPS; op++)
+    count += watch->inflight[op];
+  return count;
+}
+
+/* A multishot poll, reporting every time the descriptor gets ready. */
+static int reactorArm(struct Reactor *reactor, struct Watch *watch)
+{
+  struct io_uring_sqe *sqe = NULL;
+
+  sqe = uringSqe(&(reactor->uring));
+  if (!sqe)
+    return -1;
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = watch->fd;
+  sqe->poll32_events = watch->events;
+  sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->user_data = reactorTag(watch, REACTOR_POLL);
+  watch->inflight[REACTOR_POLL]++;
+  return 0;
+}
+
+/*
+ * A request on its way, kept in step with how many of its kind are in
+ * flight for the watch. Once the last request of its kind found the
+ * descriptor not ready (older kernels do that with O_NONBLOCK), it goes
+ * in linked behind a poll for the events it waits for.
+ */
+static struct io_uring_sqe *reactorRequest(struct Reactor *reactor,
+                                           struct Watch *watch, int op,
+                                           uint32_t events)
+{
+  struct io_uring_sqe *sqe = NULL;
+
+  assert(reactor->completes);
+  assert(watch->complete);
+  if ((watch->again) & (1U << op)) {
+    sqe = uringSqe(&(reactor->uring));
+    if (!sqe)
+      return NULL;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = watch->fd;
+    sqe->poll32_events = events;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = reactorTag(watch, REACTOR_WAIT);
+    watch->inflight[REACTOR_WAIT]++;
+    watch->again &= ~(1U << op);
+  }
+  sqe = uringSqe(&(reactor->uring));
+  if (!sqe)
+    return NULL;
+  sqe->fd = watch->fd;
+  sqe->user_data = reactorTag(watch, op);
+  watch->inflight[op]++;
+  return sqe;
+}
+
+static void reactorRecycle(struct Reactor *reactor, uint32_t flags)
+{
+  if (flags & IORING_CQE_F_BUFFER)
+    uringBufferPut(&(reactor->buffers), flags >> IORING_CQE_BUFFER_SHIFT);
+}
+
+/* Room for one more completion to be held. */
+static int reactorHold(struct Reactor *reactor)
+{
+  struct Completion *done = NULL;
+  size_t size;
+
+  if ((reactor->doneCount) < (reactor->doneSize))
+    return 0;
+  size = (reactor->doneSize) ? ((reactor->doneSize) * 2U)
+                             : REACTOR_MAX_EVENTS;
+  done = (struct Completion *)(realloc(reactor->done,
+                                       size * sizeof(struct Completion)));
+  if (!done)
+    return -1;
+  reactor->done = done;
+  reactor->doneSize = size;
+  return 0;
+}
+
+/*
+ * Polls mark their watches ready, completions are held for their
+ * handlers. Completions that cannot be held stay in the ring.
+ */
+static int reactorReap(struct Reactor *reactor)
+{
+  struct io_uring_cqe *cqe = NULL;
+  struct Completion *done = NULL;
+  struct Watch *watch = NULL;
+  int op;
+
+  while ((cqe = uringPeek(&(reactor->uring)))) {
+    op = (int)((cqe->user_data) & REACTOR_OP_MASK);
+    watch = (struct Watch *)((uintptr_t)((cqe->user_data)
+                                         & (~((uint64_t)(REACTOR_OP_MASK)))));
+    if ((watch) && (op != REACTOR_POLL) && (op != REACTOR_WAIT)
+        && (!(watch->deleting)) && (reactorHold(reactor) < 0))
+      return -1;
+    if (watch && (!((cqe->flags) & IORING_CQE_F_MORE))) {
+      assert(watch->inflight[op]);
+      watch->inflight[op]--;
+    }
+    if (!watch) {
+      /* A cancel, which may find the request busy completing. */
+      if ((cqe->res) == -EALREADY)
+        reactor->cancelBusy = !0;
+    } else if (op == REACTOR_WAIT) {
+      ;
+    } else if (watch->deleting) {
+      reactorRecycle(reactor, cqe->flags);
+    } else if (op != REACTOR_POLL) {
+      if ((cqe->res) == -EAGAIN)
+        watch->again |= 1U << op;
+      done = &(reactor->done[reactor->doneCount++]);
+      done->watch = watch;
+      done->op = op;
+      done->res = cqe->res;
+      done->flags = cqe->flags;
+    } else if ((cqe->res) < 0) {
+      /* Let the handler find out what went wrong. */
+      reactorMark(reactor, watch, EPOLLERR);
+    } else {
+      reactorMark(reactor, watch, cqe->res);
+      /* The kernel may end a multishot poll, e.g. on CQ overflow. */
+      if (!(watch->inflight[REACTOR_POLL]))
+        reactorArm(reactor, watch);
+    }
+    uringSeen(&(reactor->uring));
+  }
+  return 0;
+}
+
+/*
+ * Hand the completions held over to their handlers, including those
+ * that come in while they run. A fatal error leaves the rest for later.
+ */
+static int reactorDispatch(struct Reactor *reactor)
+{
+  struct Completion done;
+  const uint8_t *data = NULL;
+  int ret = 0;
+
+  while ((!(ret < 0)) && ((reactor->doneNext) < (reactor->doneCount))) {
+    done = reactor->done[reactor->doneNext++];
+    if (!(done.watch))
+      continue;
+    data = NULL;
+    if (done.flags & IORING_CQE_F_BUFFER)
+      data = uringBuffer(&(reactor->buffers),
+                         done.flags >> IORING_CQE_BUFFER_SHIFT);
+    ret = done.watch->complete(done.watch, done.op, done.res, data,
+                               reactor->ctx);
+    reactorRecycle(reactor, done.flags);
+  }
+  if ((reactor->doneNext) == (reactor->doneCount)) {
+    reactor->doneNext = 0U;
+    reactor->doneCount = 0U;
+  }
+  return ret;
+}
+
+/*
+ * With no backend given or the io_uring one not available, epoll is
+ * used. With io_uring, watches may make requests of their own if the
+ * kernel is recent enough, see reactorCompletes().
+ */
+int reactorInit(struct Reactor *reactor, void *ctx, int backend)
+{
+  assert(reactor);
+  memset(reactor, 0, sizeof(struct Reactor));
+  reactor->pending = NULL;
+  reactor->pendingTail = NULL;
+  reactor->sigmask = NULL;
+  reactor->ctx = ctx;
+  reactor->woke = 0U;
+  reactor->epfd = -1;
+  reactor->uring.fd = -1;
+  if ((backend == REACTOR_IO_URING)
+      && (!(uringInit(&(reactor->uring), URING_ENTRIES) < 0))) {
+    reactor->backend = REACTOR_IO_URING;
+    /* Without a buffer ring (before 5.19) there is only polling. */
+    reactor->completes =
+      !(uringBuffersInit(&(reactor->uring), &(reactor->buffers), 0U,
+                         URING_BUFFERS, URING_BUFFER_SIZE) < 0);
+    return 0;
+  }
+  reactor->backend = REACTOR_EPOLL;
+  reactor->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if ((reactor->epfd) < 0)
+    return -1;
+  return 0;
+}
+
+int reactorAdd(struct Reactor *reactor, struct Watch *watch)
+{
+  struct epoll_event ev;
+  struct stat st;
+
+  assert(reactor);
+  assert(watch);
+  assert(!((watch->fd) < 0));
+  assert(watch->handler);
+  watch->nextPending = NULL;
+  watch->pending = 0;
+  watch->pendingEvents = 0U;
+  watch->polled = 0;
+  watch->deleting = 0;
+  memset(watch->inflight, 0, sizeof watch->inflight);
+  watch->again = 0U;
+  if ((reactor->backend) == REACTOR_IO_URING) {
+    if (watch->complete) {
+      assert(reactor->completes);
+      reactorMark(reactor, watch, watch->events);
+      return 0;
+    }
+    if (fstat(watch->fd, &st) < 0)
+      return -1;
+    if (S_ISREG(st.st_mode)) {
+      watch->polled = !0;
+      reactorMark(reactor, watch, watch->events);
+      return 0;
+    }
+    return reactorArm(reactor, watch);
+  }
+  memset(&ev, 0, sizeof ev);
+  ev.events = (watch->events) | EPOLLET;
+  ev.data.ptr = watch;
+  if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, watch->fd, &ev) < 0) {
+    if (errno != EPERM)
+      return -1;
+    /*
+     * Regular files cannot be watched, yet they are always ready.
+     * Treat them as if they have just signalled their edge, the
+     * handler keeps them going by returning a positive value.
+     */
+    watch->polled = !0;
+    reactorMark(reactor, watch, watch->events);
+  }
+  return 0;
+}
+
+/* Ask for a request of the watch to end early, it still completes. */
+void reactorCancel(struct Reactor *reactor, struct Watch *watch, int op)
+{
+  struct io_uring_sqe *sqe = NULL;
+
+  sqe = uringSqe(&(reactor->uring));
+  if (!sqe)
+    return;
+  sqe->opcode = (op == REACTOR_POLL) ? IORING_OP_POLL_REMOVE
+                                     : IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = reactorTag(watch, op);
+  if (op != REACTOR_POLL)
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+  sqe->user_data = 0U;
+}
+
+/*
+ * Completions for a poll or any other request may still be on their
+ * way after it was asked to go, and the kernel may still be at the
+ * memory a request points to, so wait for the last one before the
+ * watch can be reused. Those held for the handlers are let go. A
+ * cancel that catches a request busy completing is made again.
+ */
+static void reactorDisarm(struct Reactor *reactor, struct Watch *watch)
+{
+  size_t i;
+  int op;
+
+  for (i = reactor->doneNext; i < (reactor->doneCount); i++) {
+    if ((reactor->done[i].watch) != watch)
+      continue;
+    reactor->done[i].watch = NULL;
+    reactorRecycle(reactor, reactor->done[i].flags);
+  }
+  watch->again = 0U;
+  if (!(reactorInflight(watch)))
+    return;
+  watch->deleting = !0;
+  reactor->cancelBusy = !0;
+  reactorReap(reactor);
+  while (reactorInflight(watch)) {
+    if (reactor->cancelBusy) {
+      reactor->cancelBusy = 0;
+      for (op = 0; op < REACTOR_OPS; op++) {
+        if (watch->inflight[op])
+          reactorCancel(reactor, watch, op);
+      }
+    }
+    if ((uringEnter(&(reactor->uring), !0, NULL, -1) < 0)
+        && (errno != EINTR))
+      break;
+    if (reactorReap(reactor) < 0)
+      break;
+  }
+  memset(watch->inflight, 0, sizeof watch->inflight);
+  watch->deleting = 0;
+}
+
+void reactorDel(struct Reactor *reactor, struct Watch *watch)
+{
+  struct Watch *prev = NULL;
+  struct Watch *iter = NULL;
+
+  assert(reactor);
+  assert(watch);
+  if ((reactor->backend) == REACTOR_IO_URING) {
+    reactorDisarm(reactor, watch);
+  } else if ((!(watch->polled)) && (!((watch->fd) < 0))) {
+    epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, watch->fd, NULL);
+  }
+  if (!(watch->pending))
+    return;
+  iter = reactor->pending;
+  while (iter) {
+    if (iter == watch) {
+      if (prev)
+        prev->nextPending = iter->nextPending;
+      else
+        reactor->pending = iter->nextPending;
+      if (reactor->pendingTail == iter)
+        reactor->pendingTail = prev;
+      break;
+    }
+    prev = iter;
+    iter = iter->nextPending;
+  }
+  watch->nextPending = NULL;
+  watch->pending = 0;
+  watch->pendingEvents = 0U;
+}
+
+/*
+ * Have the handler of a watch run on the next turn as if the given
+ * events had come in, e.g. once the reason it backed off has gone.
+ */
+void reactorPend(struct Reactor *reactor, struct Watch *watch,
+                 uint32_t events)
+{
+  assert(reactor);
+  assert(watch);
+  reactorMark(reactor, watch, events);
+}
+
+void reactorSigmask(struct Reactor *reactor, const sigset_t *sigmask)
+{
+  assert(reactor);
+  reactor->sigmask = sigmask;
+}
+
+/*
+ * Whether watches with a completion handler can be added, only ever
+ * with the io_uring backend.
+ */
+int reactorCompletes(const struct Reactor *reactor)
+{
+  assert(reactor);
+  return reactor->completes;
+}
+
+/* Requests of the kind given the watch has in flight. */
+unsigned reactorBusy(const struct Watch *watch, int op)
+{
+  assert(watch);
+  assert((op >= 0) && (op < REACTOR_OPS));
+  return watch->inflight[op];
+}
+
+/* Every connection that comes in, until the kernel ends it. */
+int reactorAccept(struct Reactor *reactor, struct Watch *watch)
+{
+  struct io_uring_sqe *sqe = NULL;
+
+  assert(reactor);
+  assert(watch);
+  sqe = reactorRequest(reactor, watch, REACTOR_ACCEPT, EPOLLIN);
+  if (!sqe)
+    return -1;
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  return 0;
+}
+
+/*
+ * Up to size bytes into whichever buffer of the ring the kernel picks
+ * once they are there, no more than a buffer holds.
+ */
+int reactorRecv(struct Reactor *reactor, struct Watch *watch, size_t size)
+{
+  struct io_uring_sqe *sqe = NULL;
+
+  assert(reactor);
+  assert(watch);
+  assert(size > 0U);
+  sqe = reactorRequest(reactor, watch, REACTOR_RECV, EPOLLIN);
+  if (!sqe)
+    return -1;
+  sqe->opcode = IORING_OP_RECV;
+  sqe->len = (size < (reactor->buffers.size)) ? size
+                                               : (reactor->buffers.size);
+  sqe->flags |= IOSQE_BUFFER_SELECT;
+  sqe->buf_group = reactor->buffers.group;
+  return 0;
+}
+
+/* The message and whatever it points to has to stay until completion. */
+int reactorSend(struct Reactor *reactor, struct Watch *watch,
+                const struct msghdr *msg, int flags)
+{
+  struct io_uring_sqe *sqe = NULL;
+
+  assert(reactor);
+  assert(watch);
+  assert(msg);
+  sqe = reactorRequest(reactor, watch, REACTOR_SEND, EPOLLOUT);
+  if (!sqe)
+    return -1;
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->addr = (uint64_t)((uintptr_t)(msg));
+  sqe->len = 1U;
+  sqe->msg_flags = (uint32_t)(flags);
+  return 0;
+}
+
+/* From where the descriptor is at, a pipe or a terminal as well. */
+int reactorRead(struct Reactor *reactor, struct Watch *watch, uint8_t *data,
+                size_t size)
+{
+  struct io_uring_sqe *sqe = NULL;
+
+  assert(reactor);
+  assert(watch);
+  assert(data);
+  sqe = reactorRequest(reactor, watch, REACTOR_READ, EPOLLIN);
+  if (!sqe)
+    return -1;
+  sqe->opcode = IORING_OP_READ;
+  sqe->addr = (uint64_t)((uintptr_t)(data));
+  sqe->len = (uint32_t)(size);
+  sqe->off = (uint64_t)(-1);
+  return 0;
+}
+
+int reactorWrite(struct Reactor *reactor, struct Watch *watch,
+                 const uint8_t *data, size_t size)
+{
+  struct io_uring_sqe *sqe = NULL;
+
+  assert(reactor);
+  assert(watch);
+  assert(data);
+  sqe = reactorRequest(reactor, watch, REACTOR_WRITE, EPOLLOUT);
+  if (!sqe)
+    return -1;
+  sqe->opcode = IORING_OP_WRITE;
+  sqe->addr = (uint64_t)((uintptr_t)(data));
+  sqe->len = (uint32_t)(size);
+  sqe->off = (uint64_t)(-1);
+  return 0;
+}
+
+int reactorRun(struct Reactor *reactor, int timeout)
+{
+  struct epoll_event events[REACTOR_MAX_EVENTS];
+  struct Watch *watch = NULL;
+  struct Watch *ready = NULL;
+  uint32_t mask;
+  int count;
+  int ret;
+  int i;
+
+  assert(reactor);
+  if ((reactor->pending) || ((reactor->doneNext) < (reactor->doneCount)))
+    timeout = 0;
+  if ((reactor->backend) == REACTOR_IO_URING) {
+    if ((uringEnter(&(reactor->uring), !!timeout, reactor->sigmask,
+                    timeout) < 0) && (errno != EINTR))
+      return -1;
+    if (reactorReap(reactor) < 0)
+      return -1;
+  } else {
+    assert(!((reactor->epfd) < 0));
+    count = epoll_pwait(reactor->epfd, events, REACTOR_MAX_EVENTS, timeout,
+                        reactor->sigmask);
+    if (count < 0) {
+      if (errno != EINTR)
+        return -1;
+      count = 0;
+    }
+    for (i = 0; i < count; i++)
+      reactorMark(reactor, (struct Watch *)(events[i].data.ptr),
+                  events[i].events);
+  }
+  reactor->woke = metricsClock();
+  /* Completions first, their handlers kick the watches to go on. */
+  if (reactorDispatch(reactor) < 0)
+    return -1;
+  ready = reactor->pending;
+  reactor->pending = NULL;
+  reactor->pendingTail = NULL;
+  while (ready) {
+    watch = ready;
+    ready = watch->nextPending;
+    mask = watch->pendingEvents;
+    watch->nextPending = NULL;
+    watch->pending = 0;
+    watch->pendingEvents = 0U;
+    ret = watch->handler(watch, mask, reactor->ctx);
+    if (ret < 0) {
+      while (ready) {
+        watch = ready;
+        ready = watch->nextPending;
+        watch->pending = 0;
+        reactorMark(reactor, watch, watch->pendingEvents);
+      }
+      return -1;
+    }
+    if (ret > 0)
+      reactorMark(reactor, watch, mask);
+  }
+  return 0;
+}
+
+void reactorStop(struct Reactor *reactor)
+{
+  assert(reactor);
+  if (!((reactor->epfd) < 0))
+    close(reactor->epfd);
+  reactor->epfd = -1;
+  if ((reactor->backend) == REACTOR_IO_URING)
+    uringStop(&(reactor->uring));
+  if (reactor->completes)
+    uringBuffersFree(&(reactor->buffers));
+  reactor->completes = 0;
+  free(reactor->done);
+  reactor->done = NULL;
+  reactor->doneCount = 0U;
+  reactor->doneNext = 0U;
+  reactor->doneSize = 0U;
+  reactor->backend = REACTOR_EPOLL;
+  reactor->pending = NULL;
+  reactor->pendingTail = NULL;
+}
+
+/* Milliseconds on a clock that does not jump, for reactorRun() timeouts. */
+uint64_t reactorClock(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (((uint64_t)(ts.tv_sec)) * 1000U) + (ts.tv_nsec / 1000000L);
+}
@@ -0,0 +1,162 @@
+/*
+ * reactor.h - Edge-triggered event loop interface.
+ *
+ * Written in 2020 by Paul Osmialowski <pawelo@king.net.pl>.
+ *
+ * To the extent possible under law, the author(s) have dedicated all
+ * copyright and related and neighboring rights to this software to
+ * the public domain worldwide. This software is distributed without
+ * any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication
+ * along with this software. If not, see
+ * <http://creativecommons.org/publicdomain/zero/1.0>.
+ */
+
+#ifndef __REACTOR_H
+#define __REACTOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "uring.h"
+
+#define REACTOR_MAX_EVENTS 64
+
+/* Most bytes a write request takes at once, see struct ReactorOut. */
+#ifndef REACTOR_WRITE_CHUNK
+#define REACTOR_WRITE_CHUNK 4096U
+#endif
+
+struct Watch;
+
+/*
+ * Called with the epoll events that became ready for the watched
+ * descriptor. Returns a negative value on a fatal error, zero once
+ * the descriptor has been drained (EAGAIN seen) and a positive value
+ * when there is more work left, in which case the handler is called
+ * again on the next turn without waiting.
+ */
+typedef int (*WatchHandler)(struct Watch *watch, uint32_t events, void *ctx);
+
+/*
+ * What a request made for a watch on the io_uring backend is for, in
+ * the low bits of its user data, the watch being in the rest of them.
+ */
+enum
+{
+  REACTOR_POLL = 0,
+  REACTOR_WAIT, /* a poll linked ahead of a request that found EAGAIN */
+  REACTOR_ACCEPT,
+  REACTOR_RECV,
+  REACTOR_SEND,
+  REACTOR_READ,
+  REACTOR_WRITE,
+  REACTOR_OPS
+};
+
+/*
+ * Called with what a request made for the watch came back with: a new
+ * descriptor, a byte count or a negative errno value, and for a receive
+ * the data, good until the handler returns. Returns a negative value on
+ * a fatal error. Whatever is to be done next is best left to the watch
+ * handler by way of reactorPend(), that one runs on the same turn.
+ */
+typedef int (*CompleteHandler)(struct Watch *watch, int op, int res,
+                               const uint8_t *data, void *ctx);
+
+struct Watch
+{
+  struct Watch *nextPending;
+  int fd;
+  uint32_t events;
+  uint32_t pendingEvents;
+  int pending;
+  int polled;
+  int deleting;
+  unsigned inflight[REACTOR_OPS];
+  uint32_t again; /* requests to wait for readiness next time, by op */
+  WatchHandler handler;
+  CompleteHandler complete; /* makes requests rather than wait for events */
+  void *data;
+};
+
+/*
+ * With the io_uring backend, a watch with no completion handler keeps
+ * a multishot poll armed and gets its events in epoll terms, the same
+ * as with epoll. A watch with a completion handler is not polled at all:
+ * its handler is called once it is added and then whenever it is kicked
+ * with reactorPend(), to make the requests it needs (reactorAccept() and
+ * the like), and their outcome goes to the completion handler. None of
+ * the requests costs a syscall of its own, they all go in with the wait.
+ */
+enum
+{
+  REACTOR_EPOLL = 0,
+  REACTOR_IO_URING
+};
+
+/* A completion held until the handlers run. */
+struct Completion
+{
+  struct Watch *watch;
+  int op;
+  int res;
+  uint32_t flags;
+};
+
+struct Reactor
+{
+  int backend;
+  int completes;
+  int cancelBusy; /* a cancel found its request on the way out, try again */
+  int epfd;
+  struct Uring uring;
+  struct UringBuffers buffers;
+  struct Completion *done;
+  size_t doneCount;
+  size_t doneNext;
+  size_t doneSize;
+  struct Watch *pending;
+  struct Watch *pendingTail;
+  const sigset_t *sigmask;
+  void *ctx;
+  uint64_t woke; /* when the last wait ended, metricsClock() microseconds */
+};
+
+/*
+ * Bytes handed over to a write request, kept aside until it completes
+ * as the ring they came from may be written over meanwhile.
+ */
+struct ReactorOut
+{
+  uint8_t data[REACTOR_WRITE_CHUNK];
+  size_t size;
+  size_t done;
+};
+
+int reactorInit(struct Reactor *reactor, void *ctx, int backend);
+int reactorAdd(struct Reactor *reactor, struct Watch *watch);
+void reactorDel(struct Reactor *reactor, struct Watch *watch);
+void reactorPend(struct Reactor *reactor, struct Watch *watch,
+                 uint32_t events);
+void reactorSigmask(struct Reactor *reactor, const sigset_t *sigmask);
+int reactorCompletes(const struct Reactor *reactor);
+unsigned reactorBusy(const struct Watch *watch, int op);
+int reactorAccept(struct Reactor *reactor, struct Watch *watch);
+int reactorRecv(struct Reactor *reactor, struct Watch *watch, size_t size);
+int reactorSend(struct Reactor *reactor, struct Watch *watch,
+                const struct msghdr *msg, int flags);
+int reactorRead(struct Reactor *reactor, struct Watch *watch, uint8_t *data,
+                size_t size);
+int reactorWrite(struct Reactor *reactor, struct Watch *watch,
+                 const uint8_t *data, size_t size);
+void reactorCancel(struct Reactor *reactor, struct Watch *watch, int op);
+int reactorRun(struct Reactor *reactor, int timeout);
+void reactorStop(struct Reactor *reactor);
+uint64_t reactorClock(void);
+
+#endif /* __REACTOR_H */
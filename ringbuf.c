@@ -13,15 +13,21 @@
  * <http://creativecommons.org/publicdomain/zero/1.0/>.
  */
 
+#define _GNU_SOURCE
+
 #include "ringbuf.h"
 
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/socket.h>
 #include <unistd.h>
 #include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <assert.h>
+#include <stdatomic.h>
 
 /*
  * The code is written for clarity, not cleverness or performance, and
@@ -31,49 +37,110 @@
  * intended.
  */
 
+/*
+ * The buffer size is a power of two and the head and tail are
+ * free-running byte counts rather than pointers: their difference is
+ * the number of bytes used, and masking either one with the buffer
+ * size minus one gives its position in the buffer. Hence all of the
+ * buffer is usable, and nothing needs wrapping but the masked
+ * positions. The header and the storage come in one allocation.
+ *
+ * A mirrored ring buffer has its storage mapped twice in a row
+ * instead, so that any span of up to the buffer size starting within
+ * the first mapping is contiguous.
+ */
 struct ringbuf_t
 {
+    size_t head, tail;
+    size_t mask;
     uint8_t *buf;
-    uint8_t *head, *tail;
-    size_t size;
+    int mirrored;
+    uint8_t storage[];
 };
 
 ringbuf_t
 ringbuf_new(size_t capacity)
 {
-    ringbuf_t rb = malloc(sizeof(struct ringbuf_t));
+    size_t size = 1;
+    while (size < capacity)
+        size <<= 1;
+
+    ringbuf_t rb = malloc(sizeof(struct ringbuf_t) + size);
     if (rb) {
+        rb->mask = size - 1;
+        rb->buf = rb->storage;
+        rb->mirrored = 0;
+        ringbuf_reset(rb);
+    }
+    return rb;
+}
 
-        /* One byte is used for detecting the full condition. */
-        rb->size = capacity + 1;
-        rb->buf = malloc(rb->size);
-        if (rb->buf)
-            ringbuf_reset(rb);
-        else {
-            free(rb);
-            return 0;
-        }
+ringbuf_t
+ringbuf_new_mirrored(size_t capacity)
+{
+    size_t size = sysconf(_SC_PAGESIZE);
+    while (size < capacity)
+        size <<= 1;
+
+    ringbuf_t rb = malloc(sizeof(struct ringbuf_t));
+    if (!rb)
+        return 0;
+
+    int fd = memfd_create("ringbuf", MFD_CLOEXEC);
+    if (fd < 0) {
+        free(rb);
+        return ringbuf_new(capacity);
+    }
+
+    /* Reserve room for both views first, then lay them over it. */
+    uint8_t *base = MAP_FAILED;
+    if (ftruncate(fd, size) == 0)
+        base = mmap(0, size << 1, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS,
+                    -1, 0);
+    if ((base == MAP_FAILED)
+        || (mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                 fd, 0) == MAP_FAILED)
+        || (mmap(base + size, size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)) {
+        if (base != MAP_FAILED)
+            munmap(base, size << 1);
+        close(fd);
+        free(rb);
+        return ringbuf_new(capacity);
     }
+    close(fd);
+
+    rb->mask = size - 1;
+    rb->buf = base;
+    rb->mirrored = 1;
+    ringbuf_reset(rb);
     return rb;
 }
 
+int
+ringbuf_is_mirrored(const struct ringbuf_t *rb)
+{
+    return rb->mirrored;
+}
+
 size_t
 ringbuf_buffer_size(const struct ringbuf_t *rb)
 {
-    return rb->size;
+    return rb->mask + 1;
 }
 
 void
 ringbuf_reset(ringbuf_t rb)
 {
-    rb->head = rb->tail = rb->buf;
+    rb->head = rb->tail = 0;
 }
 
 void
 ringbuf_free(ringbuf_t *rb)
 {
     assert(rb && *rb);
-    free((*rb)->buf);
+    if ((*rb)->mirrored)
+        munmap((*rb)->buf, ringbuf_buffer_size(*rb) << 1);
     free(*rb);
     *rb = 0;
 }
@@ -81,33 +148,46 @@ ringbuf_free(ringbuf_t *rb)
 size_t
 ringbuf_capacity(const struct ringbuf_t *rb)
 {
-    return ringbuf_buffer_size(rb) - 1;
+    return ringbuf_buffer_size(rb);
+}
+
+/*
+ * Return the number of bytes between the position of the given index
+ * and the end of the ring buffer's contiguous buffer. You shouldn't
+ * normally need to use this function unless you're writing a new
+ * ringbuf_* function.
+ */
+static size_t
+ringbuf_contig(const struct ringbuf_t *rb, size_t index)
+{
+    if (rb->mirrored)
+        return ringbuf_buffer_size(rb);
+    return ringbuf_buffer_size(rb) - (index & rb->mask);
 }
 
 /*
- * Return a pointer to one-past-the-end of the ring buffer's
- * contiguous buffer. You shouldn't normally need to use this function
- * unless you're writing a new ringbuf_* function.
+ * Drop the oldest bytes after the head has been moved past the
+ * capacity of the ring buffer.
  */
-static const uint8_t *
-ringbuf_end(const struct ringbuf_t *rb)
+static void
+ringbuf_overflow(ringbuf_t rb)
 {
-    return rb->buf + ringbuf_buffer_size(rb);
+    if (rb->head - rb->tail > ringbuf_capacity(rb)) {
+        rb->tail = rb->head - ringbuf_capacity(rb);
+        assert(ringbuf_is_full(rb));
+    }
 }
 
 size_t
 ringbuf_bytes_free(const struct ringbuf_t *rb)
 {
-    if (rb->head >= rb->tail)
-        return ringbuf_capacity(rb) - (rb->head - rb->tail);
-    else
-        return rb->tail - rb->head - 1;
+    return ringbuf_capacity(rb) - ringbuf_bytes_used(rb);
 }
 
 size_t
 ringbuf_bytes_used(const struct ringbuf_t *rb)
 {
-    return ringbuf_capacity(rb) - ringbuf_bytes_free(rb);
+    return rb->head - rb->tail;
 }
 
 int
@@ -119,84 +199,52 @@ ringbuf_is_full(const struct ringbuf_t *rb)
 int
 ringbuf_is_empty(const struct ringbuf_t *rb)
 {
-    return ringbuf_bytes_free(rb) == ringbuf_capacity(rb);
+    return ringbuf_bytes_used(rb) == 0;
 }
 
 const void *
 ringbuf_tail(const struct ringbuf_t *rb)
 {
-    return rb->tail;
+    return rb->buf + (rb->tail & rb->mask);
 }
 
 const void *
 ringbuf_head(const struct ringbuf_t *rb)
 {
-    return rb->head;
-}
-
-/*
- * Given a ring buffer rb and a pointer to a location within its
- * contiguous buffer, return the a pointer to the next logical
- * location in the ring buffer.
- */
-static uint8_t *
-ringbuf_nextp(ringbuf_t rb, const uint8_t *p)
-{
-    /*
-     * The assert guarantees the expression (++p - rb->buf) is
-     * non-negative; therefore, the modulus operation is safe and
-     * portable.
-     */
-    assert((p >= rb->buf) && (p < ringbuf_end(rb)));
-    return rb->buf + ((++p - rb->buf) % ringbuf_buffer_size(rb));
+    return rb->buf + (rb->head & rb->mask);
 }
 
 size_t
 ringbuf_findchr(const struct ringbuf_t *rb, int c, size_t offset)
 {
-    const uint8_t *bufend = ringbuf_end(rb);
     size_t bytes_used = ringbuf_bytes_used(rb);
-    if (offset >= bytes_used)
-        return bytes_used;
 
-    const uint8_t *start = rb->buf +
-        (((rb->tail - rb->buf) + offset) % ringbuf_buffer_size(rb));
-    assert(bufend > start);
-    size_t n = MIN(bufend - start, bytes_used - offset);
-    const uint8_t *found = memchr(start, c, n);
-    if (found)
-        return offset + (found - start);
-    else
-        return ringbuf_findchr(rb, c, offset + n);
+    while (offset < bytes_used) {
+        size_t index = rb->tail + offset;
+        const uint8_t *start = rb->buf + (index & rb->mask);
+        size_t n = MIN(ringbuf_contig(rb, index), bytes_used - offset);
+        const uint8_t *found = memchr(start, c, n);
+        if (found)
+            return offset + (found - start);
+        offset += n;
+    }
+    return bytes_used;
 }
 
 size_t
 ringbuf_memset(ringbuf_t dst, int c, size_t len)
 {
-    const uint8_t *bufend = ringbuf_end(dst);
     size_t nwritten = 0;
     size_t count = MIN(len, ringbuf_buffer_size(dst));
-    int overflow = count > ringbuf_bytes_free(dst);
 
     while (nwritten != count) {
-
-        /* don't copy beyond the end of the buffer */
-        assert(bufend > dst->head);
-        size_t n = MIN(bufend - dst->head, count - nwritten);
-        memset(dst->head, c, n);
+        size_t n = MIN(ringbuf_contig(dst, dst->head), count - nwritten);
+        memset(dst->buf + (dst->head & dst->mask), c, n);
         dst->head += n;
         nwritten += n;
-
-        /* wrap? */
-        if (dst->head == bufend)
-            dst->head = dst->buf;
-    }
-
-    if (overflow) {
-        dst->tail = ringbuf_nextp(dst, dst->head);
-        assert(ringbuf_is_full(dst));
     }
 
+    ringbuf_overflow(dst);
     return nwritten;
 }
 
@@ -204,54 +252,155 @@ void *
 ringbuf_memcpy_into(ringbuf_t dst, const void *src, size_t count)
 {
     const uint8_t *u8src = src;
-    const uint8_t *bufend = ringbuf_end(dst);
-    int overflow = count > ringbuf_bytes_free(dst);
     size_t nread = 0;
 
     while (nread != count) {
-        /* don't copy beyond the end of the buffer */
-        assert(bufend > dst->head);
-        size_t n = MIN(bufend - dst->head, count - nread);
-        memcpy(dst->head, u8src + nread, n);
+        size_t n = MIN(ringbuf_contig(dst, dst->head), count - nread);
+        memcpy(dst->buf + (dst->head & dst->mask), u8src + nread, n);
         dst->head += n;
         nread += n;
+    }
+
+    ringbuf_overflow(dst);
+    return (void *)ringbuf_head(dst);
+}
 
-        /* wrap? */
-        if (dst->head == bufend)
-            dst->head = dst->buf;
+ssize_t
+ringbuf_read(int fd, ringbuf_t rb, size_t count)
+{
+    /* don't write beyond the end of the buffer */
+    count = MIN(ringbuf_contig(rb, rb->head), count);
+    ssize_t n = read(fd, rb->buf + (rb->head & rb->mask), count);
+    if (n > 0) {
+        rb->head += n;
+        ringbuf_overflow(rb);
     }
 
-    if (overflow) {
-        dst->tail = ringbuf_nextp(dst, dst->head);
-        assert(ringbuf_is_full(dst));
+    return n;
+}
+
+ssize_t
+ringbuf_recv(int sock, ringbuf_t rb, size_t count, int flags)
+{
+    count = MIN(ringbuf_bytes_free(rb), count);
+    count = MIN(ringbuf_contig(rb, rb->head), count);
+    ssize_t n = recv(sock, rb->buf + (rb->head & rb->mask), count, flags);
+    if (n > 0) {
+        assert((size_t)n <= count);
+        rb->head += n;
     }
 
-    return dst->head;
+    return n;
+}
+
+size_t
+ringbuf_peek(const struct ringbuf_t *rb, const void **data)
+{
+    *data = ringbuf_tail(rb);
+    return MIN(ringbuf_contig(rb, rb->tail), ringbuf_bytes_used(rb));
+}
+
+void
+ringbuf_consume(ringbuf_t rb, size_t count)
+{
+    assert(count <= ringbuf_bytes_used(rb));
+    rb->tail += count;
+}
+
+/*
+ * Describe up to count bytes starting at the given index with at most
+ * two iovecs, the second one being needed only when the span wraps
+ * around the end of a plain ring buffer. Returns the number of iovecs.
+ */
+static int
+ringbuf_iov(const struct ringbuf_t *rb, size_t index, size_t count,
+            struct iovec *iov)
+{
+    size_t n = MIN(ringbuf_contig(rb, index), count);
+    iov[0].iov_base = rb->buf + (index & rb->mask);
+    iov[0].iov_len = n;
+    if (n == count)
+        return 1;
+    iov[1].iov_base = rb->buf;
+    iov[1].iov_len = count - n;
+    return 2;
 }
 
 ssize_t
-ringbuf_read(int fd, ringbuf_t rb, size_t count)
+ringbuf_readv(int fd, ringbuf_t rb, size_t count)
 {
-    const uint8_t *bufend = ringbuf_end(rb);
-    size_t nfree = ringbuf_bytes_free(rb);
+    struct iovec iov[2];
 
-    /* don't write beyond the end of the buffer */
-    assert(bufend > rb->head);
-    count = MIN(bufend - rb->head, count);
-    ssize_t n = read(fd, rb->head, count);
+    count = MIN(ringbuf_bytes_free(rb), count);
+    if (!count)
+        return 0;
+    ssize_t n = readv(fd, iov, ringbuf_iov(rb, rb->head, count, iov));
     if (n > 0) {
-        assert(rb->head + n <= bufend);
+        assert((size_t)n <= count);
         rb->head += n;
+    }
 
-        /* wrap? */
-        if (rb->head == bufend)
-            rb->head = rb->buf;
+    return n;
+}
 
-        /* fix up the tail pointer if an overflow occurred */
-        if (n > nfree) {
-            rb->tail = ringbuf_nextp(rb, rb->head);
-            assert(ringbuf_is_full(rb));
-        }
+ssize_t
+ringbuf_writev(int fd, ringbuf_t rb, size_t count)
+{
+    struct iovec iov[2];
+
+    size_t bytes_used = ringbuf_bytes_used(rb);
+    if (count > bytes_used)
+        return 0;
+    if (!count)
+        return 0;
+    ssize_t n = writev(fd, iov, ringbuf_iov(rb, rb->tail, count, iov));
+    if (n > 0) {
+        rb->tail += n;
+        assert(n + ringbuf_bytes_used(rb) == bytes_used);
+    }
+
+    return n;
+}
+
+ssize_t
+ringbuf_recvmsg(int sock, ringbuf_t rb, size_t count, int flags)
+{
+    struct iovec iov[2];
+    struct msghdr msg;
+
+    count = MIN(ringbuf_bytes_free(rb), count);
+    if (!count)
+        return 0;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = ringbuf_iov(rb, rb->head, count, iov);
+    ssize_t n = recvmsg(sock, &msg, flags);
+    if (n > 0) {
+        assert((size_t)n <= count);
+        rb->head += n;
+    }
+
+    return n;
+}
+
+ssize_t
+ringbuf_sendmsg(int sock, ringbuf_t rb, size_t count, int flags)
+{
+    struct iovec iov[2];
+    struct msghdr msg;
+
+    size_t bytes_used = ringbuf_bytes_used(rb);
+    if (count > bytes_used)
+        return 0;
+    if (!count)
+        return 0;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = ringbuf_iov(rb, rb->tail, count, iov);
+    ssize_t n = sendmsg(sock, &msg, flags);
+    if (n > 0) {
+        rb->tail += n;
+        assert(n + ringbuf_bytes_used(rb) == bytes_used);
     }
 
     return n;
@@ -265,22 +414,16 @@ ringbuf_memcpy_from(void *dst, ringbuf_t src, size_t count)
         return 0;
 
     uint8_t *u8dst = dst;
-    const uint8_t *bufend = ringbuf_end(src);
     size_t nwritten = 0;
     while (nwritten != count) {
-        assert(bufend > src->tail);
-        size_t n = MIN(bufend - src->tail, count - nwritten);
-        memcpy(u8dst + nwritten, src->tail, n);
+        size_t n = MIN(ringbuf_contig(src, src->tail), count - nwritten);
+        memcpy(u8dst + nwritten, src->buf + (src->tail & src->mask), n);
         src->tail += n;
         nwritten += n;
-
-        /* wrap ? */
-        if (src->tail == bufend)
-            src->tail = src->buf;
     }
 
     assert(count + ringbuf_bytes_used(src) == bytes_used);
-    return src->tail;
+    return (void *)ringbuf_tail(src);
 }
 
 ssize_t
@@ -290,18 +433,27 @@ ringbuf_write(int fd, ringbuf_t rb, size_t count)
     if (count > bytes_used)
         return 0;
 
-    const uint8_t *bufend = ringbuf_end(rb);
-    assert(bufend > rb->head);
-    count = MIN(bufend - rb->tail, count);
-    ssize_t n = write(fd, rb->tail, count);
+    count = MIN(ringbuf_contig(rb, rb->tail), count);
+    ssize_t n = write(fd, rb->buf + (rb->tail & rb->mask), count);
     if (n > 0) {
-        assert(rb->tail + n <= bufend);
         rb->tail += n;
+        assert(n + ringbuf_bytes_used(rb) == bytes_used);
+    }
+
+    return n;
+}
 
-        /* wrap? */
-        if (rb->tail == bufend)
-            rb->tail = rb->buf;
+ssize_t
+ringbuf_send(int sock, ringbuf_t rb, size_t count, int flags)
+{
+    size_t bytes_used = ringbuf_bytes_used(rb);
+    if (count > bytes_used)
+        return 0;
 
+    count = MIN(ringbuf_contig(rb, rb->tail), count);
+    ssize_t n = send(sock, rb->buf + (rb->tail & rb->mask), count, flags);
+    if (n > 0) {
+        rb->tail += n;
         assert(n + ringbuf_bytes_used(rb) == bytes_used);
     }
 
@@ -314,34 +466,152 @@ ringbuf_copy(ringbuf_t dst, ringbuf_t src, size_t count)
     size_t src_bytes_used = ringbuf_bytes_used(src);
     if (count > src_bytes_used)
         return 0;
-    int overflow = count > ringbuf_bytes_free(dst);
 
-    const uint8_t *src_bufend = ringbuf_end(src);
-    const uint8_t *dst_bufend = ringbuf_end(dst);
     size_t ncopied = 0;
     while (ncopied != count) {
-        assert(src_bufend > src->tail);
-        size_t nsrc = MIN(src_bufend - src->tail, count - ncopied);
-        assert(dst_bufend > dst->head);
-        size_t n = MIN(dst_bufend - dst->head, nsrc);
-        memcpy(dst->head, src->tail, n);
+        size_t nsrc = MIN(ringbuf_contig(src, src->tail), count - ncopied);
+        size_t n = MIN(ringbuf_contig(dst, dst->head), nsrc);
+        memcpy(dst->buf + (dst->head & dst->mask),
+               src->buf + (src->tail & src->mask), n);
         src->tail += n;
         dst->head += n;
         ncopied += n;
-
-        /* wrap ? */
-        if (src->tail == src_bufend)
-            src->tail = src->buf;
-        if (dst->head == dst_bufend)
-            dst->head = dst->buf;
     }
 
     assert(count + ringbuf_bytes_used(src) == src_bytes_used);
-    
-    if (overflow) {
-        dst->tail = ringbuf_nextp(dst, dst->head);
-        assert(ringbuf_is_full(dst));
+    ringbuf_overflow(dst);
+    return (void *)ringbuf_head(dst);
+}
+
+/*
+ * Each index sits on a cache line of its own, together with the
+ * owning side's last look at the other index, so that neither side
+ * touches the line the other one keeps writing to unless it has run
+ * out of room (or of data).
+ */
+#define RINGBUF_SPSC_CACHELINE 64
+
+struct ringbuf_spsc_t
+{
+    /* Producer. */
+    _Alignas(RINGBUF_SPSC_CACHELINE) atomic_size_t head;
+    size_t tail_seen;
+
+    /* Consumer. */
+    _Alignas(RINGBUF_SPSC_CACHELINE) atomic_size_t tail;
+    size_t head_seen;
+
+    /* Read-only. */
+    _Alignas(RINGBUF_SPSC_CACHELINE) size_t size;
+    uint8_t *buf;
+};
+
+ringbuf_spsc_t
+ringbuf_spsc_new(size_t capacity)
+{
+    size_t size = 1;
+    while (size < capacity)
+        size <<= 1;
+
+    ringbuf_spsc_t rb = aligned_alloc(RINGBUF_SPSC_CACHELINE,
+                                      sizeof(struct ringbuf_spsc_t));
+    if (rb) {
+        rb->size = size;
+        rb->buf = malloc(rb->size);
+        if (!rb->buf) {
+            free(rb);
+            return 0;
+        }
+        atomic_init(&rb->head, 0);
+        atomic_init(&rb->tail, 0);
+        rb->tail_seen = 0;
+        rb->head_seen = 0;
     }
+    return rb;
+}
+
+void
+ringbuf_spsc_free(ringbuf_spsc_t *rb)
+{
+    assert(rb && *rb);
+    free((*rb)->buf);
+    free(*rb);
+    *rb = 0;
+}
+
+size_t
+ringbuf_spsc_capacity(const struct ringbuf_spsc_t *rb)
+{
+    return rb->size;
+}
 
-    return dst->head;
+size_t
+ringbuf_spsc_bytes_used(const struct ringbuf_spsc_t *rb)
+{
+    size_t tail = atomic_load_explicit(&((struct ringbuf_spsc_t *)rb)->tail,
+                                       memory_order_acquire);
+    size_t head = atomic_load_explicit(&((struct ringbuf_spsc_t *)rb)->head,
+                                       memory_order_acquire);
+    return head - tail;
+}
+
+size_t
+ringbuf_spsc_reserve(ringbuf_spsc_t rb, void **data)
+{
+    size_t head = atomic_load_explicit(&rb->head, memory_order_relaxed);
+
+    /* Only look at the consumer's index when out of room. */
+    if (head - rb->tail_seen == rb->size)
+        rb->tail_seen = atomic_load_explicit(&rb->tail, memory_order_acquire);
+    size_t bytes_free = rb->size - (head - rb->tail_seen);
+    size_t offset = head & (rb->size - 1);
+    *data = rb->buf + offset;
+    return MIN(bytes_free, rb->size - offset);
+}
+
+void
+ringbuf_spsc_commit(ringbuf_spsc_t rb, size_t count)
+{
+    size_t head = atomic_load_explicit(&rb->head, memory_order_relaxed);
+    assert(head + count - rb->tail_seen <= rb->size);
+    atomic_store_explicit(&rb->head, head + count, memory_order_release);
+}
+
+size_t
+ringbuf_spsc_memcpy_into(ringbuf_spsc_t rb, const void *src, size_t count)
+{
+    const uint8_t *u8src = src;
+    size_t head = atomic_load_explicit(&rb->head, memory_order_relaxed);
+
+    if (rb->size - (head - rb->tail_seen) < count)
+        rb->tail_seen = atomic_load_explicit(&rb->tail, memory_order_acquire);
+    count = MIN(count, rb->size - (head - rb->tail_seen));
+
+    size_t offset = head & (rb->size - 1);
+    size_t n = MIN(count, rb->size - offset);
+    memcpy(rb->buf + offset, u8src, n);
+    memcpy(rb->buf, u8src + n, count - n);
+    atomic_store_explicit(&rb->head, head + count, memory_order_release);
+    return count;
+}
+
+size_t
+ringbuf_spsc_peek(ringbuf_spsc_t rb, const void **data)
+{
+    size_t tail = atomic_load_explicit(&rb->tail, memory_order_relaxed);
+
+    /* Only look at the producer's index when out of data. */
+    if (rb->head_seen == tail)
+        rb->head_seen = atomic_load_explicit(&rb->head, memory_order_acquire);
+    size_t offset = tail & (rb->size - 1);
+    *data = rb->buf + offset;
+    return MIN(rb->head_seen - tail, rb->size - offset);
+}
+
+void
+ringbuf_spsc_consume(ringbuf_spsc_t rb, size_t count)
+{
+    size_t tail = atomic_load_explicit(&rb->tail, memory_order_relaxed);
+    assert(count <= rb->head_seen - tail);
+    atomic_store_explicit(&rb->tail, tail + count, memory_order_release);
 }
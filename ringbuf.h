@@ -32,9 +32,9 @@
 typedef struct ringbuf_t *ringbuf_t;
 
 /*
- * Create a new ring buffer with the given capacity (usable
- * bytes). Note that the actual internal buffer size may be one or
- * more bytes larger than the usable capacity, for bookkeeping.
+ * Create a new ring buffer with at least the given capacity (usable
+ * bytes). The capacity is rounded up to a power of two, and the ring
+ * buffer object and its storage are allocated together.
  *
  * Returns the new ring buffer object, or 0 if there's not enough
  * memory to fulfill the request for the given capacity.
@@ -43,12 +43,26 @@ ringbuf_t
 ringbuf_new(size_t capacity);
 
 /*
- * The size of the internal buffer, in bytes. One or more bytes may be
- * unusable in order to distinguish the "buffer full" state from the
- * "buffer empty" state.
+ * Create a new mirrored ring buffer with at least the given
+ * capacity. Its storage is mapped twice, back to back, so that the
+ * bytes used as well as the bytes free always form one contiguous
+ * span and every function below moves them in one go, with no
+ * splitting at the end of the buffer. The capacity is rounded up to a
+ * power of two no smaller than the page size.
  *
- * For the usable capacity of the ring buffer, use the
- * ringbuf_capacity function.
+ * Where the system cannot provide the mapping, a plain ring buffer is
+ * returned instead (see ringbuf_is_mirrored). Returns 0 if there's
+ * not enough memory for either.
+ */
+ringbuf_t
+ringbuf_new_mirrored(size_t capacity);
+
+int
+ringbuf_is_mirrored(const struct ringbuf_t *rb);
+
+/*
+ * The size of the internal buffer, in bytes. All of it is usable,
+ * hence this is the same as ringbuf_capacity.
  */
 size_t
 ringbuf_buffer_size(const struct ringbuf_t *rb);
@@ -67,9 +81,7 @@ void
 ringbuf_reset(ringbuf_t rb);
 
 /*
- * The usable capacity of the ring buffer, in bytes. Note that this
- * value may be less than the ring buffer's internal buffer size, as
- * returned by ringbuf_buffer_size.
+ * The usable capacity of the ring buffer, in bytes.
  */
 size_t
 ringbuf_capacity(const struct ringbuf_t *rb);
@@ -173,6 +185,30 @@ ringbuf_memcpy_into(ringbuf_t dst, const void *src, size_t count);
 ssize_t
 ringbuf_read(int fd, ringbuf_t rb, size_t count);
 
+/*
+ * Same as ringbuf_read, but calls recv(2) on the socket sock with the
+ * given flags instead of read(2), and never overflows: no more than
+ * the number of free bytes is received.
+ */
+ssize_t
+ringbuf_recv(int sock, ringbuf_t rb, size_t count, int flags);
+
+/*
+ * Get the contiguous span of used bytes starting at the ring buffer's
+ * tail pointer, storing its address in data and returning its size.
+ * For a mirrored ring buffer this is all of the bytes used. The bytes
+ * stay in the ring buffer until dropped with ringbuf_consume.
+ */
+size_t
+ringbuf_peek(const struct ringbuf_t *rb, const void **data);
+
+/*
+ * Drop count bytes from the ring buffer's tail without copying them
+ * anywhere. count must not exceed the number of bytes used.
+ */
+void
+ringbuf_consume(ringbuf_t rb, size_t count);
+
 /*
  * Copy n bytes from the ring buffer src, starting from its tail
  * pointer, into a contiguous memory area dst. Returns the value of
@@ -214,6 +250,40 @@ ringbuf_memcpy_from(void *dst, ringbuf_t src, size_t count);
 ssize_t
 ringbuf_write(int fd, ringbuf_t rb, size_t count);
 
+/*
+ * Same as ringbuf_write, but calls send(2) on the socket sock with
+ * the given flags (e.g., MSG_NOSIGNAL) instead of write(2).
+ */
+ssize_t
+ringbuf_send(int sock, ringbuf_t rb, size_t count, int flags);
+
+/*
+ * Scatter-gather counterparts of ringbuf_read and ringbuf_write: fill
+ * or drain up to count bytes with a single readv(2) or writev(2),
+ * covering both sides of the wrap point at once. Unlike ringbuf_read,
+ * ringbuf_readv never overflows: no more than the number of free
+ * bytes is read. Same as the others, ringbuf_writev will not
+ * underflow and writes nothing if count is greater than the number of
+ * bytes used. Both return the value returned by the syscall, or 0 if
+ * there was nothing to do.
+ */
+ssize_t
+ringbuf_readv(int fd, ringbuf_t rb, size_t count);
+
+ssize_t
+ringbuf_writev(int fd, ringbuf_t rb, size_t count);
+
+/*
+ * Same as ringbuf_readv and ringbuf_writev, but call recvmsg(2) and
+ * sendmsg(2) on the socket sock with the given flags (e.g.,
+ * MSG_NOSIGNAL).
+ */
+ssize_t
+ringbuf_recvmsg(int sock, ringbuf_t rb, size_t count, int flags);
+
+ssize_t
+ringbuf_sendmsg(int sock, ringbuf_t rb, size_t count, int flags);
+
 /*
  * Copy count bytes from ring buffer src, starting from its tail
  * pointer, into ring buffer dst. Returns dst's new head pointer after
@@ -240,4 +310,80 @@ ringbuf_write(int fd, ringbuf_t rb, size_t count);
 void *
 ringbuf_copy(ringbuf_t dst, ringbuf_t src, size_t count);
 
+/*
+ * A lock-free single-producer/single-consumer variant of the ring
+ * buffer, for handing bytes over from one thread to another.
+ *
+ * Exactly one thread may call the producer functions
+ * (ringbuf_spsc_reserve, ringbuf_spsc_commit and
+ * ringbuf_spsc_memcpy_into) and exactly one thread may call the
+ * consumer functions (ringbuf_spsc_peek and ringbuf_spsc_consume) at
+ * any given time. The head index is only ever written by the producer
+ * and the tail index only by the consumer; they are kept on separate
+ * cache lines and published with release stores, observed with
+ * acquire loads. Unlike ringbuf_t, the SPSC variant never overflows.
+ */
+typedef struct ringbuf_spsc_t *ringbuf_spsc_t;
+
+/*
+ * Create a new SPSC ring buffer able to hold at least capacity
+ * bytes. The capacity is rounded up to a power of two, all of it is
+ * usable.
+ *
+ * Returns the new ring buffer object, or 0 if there's not enough
+ * memory to fulfill the request for the given capacity.
+ */
+ringbuf_spsc_t
+ringbuf_spsc_new(size_t capacity);
+
+/*
+ * Deallocate an SPSC ring buffer, and, as a side effect, set the
+ * pointer to 0. Neither side may be using it any more.
+ */
+void
+ringbuf_spsc_free(ringbuf_spsc_t *rb);
+
+size_t
+ringbuf_spsc_capacity(const struct ringbuf_spsc_t *rb);
+
+/*
+ * The number of bytes currently being used in the ring buffer. When
+ * called while the other side is busy, the value is only a snapshot.
+ */
+size_t
+ringbuf_spsc_bytes_used(const struct ringbuf_spsc_t *rb);
+
+/*
+ * Producer side. Get the largest contiguous free area of the ring
+ * buffer, returning its size and storing its address in data. The
+ * producer may fill any part of it and then make the bytes visible to
+ * the consumer, all at once, with ringbuf_spsc_commit. Returns 0 if
+ * the ring buffer is full.
+ */
+size_t
+ringbuf_spsc_reserve(ringbuf_spsc_t rb, void **data);
+
+void
+ringbuf_spsc_commit(ringbuf_spsc_t rb, size_t count);
+
+/*
+ * Producer side. Copy as much as fits of count bytes from src into
+ * the ring buffer and commit them. Returns the number of bytes
+ * copied.
+ */
+size_t
+ringbuf_spsc_memcpy_into(ringbuf_spsc_t rb, const void *src, size_t count);
+
+/*
+ * Consumer side. Get the largest contiguous area of committed bytes,
+ * returning its size and storing its address in data. The bytes stay
+ * in place until given back with ringbuf_spsc_consume. Returns 0 if
+ * the ring buffer is empty.
+ */
+size_t
+ringbuf_spsc_peek(ringbuf_spsc_t rb, const void **data);
+
+void
+ringbuf_spsc_consume(ringbuf_spsc_t rb, size_t count);
+
 #endif /* INCLUDED_RINGBUF_H */
@@ -13,213 +13,939 @@
  * <http://creativecommons.org/publicdomain/zero/1.0>.
  */
 
+#define _GNU_SOURCE
+
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <assert.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
-#include <sys/time.h>
-#include <sys/select.h>
 
 #include "ringbuf.h"
 
+#include "debug.h"
+#include "log.h"
+#include "config.h"
 #include "server.h"
 #include "connection.h"
+#include "reactor.h"
+#include "bcast.h"
+#include "encoder.h"
+#include "worker.h"
+#include "session.h"
+#include "metrics.h"
+#include "trace.h"
 
 #define CONNMAXNUMBER 10
 
-int serverInit(struct Server *server, uint16_t waitport)
+/* In the order of the REACTOR_* values. */
+static const char *const backends[] = { "epoll", "io_uring", NULL };
+
+/* In the order of the NET_* values. */
+static const char *const profiles[] = { "interactive", "bulk", NULL };
+
+/*
+ * With completions, hand what waits in the ring over to a write request
+ * on the watch, by way of a copy that stays put until the write is done.
+ * Returns how much was taken off the ring.
+ */
+static ssize_t serverPipeWrite(struct Server *server, struct Watch *watch,
+                               ringbuf_t rb, struct ReactorOut *out)
 {
-  int sock = -1;
-  int on = 1;
-  struct sockaddr_in sa_server;
+  size_t taken = 0U;
 
-  assert(server);
-  assert(waitport > 0U);
-  memset(server, 0, sizeof(struct Server));
-  sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-  if (sock < 0)
-    return -1;
-  memset(&sa_server, 0, sizeof sa_server);
-  sa_server.sin_family = AF_INET;
-  sa_server.sin_addr.s_addr = INADDR_ANY;
-  sa_server.sin_port = htons(waitport);
-  if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on) < 0) {
-    close(sock);
-    return -1;
+  if (reactorBusy(watch, REACTOR_WRITE))
+    return 0;
+  if ((out->done) == (out->size)) {
+    taken = ringbuf_bytes_used(rb);
+    if (taken > (sizeof out->data))
+      taken = sizeof out->data;
+    if (!taken)
+      return 0;
+    ringbuf_memcpy_from(out->data, rb, taken);
+    out->size = taken;
+    out->done = 0U;
   }
-  if (bind(sock, ((struct sockaddr *)(&sa_server)), sizeof sa_server) < 0) {
-    close(sock);
+  if (reactorWrite(&(server->reactor), watch, (out->data) + (out->done),
+                   (out->size) - (out->done)) < 0)
     return -1;
+  return taken;
+}
+
+/*
+ * Hand what the peer sent over to its own program, and once that made
+ * room, let the peer go on if it had to back off.
+ */
+static int serverSessionFlush(struct Server *server, struct Session *session)
+{
+  struct Connection *conn = session->conn;
+  ssize_t ssize;
+
+  if (session->out.complete) {
+    if (serverPipeWrite(server, &(session->out), session->rbNetToHost,
+                        &(session->toProgram)) < 0)
+      return -1;
   }
-  if (listen(sock, CONNMAXNUMBER) < 0) {
-    close(sock);
-    return -1;
+  while ((!(session->out.complete)) && (sessionNetToHostSize(session) > 0U)) {
+    ssize = sessionWrite(session);
+    if (ssize < 0) {
+      if (errno == EAGAIN)
+        break;
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    if (!ssize)
+      return -1;
   }
-  server->waitsock = sock;
-  server->connections = NULL;
-  server->rbHostToNet = NULL;
-  server->rbNetToHost = NULL;
-  server->rbHostToNet = ringbuf_new(RINGBUF_CAPACITY);
-  if (!(server->rbHostToNet)) {
-    serverStop(server);
-    return -1;
+  if ((conn->inStalled) && (sessionNetToHostSize(session)
+                            < ringbuf_capacity(session->rbNetToHost))) {
+    conn->inStalled = 0;
+    reactorPend(&(server->reactor), &(conn->watch), EPOLLIN);
   }
-  server->rbNetToHost = ringbuf_new(RINGBUF_CAPACITY);
-  if (!(server->rbNetToHost)) {
-    serverStop(server);
+  return 0;
+}
+
+/* The program of a session went away or the peer cannot keep up. */
+static void serverSessionEnd(struct Server *server, struct Session *session)
+{
+  killConnection(session->conn);
+  server->reap = !0;
+}
+
+/* Once its program is gone, the peer still gets what it left behind. */
+static void serverSessionDone(struct Server *server, struct Session *session)
+{
+  struct Connection *conn = session->conn;
+
+  if ((session->done) && (!(connLag(conn))) && (!(connOutSize(conn))))
+    serverSessionEnd(server, session);
+}
+
+static int serverSessionIn(struct Watch *watch, uint32_t events, void *ctx)
+{
+  struct Server *server = ((struct Server *)(ctx));
+  struct Session *session = ((struct Session *)(watch->data));
+  struct Connection *conn = session->conn;
+  uint8_t *buf = NULL;
+  size_t usize;
+  ssize_t ssize;
+
+  if (((conn->sock) < 0) || (session->done))
+    return 0;
+  /* Same as serverThrottle() does for the host, but for a single peer. */
+  if (((server->backpressure.output) == POLICY_STALL)
+      && (connLag(conn) > (server->backpressure.lagLimit))) {
+    session->stalled = !0;
+    return 0;
+  }
+  /* With completions, the output comes to serverSessionComplete(). */
+  if (watch->complete) {
+    if (reactorBusy(watch, REACTOR_READ))
+      return 0;
+    usize = sessionReserve(session, &buf);
+    if ((!usize) || (reactorRead(&(server->reactor), watch, buf, usize) < 0))
+      serverSessionEnd(server, session);
+    return 0;
+  }
+  ssize = sessionRead(session);
+  if (ssize < 0) {
+    if (errno == EAGAIN)
+      return 0;
+    if (errno == EINTR)
+      return 1;
+  }
+  if (!(ssize > 0)) {
+    session->done = !0;
+    serverSessionDone(server, session);
+    return 0;
+  }
+  if ((encodersRun(&(session->encoders)) < 0)
+      || (handleConnection(conn, 0) < 0)) {
+    serverSessionEnd(server, session);
+    return 0;
+  }
+  return 1;
+}
+
+static int serverSessionOut(struct Watch *watch, uint32_t events, void *ctx)
+{
+  struct Server *server = ((struct Server *)(ctx));
+  struct Session *session = ((struct Session *)(watch->data));
+
+  if ((session->conn->sock) < 0)
+    return 0;
+  if (serverSessionFlush(server, session) < 0)
+    serverSessionEnd(server, session);
+  return 0;
+}
+
+/*
+ * With completions, the program output goes into its log as the read
+ * requests of serverSessionIn() come back, and the input the peer sent
+ * leaves the copy serverSessionFlush() made as the writes do.
+ */
+static int serverSessionComplete(struct Watch *watch, int op, int res,
+                                 const uint8_t *data, void *ctx)
+{
+  struct Server *server = ((struct Server *)(ctx));
+  struct Session *session = ((struct Session *)(watch->data));
+  struct Connection *conn = session->conn;
+  int again = (res == -EAGAIN) || (res == -EINTR) || (res == -ECANCELED);
+
+  if ((conn->sock) < 0)
+    return 0;
+  if (op == REACTOR_WRITE) {
+    if (res > 0)
+      session->toProgram.done += res;
+    if (((!(res > 0)) && (!again))
+        || (serverSessionFlush(server, session) < 0))
+      serverSessionEnd(server, session);
+    return 0;
+  }
+  if (again) {
+    reactorPend(&(server->reactor), watch, EPOLLIN);
+    return 0;
+  }
+  if (!(res > 0)) {
+    session->done = !0;
+    serverSessionDone(server, session);
+    return 0;
+  }
+  sessionCommit(session, res);
+  if ((encodersRun(&(session->encoders)) < 0)
+      || (handleConnection(conn, 0) < 0)) {
+    serverSessionEnd(server, session);
+    return 0;
+  }
+  reactorPend(&(server->reactor), watch, EPOLLIN);
+  return 0;
+}
+
+static int serverSessionWatch(struct Server *server, struct Session *session)
+{
+  session->in.fd = session->fdin;
+  session->in.events = EPOLLIN;
+  session->in.handler = serverSessionIn;
+  session->in.data = session;
+  session->out.fd = session->fdout;
+  session->out.events = EPOLLOUT;
+  session->out.handler = serverSessionOut;
+  session->out.data = session;
+  if (reactorCompletes(&(server->reactor))) {
+    session->in.complete = serverSessionComplete;
+    session->out.complete = serverSessionComplete;
+  }
+  if ((reactorAdd(&(server->reactor), &(session->in)) < 0)
+      || (reactorAdd(&(server->reactor), &(session->out)) < 0))
     return -1;
+  return 0;
+}
+
+/* The peer has caught up with half of the limit, its program may go on. */
+static void serverSessionResume(struct Server *server, struct Session *session)
+{
+  if (!(session->stalled))
+    return;
+  if (connLag(session->conn) > ((server->backpressure.lagLimit) / 2U))
+    return;
+  session->stalled = 0;
+  reactorPend(&(server->reactor), &(session->in), EPOLLIN);
+}
+
+/*
+ * Whatever the socket took in or can take now, everything due for the
+ * peer goes out at once by the one push below, unless the input (ret)
+ * already failed.
+ */
+static int serverConnServe(struct Server *server, struct Connection *conn,
+                           int ret)
+{
+  if (conn->session) {
+    if ((!(ret < 0)) && (serverSessionFlush(server, conn->session) < 0))
+      ret = -1;
+  } else if (conn->inStalled) {
+    server->stalled = !0;
+  }
+  if (!(ret < 0)) {
+    if (handleConnection(conn, 0) < 0)
+      ret = -1;
+  }
+  if ((!(ret < 0)) && (conn->session)) {
+    serverSessionResume(server, conn->session);
+    serverSessionDone(server, conn->session);
+  }
+  if (ret < 0) {
+    killConnection(conn);
+    server->reap = !0;
+    return 0;
   }
+  return ret;
+}
+
+/*
+ * With completions, this only makes the requests, a receive unless the
+ * host is not keeping up and a send of whatever is due.
+ */
+static int serverConnEvent(struct Watch *watch, uint32_t events, void *ctx)
+{
+  struct Server *server = ((struct Server *)(ctx));
+  struct Connection *conn = ((struct Connection *)(watch->data));
+  int ret;
+
+  assert(server);
+  assert(conn);
+  if ((conn->sock) < 0)
+    return 0;
+  ret = 0;
+  if (events & (~EPOLLOUT))
+    ret = handleConnection(conn, !0);
+  return serverConnServe(server, conn, ret);
+}
+
+/*
+ * What the requests serverConnEvent() made came back with. Received
+ * data is followed by the next receive, a finished send by the next
+ * push, along with whatever else is due for the peer.
+ */
+static int serverConnComplete(struct Watch *watch, int op, int res,
+                              const uint8_t *data, void *ctx)
+{
+  struct Server *server = ((struct Server *)(ctx));
+  struct Connection *conn = ((struct Connection *)(watch->data));
+  int ret;
+
+  assert(server);
+  assert(conn);
+  if (op == REACTOR_SEND) {
+    ret = connSendDone(conn, res);
+  } else {
+    ret = connRecvDone(conn, data, res);
+    if (!(ret < 0))
+      ret = handleConnection(conn, !0);
+  }
+  if ((conn->sock) < 0)
+    return 0;
+  serverConnServe(server, conn, ret);
   return 0;
 }
 
-int serverStep(struct Server *server)
+static void serverTakeIn(struct Server *server, int sock,
+                         const struct sockaddr_in *sa_client)
 {
-  struct Connection *conn = NULL;
-  struct Connection *prev = NULL;
-  const char *motd = getenv("TELNET_MOTD");
-  fd_set fdset;
-  struct timeval tv;
-  int max = -1;
-  int selected = 0;
+  const char *host = NULL;
+  uint64_t acceptedAt;
+  char topbuf[512U];
+
+  acceptedAt = metricsClock();
+  host = inet_ntop(AF_INET, &(sa_client->sin_addr), topbuf, sizeof topbuf);
+  if (server->workers)
+    workersAdopt(server->workers, sock, host, acceptedAt);
+  else
+    serverAdopt(server, sock, host, acceptedAt);
+}
+
+static int serverAccept(struct Watch *watch, uint32_t events, void *ctx)
+{
+  struct Server *server = ((struct Server *)(ctx));
   struct sockaddr_in sa_client;
   socklen_t addrlen = sizeof sa_client;
   int sock = -1;
-  char topbuf[512U];
-  uint8_t outbuf[RINGBUF_CAPACITY];
-  size_t outsize;
-  size_t insize;
 
   assert(server);
-  assert(!((server->waitsock) < 0));
-  conn = server->connections;
-  outsize = serverHostToNetSize(server);
-  assert(outsize < sizeof outbuf);
-  if (outsize > 0U) {
-    if (serverHostToNetGet(server, outbuf, outsize) < 0)
+  /* With completions, the connections come to serverAcceptComplete(). */
+  if (watch->complete) {
+    if (reactorBusy(watch, REACTOR_ACCEPT))
+      return 0;
+    return reactorAccept(&(server->reactor), watch);
+  }
+  sock = accept4(server->waitsock, ((struct sockaddr *)(&sa_client)),
+                 &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (sock < 0)
+    return ((errno == EINTR) || (errno == ECONNABORTED)) ? 1 : 0;
+  serverTakeIn(server, sock, &sa_client);
+  return 1;
+}
+
+/*
+ * A connection the multishot accept took in, with no word on where it
+ * came from, which getpeername() tells. Once the kernel ends the accept
+ * it is made again, unless short of descriptors or memory, in which case
+ * it waits for serverReap() to let a peer go.
+ */
+static int serverAcceptComplete(struct Watch *watch, int op, int res,
+                                const uint8_t *data, void *ctx)
+{
+  struct Server *server = ((struct Server *)(ctx));
+  struct sockaddr_in sa_client;
+  socklen_t addrlen = sizeof sa_client;
+
+  assert(server);
+  if (res < 0) {
+    if ((res == -EMFILE) || (res == -ENFILE) || (res == -ENOBUFS)
+        || (res == -ENOMEM))
+      return 0;
+  } else if (getpeername(res, ((struct sockaddr *)(&sa_client)),
+                         &addrlen) < 0) {
+    close(res);
+  } else {
+    serverTakeIn(server, res, &sa_client);
+  }
+  if (!(reactorBusy(watch, REACTOR_ACCEPT)))
+    reactorPend(&(server->reactor), watch, EPOLLIN);
+  return 0;
+}
+
+static int serverBroadcast(struct Server *server)
+{
+  struct Connection *conn = NULL;
+  uint64_t offset = encodersLog(&(server->encoders), ENCODER_RAW)->offset;
+
+  if (server->workers) {
+    if (workersPublish(server->workers) < 0)
       return -1;
   }
-  FD_ZERO(&fdset);
-  FD_SET(server->waitsock, &fdset);
-  max = server->waitsock;
-  while (conn) {
-    if (conn->sock >= 0) {
-      FD_SET(conn->sock, &fdset);
-      if (conn->sock > max) max = conn->sock;
+  if ((server->broadcasted) == offset)
+    return 0;
+  server->broadcasted = offset;
+  if (encodersRun(&(server->encoders)) < 0)
+    return -1;
+  for (conn = server->connections; conn; conn = conn->next) {
+    if ((conn->sock) < 0)
+      continue;
+    if (handleConnection(conn, 0)) {
+      killConnection(conn);
+      server->reap = !0;
     }
-    conn = conn->next;
   }
-  assert(!(max < 0));
-  tv.tv_sec = 0;
-  tv.tv_usec = 200;
-  selected = select(max + 1, &fdset, NULL, NULL, &tv);
-  conn = server->connections;
-  if ((selected > 0) && (FD_ISSET(server->waitsock, &fdset))) {
-    sock = accept(server->waitsock, ((struct sockaddr *)(&sa_client)),
-                  &addrlen);
-    if (!(sock < 0)) {
-      prev = server->connections;
-      server->connections = newConnection(inet_ntop(AF_INET,
-                                                    &sa_client.sin_addr,
-                                                    topbuf,
-                                                    sizeof topbuf),
-                                          sock);
-      if ((server->connections) && motd) {
-        if ((connSendMsg(server->connections, motd)) < 0) {
-          closeConnection(server->connections);
-          server->connections = NULL;
-        } else if ((connSendMsg(server->connections, "\n\r")) < 0) {
-          closeConnection(server->connections);
-          server->connections = NULL;
-        }
-      }
-      if (server->connections) {
-        assert(server->connections->sock == sock);
-        server->connections->next = prev;
-      } else {
-        server->connections = prev;
-        close(sock);
-        sock = -1;
-      }
+  return 0;
+}
+
+/* The host has taken some input in, let the peers that backed off go on. */
+static void serverResume(struct Server *server)
+{
+  struct Connection *conn = NULL;
+
+  if (!(server->stalled))
+    return;
+  server->stalled = 0;
+  for (conn = server->connections; conn; conn = conn->next) {
+    if (!(conn->inStalled))
+      continue;
+    conn->inStalled = 0;
+    if (!((conn->sock) < 0))
+      reactorPend(&(server->reactor), &(conn->watch), EPOLLIN);
+  }
+}
+
+/*
+ * With POLICY_STALL for the output, stop taking host output in once the
+ * slowest peer is further behind than the limit, and go on once it has
+ * caught up with half of it.
+ */
+static void serverThrottle(struct Server *server)
+{
+  struct Connection *conn = NULL;
+  uint64_t limit = server->backpressure.lagLimit;
+  uint64_t lag = 0U;
+
+  if ((server->backpressure.output) != POLICY_STALL)
+    return;
+  for (conn = server->connections; conn; conn = conn->next) {
+    if (conn->session)
+      continue;
+    if ((!((conn->sock) < 0)) && (connLag(conn) > lag))
+      lag = connLag(conn);
+  }
+  if ((server->workers) && (workersLag(server->workers) > lag))
+    lag = workersLag(server->workers);
+  if (!(server->hostStalled)) {
+    if (lag > limit) {
+      D("\r\nHost output stalled, %llu bytes behind.\r\n",
+        (unsigned long long)(lag));
+      server->hostStalled = !0;
     }
+    return;
   }
-  prev = NULL;
-  while (conn) {
-    if (outsize > 0U) {
-      if (connHostToNetPut(conn, outbuf, outsize) < 0) {
-        closeConnection(conn);
-        return -1;
+  if (lag > (limit / 2U))
+    return;
+  server->hostStalled = 0;
+  if (server->hostWatch)
+    reactorPend(&(server->reactor), server->hostWatch,
+                server->hostWatch->events);
+}
+
+/* A peer with a program of its own takes that program along. */
+static void serverClose(struct Server *server, struct Connection *conn)
+{
+  struct Session *session = conn->session;
+
+  if (session) {
+    reactorDel(&(server->reactor), &(session->in));
+    reactorDel(&(server->reactor), &(session->out));
+  }
+  closeConnection(conn);
+  if (session)
+    sessionFree(session);
+}
+
+/*
+ * Push out the output held back past its deadline, and have the next
+ * wait end no later than the next deadline.
+ */
+static void serverCoalesce(struct Server *server)
+{
+  struct Connection *conn = NULL;
+  uint64_t next = 0U;
+  uint64_t now;
+  uint64_t at;
+
+  server->timeout = -1;
+  if (!(server->backpressure.flushDelay))
+    return;
+  now = reactorClock();
+  for (conn = server->connections; conn; conn = conn->next) {
+    if ((conn->sock) < 0)
+      continue;
+    at = connFlushAt(conn);
+    if (!at)
+      continue;
+    if (!(at > now)) {
+      if (handleConnection(conn, 0) < 0) {
+        killConnection(conn);
+        server->reap = !0;
+        continue;
       }
+      if (conn->session)
+        serverSessionDone(server, conn->session);
+      at = connFlushAt(conn);
+      if (!at)
+        continue;
     }
-    if (handleConnection(conn,
-                         ((selected > 0) && FD_ISSET(conn->sock, &fdset)))) {
-      if (prev) {
-        prev->next = conn->next;
-        closeConnection(conn);
-        conn = prev->next;
-      } else {
-        server->connections = conn->next;
-        closeConnection(conn);
-        conn = server->connections;
-      }
-    } else {
-      insize = connNetToHostSize(conn);
-      if (insize > 0U) {
-        if (!(ringbuf_copy(server->rbNetToHost, conn->rbNetToHost ,insize)))
-          closeConnection(conn);
-      }
+    if ((!next) || (at < next))
+      next = at;
+  }
+  if (next)
+    server->timeout = (next > now) ? ((int)(next - now)) : 0;
+}
+
+static void serverReap(struct Server *server)
+{
+  struct Connection *conn = NULL;
+  struct Connection *prev = NULL;
+
+  if (!(server->reap))
+    return;
+  server->reap = 0;
+  if ((server->waitwatch.complete)
+      && (!(reactorBusy(&(server->waitwatch), REACTOR_ACCEPT))))
+    reactorPend(&(server->reactor), &(server->waitwatch), EPOLLIN);
+  conn = server->connections;
+  while (conn) {
+    if (!((conn->sock) < 0)) {
       prev = conn;
       conn = conn->next;
+      continue;
+    }
+    reactorDel(&(server->reactor), &(conn->watch));
+    if (prev) {
+      prev->next = conn->next;
+      serverClose(server, conn);
+      conn = prev->next;
+    } else {
+      server->connections = conn->next;
+      serverClose(server, conn);
+      conn = server->connections;
+    }
+  }
+}
+
+/*
+ * Take over an accepted socket. The socket is gone whatever the outcome.
+ * With sessions, the peer gets a program of its own rather than sharing
+ * the host with everybody else.
+ */
+int serverAdopt(struct Server *server, int sock, const char *host,
+                uint64_t acceptedAt)
+{
+  struct Connection *conn = NULL;
+  struct Session *session = NULL;
+  struct Encoders *encoders = &(server->encoders);
+  ringbuf_t rbNetToHost = server->rbNetToHost;
+  const char *motd = getenv("TELNET_MOTD");
+
+  assert(server);
+  assert(!(sock < 0));
+  assert(host);
+  if (server->sessions) {
+    session = sessionsTake(server->sessions);
+    if (!session) {
+      logWrite(LOG_WARN, "No session for [%s].", host);
+      close(sock);
+      return -1;
+    }
+    encoders = &(session->encoders);
+    rbNetToHost = session->rbNetToHost;
+  }
+  conn = newConnection(host, sock, encoders, rbNetToHost,
+                       &(server->backpressure));
+  if (!conn) {
+    if (session)
+      sessionFree(session);
+    return -1;
+  }
+  conn->session = session;
+  if (session)
+    session->conn = conn;
+  if (motd) {
+    if (((connSendMsg(conn, motd)) < 0)
+        || ((connSendMsg(conn, "\n\r")) < 0)) {
+      serverClose(server, conn);
+      return -1;
+    }
+  }
+  assert(conn->sock == sock);
+  conn->watch.fd = sock;
+  conn->watch.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+  conn->watch.handler = serverConnEvent;
+  conn->watch.data = conn;
+  if (reactorCompletes(&(server->reactor))) {
+    conn->reactor = &(server->reactor);
+    conn->watch.complete = serverConnComplete;
+  }
+  if (reactorAdd(&(server->reactor), &(conn->watch)) < 0) {
+    serverClose(server, conn);
+    return -1;
+  }
+  if (session && (serverSessionWatch(server, session) < 0)) {
+    reactorDel(&(server->reactor), &(conn->watch));
+    serverClose(server, conn);
+    return -1;
+  }
+  conn->next = server->connections;
+  server->connections = conn;
+  metricsObserve(HISTO_ADOPT, metricsClock() - acceptedAt);
+  return 0;
+}
+
+/*
+ * With no wait port given the server only serves connections it is
+ * handed over by serverAdopt().
+ */
+int serverInit(struct Server *server, uint16_t waitport)
+{
+  int sock = -1;
+  int on = 1;
+  int backend;
+  int bulk;
+  struct sockaddr_in sa_server;
+
+  assert(server);
+  memset(server, 0, sizeof(struct Server));
+  server->reactor.epfd = -1;
+  server->waitsock = -1;
+  server->connections = NULL;
+  server->reap = 0;
+  server->stalled = 0;
+  server->hostStalled = 0;
+  server->hostWatch = NULL;
+  server->timeout = -1;
+  server->backpressure.input = configPolicy("TELNET_INPUT_POLICY",
+                                            POLICY_STALL);
+  server->backpressure.output = configPolicy("TELNET_OUTPUT_POLICY",
+                                             POLICY_DISCONNECT);
+  server->backpressure.lagLimit = configSize("TELNET_LAG_LIMIT", LAG_LIMIT);
+  server->backpressure.outBudget = configSize("TELNET_OUTQ_BUDGET",
+                                              OUTQ_CAPACITY);
+  server->backpressure.net = configChoice("TELNET_TCP_PROFILE", profiles,
+                                          NET_INTERACTIVE);
+  bulk = ((server->backpressure.net) == NET_BULK);
+  server->backpressure.flushDelay =
+    configSize("TELNET_FLUSH_DELAY",
+               bulk ? FLUSH_DELAY_BULK : FLUSH_DELAY_INTERACTIVE);
+  server->backpressure.flushSize =
+    configSize("TELNET_FLUSH_SIZE",
+               bulk ? FLUSH_SIZE_BULK : FLUSH_SIZE_INTERACTIVE);
+  server->backpressure.notsentLowat =
+    configSize("TELNET_NOTSENT_LOWAT", bulk ? 0U : NOTSENT_LOWAT_INTERACTIVE);
+  server->broadcasted = 0U;
+  server->rbNetToHost = NULL;
+  server->workers = NULL;
+  server->sessions = NULL;
+  server->splicing = 0;
+  server->scanPipe[0] = -1;
+  server->scanPipe[1] = -1;
+  server->sink = -1;
+  server->scratch = NULL;
+  if (waitport > 0U) {
+    sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                  IPPROTO_TCP);
+    if (sock < 0)
+      return -1;
+    memset(&sa_server, 0, sizeof sa_server);
+    sa_server.sin_family = AF_INET;
+    sa_server.sin_addr.s_addr = INADDR_ANY;
+    sa_server.sin_port = htons(waitport);
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on) < 0) {
+      close(sock);
+      return -1;
+    }
+    if (bind(sock, ((struct sockaddr *)(&sa_server)), sizeof sa_server) < 0) {
+      close(sock);
+      return -1;
+    }
+    if (listen(sock, CONNMAXNUMBER) < 0) {
+      close(sock);
+      return -1;
     }
+    server->waitsock = sock;
+  }
+  if (encodersInit(&(server->encoders)) < 0) {
+    serverStop(server);
+    return -1;
+  }
+  server->rbNetToHost =
+    ringbuf_new_mirrored(configSize("TELNET_RINGBUF_CAPACITY",
+                                    RINGBUF_CAPACITY));
+  if (!(server->rbNetToHost)) {
+    serverStop(server);
+    return -1;
+  }
+  backend = configChoice("TELNET_BACKEND", backends, REACTOR_EPOLL);
+  if (reactorInit(&(server->reactor), server, backend) < 0) {
+    serverStop(server);
+    return -1;
+  }
+  if ((server->reactor.backend) != backend)
+    logWrite(LOG_WARN, "Falling back to %s.",
+             backends[server->reactor.backend]);
+  else if ((backend == REACTOR_IO_URING)
+           && (!reactorCompletes(&(server->reactor))))
+    logWrite(LOG_WARN, "No buffer ring, io_uring only polls.");
+  if (sock < 0)
+    return 0;
+  server->waitwatch.fd = sock;
+  server->waitwatch.events = EPOLLIN;
+  server->waitwatch.handler = serverAccept;
+  server->waitwatch.data = NULL;
+  if (reactorCompletes(&(server->reactor)))
+    server->waitwatch.complete = serverAcceptComplete;
+  if (reactorAdd(&(server->reactor), &(server->waitwatch)) < 0) {
+    serverStop(server);
+    return -1;
   }
   return 0;
 }
 
+int serverStep(struct Server *server)
+{
+  assert(server);
+  if (reactorRun(&(server->reactor), server->timeout) < 0)
+    return -1;
+  if (serverBroadcast(server) < 0)
+    return -1;
+  serverCoalesce(server);
+  serverReap(server);
+  serverThrottle(server);
+  metricsAdd(METRIC_LOOPS, 1U);
+  metricsObserve(HISTO_LOOP, metricsClock() - server->reactor.woke);
+  TRACE(TRACE_STEP, 0U, -1, server->reactor.woke, 0U);
+  return 0;
+}
+
 void serverStop(struct Server *server)
 {
   struct Connection *conn = NULL;
   struct Connection *tmp = NULL;
 
   assert(server);
+  /* Output held back goes out now, as far as the sockets take it. */
+  server->backpressure.flushDelay = 0U;
+  for (conn = server->connections; conn; conn = conn->next) {
+    if (!((conn->sock) < 0))
+      handleConnection(conn, 0);
+  }
+  /* With completions, the sends are only made once handed over. */
+  if (reactorCompletes(&(server->reactor)))
+    reactorRun(&(server->reactor), 0);
   conn = server->connections;
   while (conn) {
     tmp = conn;
     conn = conn->next;
-    closeConnection(tmp);
+    reactorDel(&(server->reactor), &(tmp->watch));
+    serverClose(server, tmp);
     tmp = NULL;
   }
-  if (server->rbHostToNet)
-    ringbuf_free(&(server->rbHostToNet));
-  server->rbHostToNet = NULL;
+  encodersStop(&(server->encoders));
   if (server->rbNetToHost)
     ringbuf_free(&(server->rbNetToHost));
   server->rbNetToHost = NULL;
+  reactorStop(&(server->reactor));
   if ((server->waitsock) >= 0)
     close(server->waitsock);
   server->waitsock = -1;
+  server->splicing = 0;
+  if (!((server->scanPipe[0]) < 0)) {
+    close(server->scanPipe[0]);
+    close(server->scanPipe[1]);
+  }
+  server->scanPipe[0] = -1;
+  server->scanPipe[1] = -1;
+  if (!((server->sink) < 0))
+    close(server->sink);
+  server->sink = -1;
+  free(server->scratch);
+  server->scratch = NULL;
 }
 
-int serverHostToNetGet(struct Server *server, uint8_t *data, size_t size)
+/*
+ * Let host output read from the pipe fd go to the peers with tee() and
+ * splice() rather than through the log whenever they all can take it as
+ * it is. Only meant for a server that serves its connections itself.
+ */
+int serverSpliceInit(struct Server *server, int fd)
 {
+  struct stat st;
+
   assert(server);
-  assert(server->rbHostToNet);
-  if (!(ringbuf_memcpy_from(data, server->rbHostToNet, size)))
+  assert(!(server->workers));
+  /* Not with completions, the host output is read in by a request. */
+  if (reactorCompletes(&(server->reactor)))
     return -1;
+  if ((fstat(fd, &st) < 0) || (!(S_ISFIFO(st.st_mode))))
+    return -1;
+  if (pipe2(server->scanPipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+    server->scanPipe[0] = -1;
+    server->scanPipe[1] = -1;
+    return -1;
+  }
+  server->sink = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  server->scratch = (uint8_t *)(malloc(SERVER_SPLICE_CHUNK));
+  if (((server->sink) < 0) || (!(server->scratch)))
+    return -1;
+  server->splicing = !0;
   return 0;
 }
 
+/* Everybody is in step with the host output and takes it unescaped. */
+static int serverSpliceReady(struct Server *server)
+{
+  struct Connection *conn = NULL;
+  int found = 0;
+
+  if (!(server->splicing))
+    return 0;
+  if ((server->broadcasted)
+      != (encodersLog(&(server->encoders), ENCODER_RAW)->offset))
+    return 0;
+  if (!(encodersSynced(&(server->encoders))))
+    return 0;
+  for (conn = server->connections; conn; conn = conn->next) {
+    if ((conn->sock) < 0)
+      continue;
+    if (!(connSpliceReady(conn)))
+      return 0;
+    found = !0;
+  }
+  return found;
+}
+
+/*
+ * The host output still has to be looked at for IAC bytes that would
+ * need escaping, which takes one copy through the scan pipe, but none
+ * of the peers get a copy of their own. Returns 0 when the host output
+ * is to be read into the log as usual instead.
+ */
+ssize_t serverHostToNetSplice(struct Server *server, int fd)
+{
+  struct Connection *conn = NULL;
+  const uint8_t *iac = NULL;
+  ssize_t teed;
+  ssize_t n;
+  size_t size;
+  size_t done;
+
+  assert(server);
+  if (!(serverSpliceReady(server)))
+    return 0;
+  teed = tee(fd, server->scanPipe[1], SERVER_SPLICE_CHUNK, SPLICE_F_NONBLOCK);
+  if (!(teed > 0))
+    return 0;
+  size = teed;
+  for (done = 0U; done < size; done += n) {
+    n = read(server->scanPipe[0], server->scratch + done, size - done);
+    if (!(n > 0)) {
+      /* The scan pipe is out of step for good, give up on splicing. */
+      server->splicing = 0;
+      return 0;
+    }
+  }
+  /* Escaping is up to the log, only take whatever comes before it. */
+  iac = (const uint8_t *)(memchr(server->scratch, TELNET_IAC, size));
+  if (iac)
+    size = iac - (server->scratch);
+  if (!size)
+    return 0;
+  for (conn = server->connections; conn; conn = conn->next) {
+    if ((conn->sock) < 0)
+      continue;
+    if (connTee(conn, fd, server->scratch, size) < 0) {
+      killConnection(conn);
+      server->reap = !0;
+    }
+  }
+  for (done = 0U; done < size; done += n) {
+    n = splice(fd, NULL, server->sink, NULL, size - done, SPLICE_F_NONBLOCK);
+    if (n < 0)
+      n = read(fd, server->scratch, size - done);
+    if (!(n > 0))
+      return -1;
+  }
+  return size;
+}
+
+/*
+ * The watch that feeds host output in, to be kicked when it may go on
+ * after serverHostToNetStalled() told it to back off.
+ */
+void serverHostToNetWatch(struct Server *server, struct Watch *watch)
+{
+  assert(server);
+  server->hostWatch = watch;
+}
+
+int serverHostToNetStalled(const struct Server *server)
+{
+  assert(server);
+  return server->hostStalled;
+}
+
+size_t serverHostToNetReserve(struct Server *server, uint8_t **data)
+{
+  assert(server);
+  return bcastReserve(encodersLog(&(server->encoders), ENCODER_RAW), data);
+}
+
+void serverHostToNetCommit(struct Server *server, size_t size)
+{
+  assert(server);
+  bcastCommit(encodersLog(&(server->encoders), ENCODER_RAW), size);
+}
+
 int serverHostToNetPut(struct Server *server, const uint8_t *data, size_t size)
 {
   assert(server);
-  assert(server->rbHostToNet);
-  if (!(ringbuf_memcpy_into(server->rbHostToNet, data, size)))
-    return -1;
-  return 0;
+  return bcastWrite(encodersLog(&(server->encoders), ENCODER_RAW), data,
+                    size);
 }
 
 int serverNetToHostGet(struct Server *server, uint8_t *data, size_t size)
@@ -228,6 +954,7 @@ int serverNetToHostGet(struct Server *server, uint8_t *data, size_t size)
   assert(server->rbNetToHost);
   if (!(ringbuf_memcpy_from(data, server->rbNetToHost, size)))
     return -1;
+  serverResume(server);
   return 0;
 }
 
@@ -241,16 +968,98 @@ int serverNetToHostPut(struct Server *server, const uint8_t *data,
   return 0;
 }
 
-size_t serverHostToNetSize(const struct Server *server)
+size_t serverNetToHostSize(const struct Server *server)
 {
   assert(server);
-  assert(server->rbHostToNet);
-  return ringbuf_bytes_used(server->rbHostToNet);
+  assert(server->rbNetToHost);
+  return ringbuf_bytes_used(server->rbNetToHost);
 }
 
-size_t serverNetToHostSize(const struct Server *server)
+/*
+ * With completions, the same as serverNetToHostWrite() by a write request
+ * on the watch given, which goes on from out as it completes.
+ */
+int serverNetToHostSubmit(struct Server *server, struct Watch *watch,
+                          struct ReactorOut *out)
 {
+  ssize_t taken;
+
   assert(server);
   assert(server->rbNetToHost);
-  return ringbuf_bytes_used(server->rbNetToHost);
+  assert(watch);
+  assert(out);
+  taken = serverPipeWrite(server, watch, server->rbNetToHost, out);
+  if (taken > 0) {
+    serverResume(server);
+    if (server->workers)
+      workersResume(server->workers);
+  }
+  return (taken < 0) ? -1 : 0;
+}
+
+ssize_t serverNetToHostWrite(struct Server *server, int fd)
+{
+  ssize_t ret;
+
+  assert(server);
+  assert(server->rbNetToHost);
+  ret = ringbuf_writev(fd, server->rbNetToHost,
+                       ringbuf_bytes_used(server->rbNetToHost));
+  if (ret > 0) {
+    serverResume(server);
+    if (server->workers)
+      workersResume(server->workers);
+  }
+  return ret;
+}
+
+/*
+ * Host output not yet out to the peers, queued for them or in the log
+ * past where they are, and with workers, on its way to their peers.
+ * Peers with programs of their own do not count.
+ */
+uint64_t serverBacklog(const struct Server *server)
+{
+  const struct Connection *conn = NULL;
+  uint64_t backlog = 0U;
+
+  assert(server);
+  for (conn = server->connections; conn; conn = conn->next) {
+    if (((conn->sock) < 0) || (conn->session))
+      continue;
+    backlog += connOutSize(conn) + connLag(conn);
+  }
+  if (server->workers)
+    backlog += workersBacklog(server->workers);
+  return backlog;
+}
+
+/*
+ * Gauges of the host side, to be called on the thread running the
+ * server: the logs the host output goes through, the input waiting for
+ * the host and whether either side is being held back.
+ */
+void serverMetricsWrite(struct Server *server, FILE *out)
+{
+  static const char *const names[ENCODER_MAX] = {
+    "raw", "plain", "compress2"
+  };
+  int i;
+
+  assert(server);
+  assert(out);
+  fprintf(out, "# TYPE " METRICS_PREFIX "host_log_segments gauge\n");
+  for (i = 0; i < ENCODER_MAX; i++)
+    fprintf(out, METRICS_PREFIX "host_log_segments{profile=\"%s\"} %zu\n",
+            names[i], encodersLog(&(server->encoders), i)->segments);
+  fprintf(out, "# TYPE " METRICS_PREFIX "net_to_host_bytes gauge\n");
+  fprintf(out, METRICS_PREFIX "net_to_host_bytes %zu\n",
+          ringbuf_bytes_used(server->rbNetToHost));
+  fprintf(out, "# TYPE " METRICS_PREFIX "host_output_stalled gauge\n");
+  fprintf(out, METRICS_PREFIX "host_output_stalled %d\n",
+          !!(server->hostStalled));
+  fprintf(out, "# TYPE " METRICS_PREFIX "input_stalled gauge\n");
+  fprintf(out, METRICS_PREFIX "input_stalled %d\n", !!(server->stalled));
+  if (server->workers)
+    workersMetricsWrite(server->workers, out);
 }
@@ -16,29 +16,69 @@
 #ifndef __SERVER_H
 #define __SERVER_H
 
+#include <stdio.h>
 #include <stddef.h>
 #include <stdint.h>
 
+#include <sys/types.h>
+
 #include "ringbuf.h"
 
 #include "connection.h"
+#include "reactor.h"
+#include "bcast.h"
+#include "encoder.h"
+
+/* Most host output taken past the log at once, a default pipe's worth. */
+#ifndef SERVER_SPLICE_CHUNK
+#define SERVER_SPLICE_CHUNK 65536U
+#endif
+
+struct Workers;
+struct Sessions;
 
 struct Server
 {
   struct Connection *connections;
   int waitsock;
-  ringbuf_t rbHostToNet;
+  int reap;
+  int stalled;
+  int hostStalled;
+  int timeout;
+  struct Watch *hostWatch;
+  struct Backpressure backpressure;
+  uint64_t broadcasted;
+  struct Encoders encoders;
   ringbuf_t rbNetToHost;
+  struct Reactor reactor;
+  struct Watch waitwatch;
+  struct Workers *workers;
+  struct Sessions *sessions;
+  int splicing;
+  int scanPipe[2];
+  int sink;
+  uint8_t *scratch;
 };
 
 int serverInit(struct Server *server, uint16_t waitport);
+int serverAdopt(struct Server *server, int sock, const char *host,
+                uint64_t acceptedAt);
 int serverStep(struct Server *server);
 void serverStop(struct Server *server);
-int serverHostToNetGet(struct Server *server, uint8_t *data, size_t size);
+void serverHostToNetWatch(struct Server *server, struct Watch *watch);
+int serverHostToNetStalled(const struct Server *server);
+int serverSpliceInit(struct Server *server, int fd);
+ssize_t serverHostToNetSplice(struct Server *server, int fd);
+size_t serverHostToNetReserve(struct Server *server, uint8_t **data);
+void serverHostToNetCommit(struct Server *server, size_t size);
 int serverHostToNetPut(struct Server *server, const uint8_t *data, size_t size);
 int serverNetToHostGet(struct Server *server, uint8_t *data, size_t size);
 int serverNetToHostPut(struct Server *server, const uint8_t *data, size_t size);
-size_t serverHostToNetSize(const struct Server *server);
 size_t serverNetToHostSize(const struct Server *server);
+ssize_t serverNetToHostWrite(struct Server *server, int fd);
+int serverNetToHostSubmit(struct Server *server, struct Watch *watch,
+                          struct ReactorOut *out);
+uint64_t serverBacklog(const struct Server *server);
+void serverMetricsWrite(struct Server *server, FILE *out);
 
 #endif /* __SERVER_H */
@@ -0,0 +1,291 @@
+/*
+ * session.c - Per-connection program instances implementation.
+ *
+ * Written in 2020 by Paul Osmialowski <pawelo@king.net.pl>.
+ *
+ * To the extent possible under law, the author(s) have dedicated all
+ * copyright and related and neighboring rights to this software to
+ * the public domain worldwide. This software is distributed without
+ * any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication
+ * along with this software. If not, see
+ * <http://creativecommons.org/publicdomain/zero/1.0>.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "ringbuf.h"
+
+#include "debug.h"
+#include "config.h"
+#include "session.h"
+#include "encoder.h"
+#include "bcast.h"
+#include "slab.h"
+#include "spawn.h"
+
+static struct Session *sessionNew(const struct Sessions *sessions)
+{
+  struct Session *session = NULL;
+
+  session = (struct Session *)(calloc(1U, sizeof(struct Session)));
+  if (!session)
+    return NULL;
+  session->fdin = -1;
+  session->fdout = -1;
+  if (encodersInit(&(session->encoders)) < 0) {
+    sessionFree(session);
+    return NULL;
+  }
+  session->rbNetToHost =
+    ringbuf_new_mirrored(configSize("TELNET_RINGBUF_CAPACITY",
+                                    RINGBUF_CAPACITY));
+  if (!(session->rbNetToHost)) {
+    sessionFree(session);
+    return NULL;
+  }
+  session->pid = spawn(sessions->argv[0], sessions->argc, sessions->argv,
+                       &(session->fdout), &(session->fdin));
+  if ((session->pid) < 0) {
+    session->pid = 0;
+    sessionFree(session);
+    return NULL;
+  }
+  fcntl(session->fdin, F_SETFL, fcntl(session->fdin, F_GETFL) | O_NONBLOCK);
+  fcntl(session->fdout, F_SETFL, fcntl(session->fdout, F_GETFL) | O_NONBLOCK);
+  return session;
+}
+
+static void sessionsBackOff(struct Sessions *sessions)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec += SESSION_RETRY_SECONDS;
+  pthread_cond_timedwait(&(sessions->cond), &(sessions->lock), &ts);
+}
+
+static void *sessionsMain(void *arg)
+{
+  struct Sessions *sessions = ((struct Sessions *)(arg));
+  struct Session *session = NULL;
+
+  pthread_mutex_lock(&(sessions->lock));
+  while (!(sessions->stop)) {
+    if (!((sessions->count) < (sessions->target))) {
+      pthread_cond_wait(&(sessions->cond), &(sessions->lock));
+      continue;
+    }
+    /* Forking takes a while, let the others pick sessions up meanwhile. */
+    pthread_mutex_unlock(&(sessions->lock));
+    session = sessionNew(sessions);
+    pthread_mutex_lock(&(sessions->lock));
+    if (!session) {
+      sessionsBackOff(sessions);
+      continue;
+    }
+    session->next = sessions->warm;
+    sessions->warm = session;
+    sessions->count++;
+    sessions->spawned++;
+  }
+  pthread_mutex_unlock(&(sessions->lock));
+  slabTrim();
+  return NULL;
+}
+
+/*
+ * The first session is spawned right away, so that a command that
+ * cannot be run at all is told about before anybody connects. To be
+ * called with the signals blocked, the pool thread inherits the mask.
+ */
+int sessionsInit(struct Sessions *sessions, size_t target, int argc,
+                 char **argv)
+{
+  struct Session *session = NULL;
+
+  assert(sessions);
+  assert(argc > 0);
+  assert(argv);
+  memset(sessions, 0, sizeof(struct Sessions));
+  sessions->warm = NULL;
+  sessions->count = 0U;
+  sessions->target = target;
+  sessions->spawned = 0U;
+  sessions->cold = 0U;
+  sessions->argc = argc;
+  sessions->argv = argv;
+  sessions->stop = 0;
+  sessions->running = 0;
+  if (pthread_mutex_init(&(sessions->lock), NULL))
+    return -1;
+  if (pthread_cond_init(&(sessions->cond), NULL)) {
+    pthread_mutex_destroy(&(sessions->lock));
+    return -1;
+  }
+  if (!target)
+    return 0;
+  session = sessionNew(sessions);
+  if (!session) {
+    sessionsStop(sessions);
+    return -1;
+  }
+  sessions->warm = session;
+  sessions->count = 1U;
+  sessions->spawned = 1U;
+  if (pthread_create(&(sessions->thread), NULL, sessionsMain, sessions)) {
+    sessionsStop(sessions);
+    return -1;
+  }
+  sessions->running = !0;
+  return 0;
+}
+
+void sessionsStop(struct Sessions *sessions)
+{
+  struct Session *session = NULL;
+
+  assert(sessions);
+  if (sessions->running) {
+    pthread_mutex_lock(&(sessions->lock));
+    sessions->stop = !0;
+    pthread_cond_signal(&(sessions->cond));
+    pthread_mutex_unlock(&(sessions->lock));
+    pthread_join(sessions->thread, NULL);
+    sessions->running = 0;
+  }
+  while (sessions->warm) {
+    session = sessions->warm;
+    sessions->warm = session->next;
+    sessionFree(session);
+  }
+  sessions->count = 0U;
+  D("\r\n%zu sessions spawned ahead, %zu on demand.\r\n",
+    sessions->spawned, sessions->cold);
+  pthread_cond_destroy(&(sessions->cond));
+  pthread_mutex_destroy(&(sessions->lock));
+}
+
+/*
+ * Hand a ready session out, or spawn one on the spot when none is. A
+ * session whose program went away while waiting is thrown away.
+ */
+struct Session *sessionsTake(struct Sessions *sessions)
+{
+  struct Session *session = NULL;
+  struct Session *dead = NULL;
+  struct Session *tmp = NULL;
+
+  assert(sessions);
+  pthread_mutex_lock(&(sessions->lock));
+  while ((session = sessions->warm)) {
+    sessions->warm = session->next;
+    sessions->count--;
+    if (!waitpid(session->pid, NULL, WNOHANG))
+      break;
+    session->pid = 0;
+    session->next = dead;
+    dead = session;
+  }
+  if (!session)
+    sessions->cold++;
+  pthread_cond_signal(&(sessions->cond));
+  pthread_mutex_unlock(&(sessions->lock));
+  while (dead) {
+    tmp = dead;
+    dead = tmp->next;
+    sessionFree(tmp);
+  }
+  if (!session)
+    session = sessionNew(sessions);
+  if (session)
+    session->next = NULL;
+  return session;
+}
+
+/* Collect the programs that have ended, whichever session they had. */
+void sessionsReap(void)
+{
+  while (waitpid(-1, NULL, WNOHANG) > 0)
+    ;
+}
+
+/* Program output goes into the log of the session, as with the host. */
+/* Where the program output goes next, up to the size returned. */
+size_t sessionReserve(struct Session *session, uint8_t **data)
+{
+  assert(session);
+  return bcastReserve(encodersLog(&(session->encoders), ENCODER_RAW), data);
+}
+
+void sessionCommit(struct Session *session, size_t size)
+{
+  assert(session);
+  bcastCommit(encodersLog(&(session->encoders), ENCODER_RAW), size);
+}
+
+ssize_t sessionRead(struct Session *session)
+{
+  uint8_t *buf = NULL;
+  size_t usize;
+  ssize_t ssize;
+
+  assert(session);
+  usize = sessionReserve(session, &buf);
+  if (!usize) {
+    errno = ENOMEM;
+    return -1;
+  }
+  ssize = read(session->fdin, buf, usize);
+  if (ssize > 0)
+    sessionCommit(session, ssize);
+  return ssize;
+}
+
+ssize_t sessionWrite(struct Session *session)
+{
+  assert(session);
+  assert(session->rbNetToHost);
+  return ringbuf_writev(session->fdout, session->rbNetToHost,
+                        ringbuf_bytes_used(session->rbNetToHost));
+}
+
+size_t sessionNetToHostSize(const struct Session *session)
+{
+  assert(session);
+  assert(session->rbNetToHost);
+  return ringbuf_bytes_used(session->rbNetToHost);
+}
+
+/*
+ * The program gets hung up on, along with anything it started in its
+ * process group. Whatever is left of it is collected by sessionsReap().
+ */
+void sessionFree(struct Session *session)
+{
+  assert(session);
+  /* Not in a group of its own yet if it was only just forked. */
+  if (((session->pid) > 0) && (kill(-(session->pid), SIGHUP) < 0))
+    kill(session->pid, SIGHUP);
+  if (!((session->fdin) < 0))
+    close(session->fdin);
+  if (!((session->fdout) < 0))
+    close(session->fdout);
+  encodersStop(&(session->encoders));
+  if (session->rbNetToHost)
+    ringbuf_free(&(session->rbNetToHost));
+  free(session);
+}
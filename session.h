@@ -0,0 +1,94 @@
+/*
+ * session.h - Per-connection program instances interface.
+ *
+ * Written in 2020 by Paul Osmialowski <pawelo@king.net.pl>.
+ *
+ * To the extent possible under law, the author(s) have dedicated all
+ * copyright and related and neighboring rights to this software to
+ * the public domain worldwide. This software is distributed without
+ * any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication
+ * along with this software. If not, see
+ * <http://creativecommons.org/publicdomain/zero/1.0>.
+ */
+
+#ifndef __SESSION_H
+#define __SESSION_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "ringbuf.h"
+
+#include "reactor.h"
+#include "encoder.h"
+
+/* Default for TELNET_SESSIONS. */
+#ifndef SESSION_POOL
+#define SESSION_POOL 4U
+#endif
+
+/* How long the pool waits before trying again when a spawn fails. */
+#ifndef SESSION_RETRY_SECONDS
+#define SESSION_RETRY_SECONDS 1
+#endif
+
+struct Connection;
+
+/*
+ * An instance of the program for a single peer. Whatever the peer sends
+ * goes to its input only, and its output goes through a log of its own
+ * to that peer only.
+ */
+struct Session
+{
+  struct Session *next;
+  pid_t pid;
+  int fdin;  /* the program output */
+  int fdout; /* the program input */
+  int stalled;
+  int done;
+  struct Encoders encoders;
+  ringbuf_t rbNetToHost;
+  struct Connection *conn;
+  struct Watch in;
+  struct Watch out;
+  struct ReactorOut toProgram; /* with completions, input on its way */
+};
+
+/*
+ * Sessions spawned ahead of time, so that a new peer only has to pick a
+ * ready one up. A thread of its own tops the pool up in the background.
+ */
+struct Sessions
+{
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct Session *warm;
+  size_t count;
+  size_t target;
+  size_t spawned;
+  size_t cold;
+  int argc;
+  char **argv;
+  int stop;
+  int running;
+  pthread_t thread;
+};
+
+int sessionsInit(struct Sessions *sessions, size_t target, int argc,
+                 char **argv);
+void sessionsStop(struct Sessions *sessions);
+struct Session *sessionsTake(struct Sessions *sessions);
+void sessionsReap(void);
+size_t sessionReserve(struct Session *session, uint8_t **data);
+void sessionCommit(struct Session *session, size_t size);
+ssize_t sessionRead(struct Session *session);
+ssize_t sessionWrite(struct Session *session);
+size_t sessionNetToHostSize(const struct Session *session);
+void sessionFree(struct Session *session);
+
+#endif /* __SESSION_H */
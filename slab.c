@@ -0,0 +1,85 @@
+/*
+ * slab.c - Fixed-size buffer pool implementation.
+ *
+ * Written in 2020 by Paul Osmialowski <pawelo@king.net.pl>.
+ *
+ * To the extent possible under law, the author(s) have dedicated all
+ * copyright and related and neighboring rights to this software to
+ * the public domain worldwide. This software is distributed without
+ * any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication
+ * along with this software. If not, see
+ * <http://creativecommons.org/publicdomain/zero/1.0>.
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdatomic.h>
+
+#include "slab.h"
+
+struct SlabFree
+{
+  struct SlabFree *next;
+};
+
+struct SlabPool
+{
+  struct SlabFree *head;
+  size_t count;
+};
+
+static _Thread_local struct SlabPool pool = { NULL, 0U };
+static atomic_size_t allocs = 0U;
+
+void *slabGet(void)
+{
+  struct SlabFree *slab = pool.head;
+
+  if (!slab) {
+    slab = (struct SlabFree *)(malloc(SLAB_SIZE));
+    if (slab)
+      atomic_fetch_add(&allocs, 1U);
+    return slab;
+  }
+  assert(pool.count > 0U);
+  pool.head = slab->next;
+  pool.count--;
+  return slab;
+}
+
+void slabPut(void *slab)
+{
+  struct SlabFree *entry = ((struct SlabFree *)(slab));
+
+  if (!entry)
+    return;
+  if (!(pool.count < SLAB_POOL_MAX)) {
+    free(entry);
+    return;
+  }
+  entry->next = pool.head;
+  pool.head = entry;
+  pool.count++;
+}
+
+/* Slabs taken from the heap so far, by all the threads. */
+size_t slabAllocs(void)
+{
+  return atomic_load(&allocs);
+}
+
+/* Give every cached slab of the calling thread back to the system. */
+void slabTrim(void)
+{
+  struct SlabFree *slab = NULL;
+
+  while (pool.head) {
+    slab = pool.head;
+    pool.head = slab->next;
+    free(slab);
+  }
+  pool.count = 0U;
+}
@@ -0,0 +1,39 @@
+/*
+ * slab.h - Fixed-size buffer pool interface.
+ *
+ * Written in 2020 by Paul Osmialowski <pawelo@king.net.pl>.
+ *
+ * To the extent possible under law, the author(s) have dedicated all
+ * copyright and related and neighboring rights to this software to
+ * the public domain worldwide. This software is distributed without
+ * any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication
+ * along with this software. If not, see
+ * <http://creativecommons.org/publicdomain/zero/1.0>.
+ */
+
+#ifndef __SLAB_H
+#define __SLAB_H
+
+#include <stddef.h>
+
+#ifndef SLAB_SIZE
+#define SLAB_SIZE 4096U
+#endif
+
+/* Most slabs a thread keeps around for reuse, the rest go back. */
+#ifndef SLAB_POOL_MAX
+#define SLAB_POOL_MAX 64U
+#endif
+
+/*
+ * Every thread has a pool of its own, so no locking is involved. A slab
+ * may be released by any thread, it just ends up in that thread's pool.
+ */
+void *slabGet(void);
+void slabPut(void *slab);
+size_t slabAllocs(void);
+void slabTrim(void);
+
+#endif /* __SLAB_H */
@@ -13,13 +13,18 @@
  * <http://creativecommons.org/publicdomain/zero/1.0>.
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/ioctl.h>
+#include <termios.h>
 #include <assert.h>
 
 #include "spawn.h"
@@ -27,20 +32,60 @@
 #define READ 0
 #define WRITE 1
 
+static int spawnArgs(int argc, char **argv)
+{
+  if (argc > 1) {
+    if ((argc < 3) || (strcmp("--", argv[1])))
+      return -1;
+  }
+  return 0;
+}
+
+/* In the child, once its standard descriptors are in place. */
+static void spawnExec(int argc, char **argv)
+{
+  int i;
+
+  if (argc > 1) {
+    for (i = 1; i < (argc - 1); i++)
+      argv[i] = argv[i + 1];
+    argv[argc - 1] = NULL;
+    execvp(argv[0], argv);
+    perror("execvp");
+  } else {
+    execlp(argv[0], argv[0], NULL);
+    perror("execlp");
+  }
+  _Exit(-1);
+}
+
+static void spawnSignals(void)
+{
+  sigset_t sigs;
+
+  signal(SIGCHLD, SIG_DFL);
+  signal(SIGQUIT, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+  signal(SIGPIPE, SIG_DFL);
+  signal(SIGINT, SIG_DFL);
+  signal(SIGHUP, SIG_DFL);
+  /* Spawned from a thread that keeps them blocked for the event loop. */
+  sigemptyset(&sigs);
+  sigprocmask(SIG_SETMASK, &sigs, NULL);
+}
+
 pid_t spawn(const char *path, int argc, char **argv, int *fdin, int *fdout)
 {
   int p_stdin[] = { -1, -1 };
   int p_stdout[] = { -1, -1 };
   pid_t pid;
-  int i;
 
-  if (argc > 1) {
-    if ((argc < 3) || (strcmp("--", argv[1])))
-      return -1;
-  }
-  if (pipe(p_stdin))
+  if (spawnArgs(argc, argv) < 0)
     return -1;
-  if (pipe(p_stdout))
+  /* The parent ends must not leak into the programs spawned later on. */
+  if (pipe2(p_stdin, O_CLOEXEC))
+    return -1;
+  if (pipe2(p_stdout, O_CLOEXEC))
   {
     if (!(p_stdin[READ] < 0)) close(p_stdin[READ]);
     if (!(p_stdin[WRITE] < 0)) close(p_stdin[WRITE]);
@@ -51,16 +96,16 @@ pid_t spawn(const char *path, int argc, char **argv, int *fdin, int *fdout)
   assert(!(p_stdout[READ] < 0));
   assert(!(p_stdout[WRITE] < 0));
   pid = fork();
-  if (pid < 0)
+  if (pid < 0) {
+    close(p_stdin[READ]);
+    close(p_stdin[WRITE]);
+    close(p_stdout[READ]);
+    close(p_stdout[WRITE]);
     return pid;
+  }
   if (!pid)
   {
-    signal(SIGCHLD, SIG_DFL);
-    signal(SIGQUIT, SIG_DFL);
-    signal(SIGTERM, SIG_DFL);
-    signal(SIGPIPE, SIG_DFL);
-    signal(SIGINT, SIG_DFL);
-    signal(SIGHUP, SIG_DFL);
+    spawnSignals();
     if (setpgrp())
       _Exit(-1);
     close(p_stdin[WRITE]);
@@ -69,18 +114,11 @@ pid_t spawn(const char *path, int argc, char **argv, int *fdin, int *fdout)
     close(p_stdout[READ]);
     if (dup2(p_stdout[WRITE], WRITE) < 0)
       _Exit(-1);
-    if (argc > 1) {
-      for (i = 1; i < (argc - 1); i++)
-        argv[i] = argv[i + 1];
-      argv[argc - 1] = NULL;
-      execvp(argv[0], argv);
-      perror("execvp");
-    } else {
-      execlp(argv[0], argv[0], NULL);
-      perror("execlp");
-    }
-    _Exit(-1);
+    spawnExec(argc, argv);
   } else {
+    /* Only the child keeps these, or its output would never end. */
+    close(p_stdin[READ]);
+    close(p_stdout[WRITE]);
     if (!fdin)
       close(p_stdin[WRITE]);
     else
@@ -92,3 +130,52 @@ pid_t spawn(const char *path, int argc, char **argv, int *fdin, int *fdout)
   }
   return pid;
 }
+
+/*
+ * Same as spawn(), but the child gets a pseudo-terminal of its own as
+ * its controlling terminal and standard descriptors, so that it sees an
+ * interactive session and does not buffer its output up. Both ways go
+ * through the master side returned in fd.
+ */
+pid_t spawnPty(const char *path, int argc, char **argv, int *fd)
+{
+  char name[64];
+  int master = -1;
+  int slave = -1;
+  pid_t pid;
+
+  assert(fd);
+  if (spawnArgs(argc, argv) < 0)
+    return -1;
+  master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+  if (master < 0)
+    return -1;
+  if ((grantpt(master) < 0) || (unlockpt(master) < 0)
+      || ptsname_r(master, name, sizeof name)) {
+    close(master);
+    return -1;
+  }
+  pid = fork();
+  if (pid < 0) {
+    close(master);
+    return pid;
+  }
+  if (!pid)
+  {
+    spawnSignals();
+    if (setsid() < 0)
+      _Exit(-1);
+    slave = open(name, O_RDWR);
+    if (slave < 0)
+      _Exit(-1);
+    ioctl(slave, TIOCSCTTY, 0);
+    if ((dup2(slave, STDIN_FILENO) < 0) || (dup2(slave, STDOUT_FILENO) < 0)
+        || (dup2(slave, STDERR_FILENO) < 0))
+      _Exit(-1);
+    if (slave > STDERR_FILENO)
+      close(slave);
+    spawnExec(argc, argv);
+  }
+  *fd = master;
+  return pid;
+}
@@ -19,5 +19,6 @@
 #include <sys/types.h>
 
 pid_t spawn(const char *path, int argc, char **argv, int *fdin, int *fdout);
+pid_t spawnPty(const char *path, int argc, char **argv, int *fd);
 
 #endif /* __SPAWN_H */
@@ -0,0 +1,257 @@
+/*
+ * spsctest.c - Stress test of the single-producer/single-consumer ring.
+ *
+ * Written in 2020 by Paul Osmialowski <pawelo@king.net.pl>.
+ *
+ * To the extent possible under law, the author(s) have dedicated all
+ * copyright and related and neighboring rights to this software to
+ * the public domain worldwide. This software is distributed without
+ * any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication
+ * along with this software. If not, see
+ * <http://creativecommons.org/publicdomain/zero/1.0>.
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdatomic.h>
+
+#include "ringbuf.h"
+
+#define FAIL -1
+
+/* Defaults for -n and -s. */
+#define SPSC_BATCHES 200000U
+#define SPSC_CAPACITY 4096U
+
+/* Longest batch payload, past its sequence number. */
+#define SPSC_PAYLOAD_MAX 1024U
+
+#define SPSC_SEQ_LEN 8U
+
+/*
+ * The stream both threads agree on: batch after batch, each one its
+ * sequence number followed by a payload whose length and bytes follow
+ * from that number, so that any byte lost, repeated or out of place is
+ * caught by the consumer, wherever the producer split the batches up.
+ */
+struct Stream
+{
+  uint64_t seq;
+  size_t pos;
+  size_t len;
+};
+
+struct Spsc
+{
+  ringbuf_spsc_t rb;
+  uint64_t batches;
+  uint64_t bytes;
+  atomic_int failed;
+};
+
+static uint32_t spscRandom(uint32_t *state)
+{
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return *state;
+}
+
+static size_t spscLen(uint64_t seq)
+{
+  uint32_t mix = (uint32_t)(seq * 2654435761U);
+
+  return SPSC_SEQ_LEN + 1U + ((mix >> 16) % SPSC_PAYLOAD_MAX);
+}
+
+static void spscStart(struct Stream *st, uint64_t seq)
+{
+  st->seq = seq;
+  st->pos = 0U;
+  st->len = spscLen(seq);
+}
+
+static uint8_t spscByte(const struct Stream *st)
+{
+  if ((st->pos) < SPSC_SEQ_LEN)
+    return ((st->seq) >> ((st->pos) * 8U)) & 0xffU;
+  return ((st->seq) + (st->pos)) & 0xffU;
+}
+
+static void spscNext(struct Stream *st)
+{
+  st->pos++;
+  if ((st->pos) == (st->len))
+    spscStart(st, (st->seq) + 1U);
+}
+
+/* Nothing past the last batch, the consumer would not take it. */
+static size_t spscCap(const struct Spsc *spsc, const struct Stream *st,
+                      size_t n)
+{
+  size_t left = (st->len) - (st->pos);
+  uint64_t seq;
+
+  for (seq = (st->seq) + 1U; (left < n) && (seq < (spsc->batches)); seq++)
+    left += spscLen(seq);
+  return (left < n) ? left : n;
+}
+
+static void spscFill(struct Stream *st, uint8_t *data, size_t size)
+{
+  size_t i;
+
+  for (i = 0U; i < size; i++) {
+    data[i] = spscByte(st);
+    spscNext(st);
+  }
+}
+
+/*
+ * Batches go in through ringbuf_spsc_reserve() and ringbuf_spsc_commit()
+ * in pieces of whatever size, cut short wherever the ring wraps, with
+ * every fourth piece taking the ringbuf_spsc_memcpy_into() way instead.
+ */
+static void *spscProducer(void *arg)
+{
+  struct Spsc *spsc = ((struct Spsc *)(arg));
+  struct Stream st;
+  struct Stream ahead;
+  uint8_t tmp[SPSC_PAYLOAD_MAX];
+  uint32_t state = 0x9e3779b9U;
+  void *data = NULL;
+  size_t avail;
+  size_t n;
+  size_t i;
+
+  spscStart(&st, 0U);
+  while (((st.seq) < (spsc->batches)) && (!atomic_load(&(spsc->failed)))) {
+    /*
+     * A full ring only ever has room up to where it wraps, let the
+     * consumer catch up now and then so that pieces straddle it too.
+     */
+    if (!(spscRandom(&state) % 8U)) {
+      while ((ringbuf_spsc_bytes_used(spsc->rb)
+              > (ringbuf_spsc_capacity(spsc->rb) / 2U))
+             && (!atomic_load(&(spsc->failed))))
+        sched_yield();
+    }
+    n = spscCap(spsc, &st, 1U + (spscRandom(&state) % SPSC_PAYLOAD_MAX));
+    if (!(spscRandom(&state) % 4U)) {
+      ahead = st;
+      spscFill(&ahead, tmp, n);
+      n = ringbuf_spsc_memcpy_into(spsc->rb, tmp, n);
+      for (i = 0U; i < n; i++)
+        spscNext(&st);
+    } else {
+      avail = ringbuf_spsc_reserve(spsc->rb, &data);
+      if (n > avail)
+        n = avail;
+      spscFill(&st, (uint8_t *)(data), n);
+      ringbuf_spsc_commit(spsc->rb, n);
+    }
+    if (!n)
+      sched_yield();
+  }
+  return NULL;
+}
+
+static void *spscConsumer(void *arg)
+{
+  struct Spsc *spsc = ((struct Spsc *)(arg));
+  struct Stream st;
+  const void *data = NULL;
+  const uint8_t *bytes = NULL;
+  uint32_t state = 0x7f4a7c15U;
+  size_t avail;
+  size_t n;
+  size_t i;
+
+  spscStart(&st, 0U);
+  while ((st.seq) < (spsc->batches)) {
+    avail = ringbuf_spsc_peek(spsc->rb, &data);
+    if (!avail) {
+      sched_yield();
+      continue;
+    }
+    /* Give back less than there is every now and then. */
+    n = 1U + (spscRandom(&state) % avail);
+    bytes = (const uint8_t *)(data);
+    for (i = 0U; i < n; i++) {
+      if (bytes[i] != spscByte(&st)) {
+        fprintf(stderr, "Batch %llu byte %zu: got 0x%02x, expected 0x%02x.\n",
+                (unsigned long long)(st.seq), st.pos, bytes[i],
+                spscByte(&st));
+        atomic_store(&(spsc->failed), !0);
+        return NULL;
+      }
+      spscNext(&st);
+    }
+    spsc->bytes += n;
+    ringbuf_spsc_consume(spsc->rb, n);
+  }
+  return NULL;
+}
+
+int main(int argc, char **argv)
+{
+  struct Spsc spsc;
+  pthread_t producer;
+  pthread_t consumer;
+  size_t capacity = SPSC_CAPACITY;
+  int opt;
+
+  memset(&spsc, 0, sizeof spsc);
+  atomic_init(&(spsc.failed), 0);
+  spsc.batches = SPSC_BATCHES;
+  while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+    if (opt == 'n')
+      spsc.batches = strtoull(optarg, NULL, 10);
+    else if (opt == 's')
+      capacity = strtoul(optarg, NULL, 10);
+    else
+      capacity = 0U;
+    if ((!(spsc.batches)) || (!capacity)) {
+      fprintf(stderr, "Usage: %s [-n <batches>] [-s <ring size>]\n",
+              argv[0]);
+      return FAIL;
+    }
+  }
+  spsc.rb = ringbuf_spsc_new(capacity);
+  if (!(spsc.rb)) {
+    fprintf(stderr, "Out of memory.\n");
+    return FAIL;
+  }
+  if (pthread_create(&consumer, NULL, spscConsumer, &spsc)) {
+    fprintf(stderr, "Cannot start consumer thread.\n");
+    ringbuf_spsc_free(&(spsc.rb));
+    return FAIL;
+  }
+  if (pthread_create(&producer, NULL, spscProducer, &spsc)) {
+    fprintf(stderr, "Cannot start producer thread.\n");
+    /* Nothing is ever coming, the consumer is only let go by the test. */
+    _exit(FAIL);
+  }
+  pthread_join(producer, NULL);
+  pthread_join(consumer, NULL);
+  if ((!atomic_load(&(spsc.failed))) && ringbuf_spsc_bytes_used(spsc.rb)) {
+    fprintf(stderr, "%zu bytes left over.\n",
+            ringbuf_spsc_bytes_used(spsc.rb));
+    atomic_store(&(spsc.failed), !0);
+  }
+  ringbuf_spsc_free(&(spsc.rb));
+  if (atomic_load(&(spsc.failed)))
+    return FAIL;
+  printf("%llu batches, %llu bytes through a %zu byte ring: ok\n",
+         (unsigned long long)(spsc.batches),
+         (unsigned long long)(spsc.bytes), capacity);
+  return 0;
+}
@@ -16,11 +16,35 @@
 #include <stddef.h> /* needed by libtelnet.h */
 #include <stdint.h>
 #include <stdlib.h>
+#include <sys/ioctl.h>
+#include <termios.h>
 
 #include <libtelnet.h>
 
 #include "connection.h"
 #include "telnetd.h"
+#include "trace.h"
+
+/*
+ * Master side of the terminal the host runs on, if any. Set up once
+ * before any connection comes in, only read afterwards.
+ */
+static int ptyfd = -1;
+
+/* The size of the window of whichever peer told it last. */
+static void telnetdNaws(const unsigned char *buf, size_t size)
+{
+  struct winsize ws;
+
+  if ((ptyfd < 0) || (size != 4U))
+    return;
+  ws.ws_col = (buf[0] << 8) | buf[1];
+  ws.ws_row = (buf[2] << 8) | buf[3];
+  ws.ws_xpixel = 0U;
+  ws.ws_ypixel = 0U;
+  if ((ws.ws_col) && (ws.ws_row))
+    ioctl(ptyfd, TIOCSWINSZ, &ws);
+}
 
 static void telnetdEvents(telnet_t *telnet, telnet_event_t *ev, void *data)
 {
@@ -28,18 +52,26 @@ static void telnetdEvents(telnet_t *telnet, telnet_event_t *ev, void *data)
 
   if (!conn)
     return;
+  TRACE(TRACE_TELNET, ev->type, conn->sock,
+        (((ev->type) == TELNET_EV_DATA) || ((ev->type) == TELNET_EV_SEND))
+          ? ev->data.size : 0U, 0U);
   switch (ev->type) {
   case TELNET_EV_DATA:
     if (connNetToHostPut(conn, (uint8_t *)(ev->data.buffer), ev->data.size) < 0)
       killConnection(conn);
     break;
   case TELNET_EV_SEND:
-    if (connSend(conn, (const uint8_t *)(ev->data.buffer), ev->data.size) < 0)
+    if (connSendControl(conn, (const uint8_t *)(ev->data.buffer),
+                        ev->data.size) < 0)
       killConnection(conn);
     break;
   case TELNET_EV_DO:
     if ((ev->neg.telopt) == TELNET_TELOPT_COMPRESS2)
-      telnet_begin_compress2(telnet);
+      conn->compress = !0;
+    break;
+  case TELNET_EV_SUBNEGOTIATION:
+    if ((ev->sub.telopt) == TELNET_TELOPT_NAWS)
+      telnetdNaws((const unsigned char *)(ev->sub.buffer), ev->sub.size);
     break;
   case TELNET_EV_ERROR:
     killConnection(conn);
@@ -55,14 +87,20 @@ int telnetdInit(struct Connection *conn)
   {
     { .telopt = TELNET_TELOPT_COMPRESS2, .us = TELNET_WILL,
                                          .him = TELNET_DONT },
+    { .telopt = TELNET_TELOPT_NAWS, .us = TELNET_WONT,
+                                    .him = TELNET_DO },
     { .telopt = -1, .us = 0U, .him = 0U }
   };
   char submode[2];
 
   if (!conn)
     return -1;
-  conn->telnet = telnet_init(telnetdOpts, telnetdEvents, 0U, conn);
+  /* A terminal wants a bare CR (or LF) for the end of a line. */
+  conn->telnet = telnet_init(telnetdOpts, telnetdEvents,
+                             (ptyfd < 0) ? 0U : TELNET_FLAG_NVT_EOL, conn);
   telnet_negotiate(conn->telnet, TELNET_WILL, TELNET_TELOPT_COMPRESS2);
+  if (!(ptyfd < 0))
+    telnet_negotiate(conn->telnet, TELNET_DO, TELNET_TELOPT_NAWS);
   if (!(getenv("TELNET_TELOPT_LINEMODE"))) {
     telnet_negotiate(conn->telnet, TELNET_DO, TELNET_TELOPT_LINEMODE);
     submode[0] = 1; /* MODE */
@@ -75,6 +113,11 @@ int telnetdInit(struct Connection *conn)
   return 0;
 }
 
+void telnetdPty(int fd)
+{
+  ptyfd = fd;
+}
+
 void telnetdStop(struct Connection *conn)
 {
   if (!conn)
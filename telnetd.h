@@ -20,5 +20,6 @@
 
 int telnetdInit(struct Connection *conn);
 void telnetdStop(struct Connection *conn);
+void telnetdPty(int fd);
 
 #endif /* __TELNETD_H */
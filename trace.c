@@ -0,0 +1,205 @@
+/*
+ * trace.c - Hot path tracing implementation.
+ *
+ * Written in 2020 by Paul Osmialowski <pawelo@king.net.pl>.
+ *
+ * To the extent possible under law, the author(s) have dedicated all
+ * copyright and related and neighboring rights to this software to
+ * the public domain worldwide. This software is distributed without
+ * any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication
+ * along with this software. If not, see
+ * <http://creativecommons.org/publicdomain/zero/1.0>.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+
+/*
+ * Every thread records into a ring of its own with no locking at all,
+ * the oldest records giving way to the new ones. Only the count of
+ * records written is shared, so that the rings can be written out while
+ * the threads keep going: whatever got overwritten meanwhile is left out.
+ */
+struct TraceRing
+{
+  struct TraceRing *next;
+  uint32_t thread;
+  atomic_ullong head;
+  struct TraceRecord records[];
+};
+
+int traceOn = 0;
+
+static pthread_mutex_t ringsLock = PTHREAD_MUTEX_INITIALIZER;
+static struct TraceRing *rings = NULL;
+static char *tracePath = NULL;
+static uint64_t traceSize = 0U;
+static _Thread_local struct TraceRing *ring = NULL;
+static _Thread_local int ringFailed = 0;
+
+/* Records are kept in rings of a power of two in size. */
+int traceInit(const char *path, uint64_t records)
+{
+  uint64_t size = 2U;
+
+  assert(path);
+  while (size < records)
+    size <<= 1;
+  tracePath = strdup(path);
+  if (!tracePath)
+    return -1;
+  traceSize = size;
+  traceOn = !0;
+  return 0;
+}
+
+static struct TraceRing *traceRing(void)
+{
+  struct TraceRing *mine = NULL;
+
+  if (ringFailed)
+    return NULL;
+  mine = (struct TraceRing *)(malloc(sizeof(struct TraceRing)
+                                     + (traceSize
+                                        * sizeof(struct TraceRecord))));
+  if (!mine) {
+    ringFailed = !0;
+    return NULL;
+  }
+  mine->thread = (uint32_t)(syscall(SYS_gettid));
+  atomic_init(&(mine->head), 0U);
+  pthread_mutex_lock(&ringsLock);
+  mine->next = rings;
+  rings = mine;
+  pthread_mutex_unlock(&ringsLock);
+  ring = mine;
+  return mine;
+}
+
+void traceRecord(int event, unsigned arg, int fd, uint64_t a, uint64_t b)
+{
+  struct TraceRing *mine = ring;
+  struct TraceRecord *record = NULL;
+  struct timespec ts;
+  uint64_t head;
+
+  if ((!mine) && (!(mine = traceRing())))
+    return;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  head = atomic_load_explicit(&(mine->head), memory_order_relaxed);
+  record = &(mine->records[head & (traceSize - 1U)]);
+  record->time = (((uint64_t)(ts.tv_sec)) * 1000000000U) + ts.tv_nsec;
+  record->event = (uint16_t)(event);
+  record->arg = (uint16_t)(arg);
+  record->fd = fd;
+  record->a = a;
+  record->b = b;
+  atomic_store_explicit(&(mine->head), head + 1U, memory_order_release);
+}
+
+/* Called with ringsLock held. */
+static int traceWriteRing(FILE *out, struct TraceRing *each,
+                          struct TraceRecord *copy)
+{
+  struct TraceRingHeader header;
+  uint64_t first;
+  uint64_t last;
+  uint64_t safe;
+  uint64_t i;
+
+  last = atomic_load_explicit(&(each->head), memory_order_acquire);
+  first = (last > traceSize) ? (last - traceSize) : 0U;
+  for (i = first; i < last; i++)
+    copy[i - first] = each->records[i & (traceSize - 1U)];
+  /* The record being written now takes the place of the oldest one. */
+  safe = atomic_load_explicit(&(each->head), memory_order_acquire) + 1U;
+  safe = (safe > traceSize) ? (safe - traceSize) : 0U;
+  if (safe > last)
+    safe = last;
+  if (safe < first)
+    safe = first;
+  memset(&header, 0, sizeof header);
+  header.thread = each->thread;
+  header.count = last - safe;
+  header.lost = safe;
+  if (fwrite(&header, sizeof header, 1U, out) != 1U)
+    return -1;
+  if ((header.count)
+      && (fwrite(copy + (safe - first), sizeof(struct TraceRecord),
+                 header.count, out) != header.count))
+    return -1;
+  return 0;
+}
+
+/*
+ * Write out what every thread has recorded so far, from any thread and
+ * at any time, to be made sense of by stdiotelnetd-trace.
+ */
+int traceWrite(void)
+{
+  struct TraceHeader header;
+  struct TraceRecord *copy = NULL;
+  struct TraceRing *each = NULL;
+  FILE *out = NULL;
+  int ret = 0;
+
+  if (!tracePath)
+    return 0;
+  copy = (struct TraceRecord *)(malloc(traceSize
+                                       * sizeof(struct TraceRecord)));
+  if (!copy)
+    return -1;
+  out = fopen(tracePath, "wbe");
+  if (!out) {
+    free(copy);
+    return -1;
+  }
+  memset(&header, 0, sizeof header);
+  memcpy(header.magic, TRACE_MAGIC, sizeof header.magic);
+  header.version = TRACE_VERSION;
+  header.recordSize = sizeof(struct TraceRecord);
+  if (fwrite(&header, sizeof header, 1U, out) != 1U)
+    ret = -1;
+  pthread_mutex_lock(&ringsLock);
+  for (each = rings; each && (!ret); each = each->next)
+    ret = traceWriteRing(out, each, copy);
+  pthread_mutex_unlock(&ringsLock);
+  if (fclose(out))
+    ret = -1;
+  free(copy);
+  return ret;
+}
+
+/* Only once every thread is gone. */
+void traceFree(void)
+{
+  struct TraceRing *each = NULL;
+
+  traceOn = 0;
+  pthread_mutex_lock(&ringsLock);
+  while (rings) {
+    each = rings;
+    rings = each->next;
+    free(each);
+  }
+  pthread_mutex_unlock(&ringsLock);
+  ring = NULL;
+  free(tracePath);
+  tracePath = NULL;
+}
@@ -0,0 +1,92 @@
+/*
+ * trace.h - Hot path tracing interface.
+ *
+ * Written in 2020 by Paul Osmialowski <pawelo@king.net.pl>.
+ *
+ * To the extent possible under law, the author(s) have dedicated all
+ * copyright and related and neighboring rights to this software to
+ * the public domain worldwide. This software is distributed without
+ * any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication
+ * along with this software. If not, see
+ * <http://creativecommons.org/publicdomain/zero/1.0>.
+ */
+
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include <stdint.h>
+
+/* Default for TELNET_TRACE_RECORDS, records kept by every thread. */
+#ifndef TRACE_RECORDS
+#define TRACE_RECORDS 65536U
+#endif
+
+#define TRACE_MAGIC "STDTRACE"
+#define TRACE_VERSION 1U
+
+/*
+ * The tracepoints. Offsets are positions in the logs the host output
+ * goes through, which is what ties a chunk read from the host to the
+ * sends that took it to every peer.
+ */
+enum
+{
+  TRACE_STEP = 0,   /* a: when the loop woke up, metricsClock() */
+  TRACE_CONN,       /* arg: whether the socket was read from */
+  TRACE_RECV,       /* a: bytes received */
+  TRACE_SEND,       /* arg: profile, a: bytes sent, b: log offset */
+  TRACE_SPLICE,     /* a: bytes spliced */
+  TRACE_TELNET,     /* arg: libtelnet event type, a: size */
+  TRACE_ADOPT,
+  TRACE_CLOSE,
+  TRACE_ENCODE,     /* arg: profile, a: source offset, b: log offset */
+  TRACE_HOST_READ,  /* a: bytes read, b: raw log offset */
+  TRACE_HOST_SPLICE, /* a: bytes taken past the log */
+  TRACE_HOST_WRITE, /* a: bytes written */
+  TRACE_MAX
+};
+
+/* As written out, in the byte order of the machine. */
+struct TraceRecord
+{
+  uint64_t time; /* nanoseconds, CLOCK_MONOTONIC */
+  uint16_t event;
+  uint16_t arg;
+  int32_t fd;
+  uint64_t a;
+  uint64_t b;
+};
+
+struct TraceHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t recordSize;
+};
+
+/* Followed by count records of a single thread, oldest first. */
+struct TraceRingHeader
+{
+  uint32_t thread;
+  uint32_t reserved;
+  uint64_t count;
+  uint64_t lost; /* overwritten before they could be written out */
+};
+
+extern int traceOn;
+
+/* Costs a single branch while tracing is off. */
+#define TRACE(event, arg, fd, a, b) \
+  do { \
+    if (traceOn) \
+      traceRecord((event), (arg), (fd), (a), (b)); \
+  } while (0)
+
+int traceInit(const char *path, uint64_t records);
+void traceRecord(int event, unsigned arg, int fd, uint64_t a, uint64_t b);
+int traceWrite(void);
+void traceFree(void);
+
+#endif /* __TRACE_H */
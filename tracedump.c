@@ -0,0 +1,474 @@
+/*
+ * tracedump.c - Offline decoder for the traces written by stdiotelnetd.
+ *
+ * Written in 2020 by Paul Osmialowski <pawelo@king.net.pl>.
+ *
+ * To the extent possible under law, the author(s) have dedicated all
+ * copyright and related and neighboring rights to this software to
+ * the public domain worldwide. This software is distributed without
+ * any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication
+ * along with this software. If not, see
+ * <http://creativecommons.org/publicdomain/zero/1.0>.
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "trace.h"
+#include "encoder.h"
+
+#define FAIL -1
+
+/* Profiles whose logs the encoder runs tie together. */
+#define ENCODER_PROFILES ENCODER_MAX
+
+static const char *const names[TRACE_MAX] = {
+  "step",
+  "conn",
+  "recv",
+  "send",
+  "splice",
+  "telnet",
+  "adopt",
+  "close",
+  "encode",
+  "host-read",
+  "host-splice",
+  "host-write"
+};
+
+struct Event
+{
+  struct TraceRecord rec;
+  uint32_t thread;
+};
+
+struct Trace
+{
+  struct Event *events;
+  size_t count;
+  uint64_t lost;
+  uint64_t start;
+};
+
+/* A growable array of durations, in nanoseconds. */
+struct Samples
+{
+  uint64_t *values;
+  size_t count;
+  size_t size;
+};
+
+static int samplesAdd(struct Samples *samples, uint64_t value)
+{
+  uint64_t *values = NULL;
+  size_t size;
+
+  if ((samples->count) == (samples->size)) {
+    size = (samples->size) ? ((samples->size) * 2U) : 1024U;
+    values = (uint64_t *)(realloc(samples->values, size * sizeof(uint64_t)));
+    if (!values)
+      return -1;
+    samples->values = values;
+    samples->size = size;
+  }
+  samples->values[samples->count++] = value;
+  return 0;
+}
+
+static int compareValues(const void *a, const void *b)
+{
+  uint64_t x = *((const uint64_t *)(a));
+  uint64_t y = *((const uint64_t *)(b));
+
+  return (x > y) - (x < y);
+}
+
+static int compareEvents(const void *a, const void *b)
+{
+  const struct Event *x = ((const struct Event *)(a));
+  const struct Event *y = ((const struct Event *)(b));
+
+  if ((x->rec.time) != (y->rec.time))
+    return ((x->rec.time) > (y->rec.time)) ? 1 : -1;
+  /* The records of a single thread keep their order. */
+  if ((x->thread) != (y->thread))
+    return ((x->thread) > (y->thread)) ? 1 : -1;
+  return (x > y) - (x < y);
+}
+
+static void samplesPrint(const char *what, struct Samples *samples)
+{
+  const uint64_t *v = samples->values;
+  size_t n = samples->count;
+
+  if (!n) {
+    printf("%s: no samples\n", what);
+    return;
+  }
+  qsort(samples->values, n, sizeof(uint64_t), compareValues);
+  printf("%s: %zu samples, usec min %.1f p50 %.1f p90 %.1f p99 %.1f"
+         " p99.9 %.1f max %.1f\n", what, n, v[0] / 1e3, v[n / 2U] / 1e3,
+         v[(n * 9U) / 10U] / 1e3, v[(n * 99U) / 100U] / 1e3,
+         v[(n * 999U) / 1000U] / 1e3, v[n - 1U] / 1e3);
+}
+
+static int traceLoad(struct Trace *trace, const char *path)
+{
+  struct TraceHeader header;
+  struct TraceRingHeader ring;
+  struct TraceRecord rec;
+  struct Event *events = NULL;
+  FILE *in = NULL;
+  uint64_t i;
+
+  memset(trace, 0, sizeof(struct Trace));
+  in = fopen(path, "rb");
+  if (!in) {
+    perror(path);
+    return -1;
+  }
+  if ((fread(&header, sizeof header, 1U, in) != 1U)
+      || memcmp(header.magic, TRACE_MAGIC, sizeof header.magic)
+      || ((header.version) != TRACE_VERSION)
+      || ((header.recordSize) != sizeof(struct TraceRecord))) {
+    fprintf(stderr, "%s: not a trace this program can read.\n", path);
+    fclose(in);
+    return -1;
+  }
+  while (fread(&ring, sizeof ring, 1U, in) == 1U) {
+    events = (struct Event *)(realloc(trace->events,
+                                      ((trace->count) + (ring.count))
+                                      * sizeof(struct Event)));
+    if ((ring.count) && (!events)) {
+      fclose(in);
+      return -1;
+    }
+    trace->events = events;
+    trace->lost += ring.lost;
+    for (i = 0U; i < (ring.count); i++) {
+      if (fread(&rec, sizeof rec, 1U, in) != 1U) {
+        fprintf(stderr, "%s: cut short.\n", path);
+        fclose(in);
+        return -1;
+      }
+      trace->events[trace->count].rec = rec;
+      trace->events[trace->count].thread = ring.thread;
+      trace->count++;
+    }
+  }
+  fclose(in);
+  if (trace->count)
+    qsort(trace->events, trace->count, sizeof(struct Event), compareEvents);
+  trace->start = (trace->count) ? trace->events[0].rec.time : 0U;
+  return 0;
+}
+
+static void traceList(const struct Trace *trace)
+{
+  const struct Event *ev = NULL;
+  size_t i;
+
+  printf("# usec thread event fd arg a b\n");
+  for (i = 0U; i < (trace->count); i++) {
+    ev = &(trace->events[i]);
+    printf("%.3f %u %s %d %u %llu %llu\n",
+           ((ev->rec.time) - (trace->start)) / 1e3, ev->thread,
+           ((ev->rec.event) < TRACE_MAX) ? names[ev->rec.event] : "?",
+           ev->rec.fd, ev->rec.arg, (unsigned long long)(ev->rec.a),
+           (unsigned long long)(ev->rec.b));
+  }
+}
+
+/* A growable array of events, in the order they happened. */
+struct Refs
+{
+  const struct Event **refs;
+  size_t count;
+  size_t size;
+};
+
+static int refsAdd(struct Refs *refs, const struct Event *ev)
+{
+  const struct Event **grown = NULL;
+  size_t size;
+
+  if ((refs->count) == (refs->size)) {
+    size = (refs->size) ? ((refs->size) * 2U) : 64U;
+    grown = (const struct Event **)(realloc(refs->refs,
+                                            size * sizeof(*grown)));
+    if (!grown)
+      return -1;
+    refs->refs = grown;
+    refs->size = size;
+  }
+  refs->refs[refs->count++] = ev;
+  return 0;
+}
+
+/* Encoder runs of a thread, one list per profile fed by another. */
+struct Encoding
+{
+  uint32_t thread;
+  struct Refs runs[ENCODER_PROFILES];
+};
+
+/* A peer from when it came in until its socket went. */
+struct Peer
+{
+  uint32_t thread;
+  int32_t fd;
+  uint64_t adopted;
+  int open;
+  struct Refs sends;
+};
+
+struct Index
+{
+  struct Refs reads;
+  struct Encoding *encodings;
+  size_t nencodings;
+  struct Peer *peers;
+  size_t npeers;
+};
+
+static struct Encoding *indexEncoding(struct Index *index, uint32_t thread)
+{
+  struct Encoding *grown = NULL;
+  size_t i;
+
+  for (i = 0U; i < (index->nencodings); i++) {
+    if ((index->encodings[i].thread) == thread)
+      return &(index->encodings[i]);
+  }
+  grown = (struct Encoding *)(realloc(index->encodings,
+                                      ((index->nencodings) + 1U)
+                                      * sizeof(struct Encoding)));
+  if (!grown)
+    return NULL;
+  index->encodings = grown;
+  memset(&(grown[index->nencodings]), 0, sizeof(struct Encoding));
+  grown[index->nencodings].thread = thread;
+  return &(grown[index->nencodings++]);
+}
+
+static struct Peer *indexPeer(struct Index *index, uint32_t thread,
+                              int32_t fd)
+{
+  struct Peer *peer = NULL;
+  size_t i;
+
+  for (i = index->npeers; i > 0U; i--) {
+    peer = &(index->peers[i - 1U]);
+    if ((peer->open) && ((peer->thread) == thread) && ((peer->fd) == fd))
+      return peer;
+  }
+  return NULL;
+}
+
+static int indexBuild(struct Index *index, const struct Trace *trace)
+{
+  const struct Event *ev = NULL;
+  struct Encoding *encoding = NULL;
+  struct Peer *peer = NULL;
+  size_t i;
+
+  memset(index, 0, sizeof(struct Index));
+  for (i = 0U; i < (trace->count); i++) {
+    ev = &(trace->events[i]);
+    switch (ev->rec.event) {
+    case TRACE_HOST_READ:
+      if (refsAdd(&(index->reads), ev) < 0)
+        return -1;
+      break;
+    case TRACE_ENCODE:
+      if (!((ev->rec.arg) > 0U) || !((ev->rec.arg) < ENCODER_PROFILES))
+        break;
+      encoding = indexEncoding(index, ev->thread);
+      if ((!encoding) || (refsAdd(&(encoding->runs[ev->rec.arg]), ev) < 0))
+        return -1;
+      break;
+    case TRACE_ADOPT:
+      peer = (struct Peer *)(realloc(index->peers, ((index->npeers) + 1U)
+                                                   * sizeof(struct Peer)));
+      if (!peer)
+        return -1;
+      index->peers = peer;
+      peer = &(index->peers[index->npeers++]);
+      memset(peer, 0, sizeof(struct Peer));
+      peer->thread = ev->thread;
+      peer->fd = ev->rec.fd;
+      peer->adopted = ev->rec.time;
+      peer->open = !0;
+      break;
+    case TRACE_SEND:
+      peer = indexPeer(index, ev->thread, ev->rec.fd);
+      if (peer && (refsAdd(&(peer->sends), ev) < 0))
+        return -1;
+      break;
+    case TRACE_CLOSE:
+      peer = indexPeer(index, ev->thread, ev->rec.fd);
+      if (peer)
+        peer->open = 0;
+      break;
+    default:
+      ;
+    }
+  }
+  return 0;
+}
+
+static void indexFree(struct Index *index)
+{
+  size_t i;
+  int j;
+
+  free(index->reads.refs);
+  for (i = 0U; i < (index->nencodings); i++) {
+    for (j = 0; j < ENCODER_PROFILES; j++)
+      free(index->encodings[i].runs[j].refs);
+  }
+  free(index->encodings);
+  for (i = 0U; i < (index->npeers); i++)
+    free(index->peers[i].sends.refs);
+  free(index->peers);
+}
+
+/*
+ * Where the host output up to a raw log offset ends up in the log of a
+ * profile, as encoded by a given thread: the first encoder run that got
+ * past it tells. Zero when it never got that far.
+ */
+static uint64_t indexMap(const struct Index *index, uint32_t thread,
+                         unsigned profile, uint64_t offset)
+{
+  const struct Encoding *encoding = NULL;
+  const struct Refs *runs = NULL;
+  unsigned step;
+  size_t lo;
+  size_t hi;
+  size_t i;
+
+  for (i = 0U; i < (index->nencodings); i++) {
+    if ((index->encodings[i].thread) == thread)
+      encoding = &(index->encodings[i]);
+  }
+  if (!profile)
+    return offset;
+  if ((!encoding) || !(profile < ENCODER_PROFILES))
+    return 0U;
+  for (step = 1U; step <= profile; step++) {
+    runs = &(encoding->runs[step]);
+    lo = 0U;
+    hi = runs->count;
+    while (lo < hi) {
+      i = lo + ((hi - lo) / 2U);
+      if ((runs->refs[i]->rec.a) < offset)
+        lo = i + 1U;
+      else
+        hi = i;
+    }
+    if (!(lo < (runs->count)))
+      return 0U;
+    offset = runs->refs[lo]->rec.b;
+  }
+  return offset;
+}
+
+/*
+ * A chunk of host output has gone to a peer once a send to it reached
+ * past the place the chunk ended up at in the log the peer reads. Peers
+ * of programs of their own (TELNET_SESSIONS) have logs of their own
+ * that do not line up with the host output, they are left out.
+ */
+static int traceLatency(const struct Trace *trace, struct Samples *chunks,
+                        struct Samples *loops)
+{
+  const struct Event *ev = NULL;
+  const struct Event *read = NULL;
+  const struct Event *send = NULL;
+  const struct Peer *peer = NULL;
+  struct Index index;
+  uint64_t target;
+  size_t i;
+  size_t j;
+  size_t k;
+  int ret = 0;
+
+  for (i = 0U; i < (trace->count); i++) {
+    ev = &(trace->events[i]);
+    if (((ev->rec.event) == TRACE_STEP)
+        && (((ev->rec.time) / 1000U) >= (ev->rec.a))
+        && (samplesAdd(loops, (ev->rec.time) - ((ev->rec.a) * 1000U)) < 0))
+      return -1;
+  }
+  if (indexBuild(&index, trace) < 0) {
+    indexFree(&index);
+    return -1;
+  }
+  for (i = 0U; (i < index.npeers) && (!ret); i++) {
+    peer = &(index.peers[i]);
+    k = 0U;
+    for (j = 0U; (j < index.reads.count) && (k < peer->sends.count); j++) {
+      read = index.reads.refs[j];
+      if ((read->rec.time) < (peer->adopted))
+        continue;
+      for (; k < (peer->sends.count); k++) {
+        send = peer->sends.refs[k];
+        if ((send->rec.time) < (read->rec.time))
+          continue;
+        target = indexMap(&index, send->thread, send->rec.arg, read->rec.b);
+        if (target && ((send->rec.b) >= target)) {
+          ret = samplesAdd(chunks, (send->rec.time) - (read->rec.time));
+          break;
+        }
+      }
+    }
+  }
+  indexFree(&index);
+  return ret;
+}
+
+int main(int argc, char **argv)
+{
+  struct Trace trace;
+  struct Samples chunks;
+  struct Samples loops;
+  int latency;
+
+  if ((argc < 2) || (argc > 3)
+      || ((argc == 3) && strcmp(argv[1], "-l"))) {
+    fprintf(stderr, "Usage: %s [-l] <trace>\n", argv[0]);
+    return FAIL;
+  }
+  latency = (argc == 3);
+  if (traceLoad(&trace, argv[argc - 1]) < 0)
+    return FAIL;
+  if (trace.lost)
+    fprintf(stderr, "%llu records overwritten before written out.\n",
+            (unsigned long long)(trace.lost));
+  if (!latency) {
+    traceList(&trace);
+    free(trace.events);
+    return 0;
+  }
+  memset(&chunks, 0, sizeof chunks);
+  memset(&loops, 0, sizeof loops);
+  if (traceLatency(&trace, &chunks, &loops) < 0) {
+    fprintf(stderr, "Out of memory.\n");
+    free(trace.events);
+    return FAIL;
+  }
+  samplesPrint("host to socket", &chunks);
+  samplesPrint("loop turn", &loops);
+  free(chunks.values);
+  free(loops.values);
+  free(trace.events);
+  return 0;
+}
@@ -0,0 +1,294 @@
+/*
+ * uring.c - Minimal io_uring implementation.
+ *
+ * Written in 2020 by Paul Osmialowski <pawelo@king.net.pl>.
+ *
+ * To the extent possible under law, the author(s) have dedicated all
+ * copyright and related and neighboring rights to this software to
+ * the public domain worldwide. This software is distributed without
+ * any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication
+ * along with this software. If not, see
+ * <http://creativecommons.org/publicdomain/zero/1.0>.
+ */
+
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "uring.h"
+
+/* What the kernel takes for the size of a sigset_t. */
+#define URING_SIGSET_SIZE (_NSIG / 8)
+
+static int uringSetup(unsigned entries, struct io_uring_params *params)
+{
+  return (int)(syscall(__NR_io_uring_setup, entries, params));
+}
+
+static int uringSyscall(int fd, unsigned submit, unsigned wait,
+                        unsigned flags, const void *arg, size_t size)
+{
+  return (int)(syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg,
+                       size));
+}
+
+static int uringRegister(int fd, unsigned opcode, const void *arg,
+                         unsigned count)
+{
+  return (int)(syscall(__NR_io_uring_register, fd, opcode, arg, count));
+}
+
+int uringInit(struct Uring *uring, unsigned entries)
+{
+  struct io_uring_params params;
+  uint8_t *sq = NULL;
+  uint8_t *cq = NULL;
+
+  assert(uring);
+  memset(uring, 0, sizeof(struct Uring));
+  memset(&params, 0, sizeof params);
+  uring->sqRing = MAP_FAILED;
+  uring->cqRing = MAP_FAILED;
+  uring->sqes = MAP_FAILED;
+  uring->fd = uringSetup(entries, &params);
+  if ((uring->fd) < 0)
+    return -1;
+  uring->features = params.features;
+  uring->entries = params.sq_entries;
+  uring->sqRingSize = params.sq_off.array
+                      + (params.sq_entries * sizeof(unsigned));
+  uring->cqRingSize = params.cq_off.cqes
+                      + (params.cq_entries * sizeof(struct io_uring_cqe));
+  if ((uring->features) & IORING_FEAT_SINGLE_MMAP) {
+    if ((uring->cqRingSize) > (uring->sqRingSize))
+      uring->sqRingSize = uring->cqRingSize;
+    uring->cqRingSize = uring->sqRingSize;
+  }
+  uring->sqRing = mmap(NULL, uring->sqRingSize, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, uring->fd,
+                       IORING_OFF_SQ_RING);
+  if ((uring->sqRing) == MAP_FAILED) {
+    uringStop(uring);
+    return -1;
+  }
+  if ((uring->features) & IORING_FEAT_SINGLE_MMAP) {
+    uring->cqRing = uring->sqRing;
+  } else {
+    uring->cqRing = mmap(NULL, uring->cqRingSize, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, uring->fd,
+                         IORING_OFF_CQ_RING);
+    if ((uring->cqRing) == MAP_FAILED) {
+      uringStop(uring);
+      return -1;
+    }
+  }
+  uring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+  uring->sqes = mmap(NULL, uring->sqesSize, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+  if ((uring->sqes) == MAP_FAILED) {
+    uringStop(uring);
+    return -1;
+  }
+  sq = (uint8_t *)(uring->sqRing);
+  cq = (uint8_t *)(uring->cqRing);
+  uring->sqHead = (unsigned *)(sq + params.sq_off.head);
+  uring->sqTail = (unsigned *)(sq + params.sq_off.tail);
+  uring->sqMask = *((unsigned *)(sq + params.sq_off.ring_mask));
+  uring->sqArray = (unsigned *)(sq + params.sq_off.array);
+  uring->sqLocal = *(uring->sqTail);
+  uring->cqHead = (unsigned *)(cq + params.cq_off.head);
+  uring->cqTail = (unsigned *)(cq + params.cq_off.tail);
+  uring->cqMask = *((unsigned *)(cq + params.cq_off.ring_mask));
+  uring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  return 0;
+}
+
+void uringStop(struct Uring *uring)
+{
+  assert(uring);
+  if ((uring->sqes) != MAP_FAILED)
+    munmap(uring->sqes, uring->sqesSize);
+  if (((uring->cqRing) != MAP_FAILED) && ((uring->cqRing) != (uring->sqRing)))
+    munmap(uring->cqRing, uring->cqRingSize);
+  if ((uring->sqRing) != MAP_FAILED)
+    munmap(uring->sqRing, uring->sqRingSize);
+  uring->sqes = MAP_FAILED;
+  uring->cqRing = MAP_FAILED;
+  uring->sqRing = MAP_FAILED;
+  if (!((uring->fd) < 0))
+    close(uring->fd);
+  uring->fd = -1;
+}
+
+/*
+ * Get a cleared submission entry. A full queue is handed to the kernel
+ * first, so this only fails when the kernel does not take anything.
+ */
+struct io_uring_sqe *uringSqe(struct Uring *uring)
+{
+  struct io_uring_sqe *sqe = NULL;
+  unsigned index;
+
+  assert(uring);
+  if (((uring->sqLocal) - __atomic_load_n(uring->sqHead, __ATOMIC_ACQUIRE))
+      == (uring->entries)) {
+    if ((uringEnter(uring, 0, NULL, 0) < 0) && (errno != EINTR))
+      return NULL;
+    if (((uring->sqLocal)
+         - __atomic_load_n(uring->sqHead, __ATOMIC_ACQUIRE))
+        == (uring->entries))
+      return NULL;
+  }
+  index = (uring->sqLocal) & (uring->sqMask);
+  sqe = &(uring->sqes[index]);
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  uring->sqArray[index] = index;
+  uring->sqLocal++;
+  return sqe;
+}
+
+/*
+ * Submit whatever was queued and, when asked to wait, block until at
+ * least one completion comes in, a signal not in the mask arrives or
+ * the timeout (in milliseconds, negative for none) expires.
+ */
+int uringEnter(struct Uring *uring, int wait, const sigset_t *sigmask,
+               int timeout)
+{
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  unsigned submit;
+  unsigned flags = 0U;
+  int ret;
+
+  assert(uring);
+  __atomic_store_n(uring->sqTail, uring->sqLocal, __ATOMIC_RELEASE);
+  submit = (uring->sqLocal) - __atomic_load_n(uring->sqHead, __ATOMIC_ACQUIRE);
+  if (!wait) {
+    if (!submit)
+      return 0;
+    return uringSyscall(uring->fd, submit, 0U, 0U, NULL, 0U);
+  }
+  flags = IORING_ENTER_GETEVENTS;
+  if (timeout < 0)
+    return uringSyscall(uring->fd, submit, 1U, flags, sigmask,
+                        URING_SIGSET_SIZE);
+  memset(&arg, 0, sizeof arg);
+  ts.tv_sec = timeout / 1000;
+  ts.tv_nsec = (timeout % 1000) * 1000000L;
+  arg.sigmask = (uint64_t)((uintptr_t)(sigmask));
+  arg.sigmask_sz = URING_SIGSET_SIZE;
+  arg.ts = (uint64_t)((uintptr_t)(&ts));
+  ret = uringSyscall(uring->fd, submit, 1U, flags | IORING_ENTER_EXT_ARG,
+                     &arg, sizeof arg);
+  if ((ret < 0) && (errno == ETIME))
+    return 0;
+  return ret;
+}
+
+struct io_uring_cqe *uringPeek(struct Uring *uring)
+{
+  unsigned head;
+
+  assert(uring);
+  head = *(uring->cqHead);
+  if (head == __atomic_load_n(uring->cqTail, __ATOMIC_ACQUIRE))
+    return NULL;
+  return &(uring->cqes[head & (uring->cqMask)]);
+}
+
+void uringSeen(struct Uring *uring)
+{
+  assert(uring);
+  __atomic_store_n(uring->cqHead, (*(uring->cqHead)) + 1U, __ATOMIC_RELEASE);
+}
+
+/*
+ * Register count buffers of size bytes each as the buffer group given.
+ * Kernels older than 5.19 do not take a buffer ring, which fails this.
+ * The registration goes away with the ring, the memory does not.
+ */
+int uringBuffersInit(struct Uring *uring, struct UringBuffers *buffers,
+                     uint16_t group, unsigned count, unsigned size)
+{
+  struct io_uring_buf_reg reg;
+  unsigned i;
+
+  assert(uring);
+  assert(buffers);
+  assert(count && (!(count & (count - 1U))));
+  memset(buffers, 0, sizeof(struct UringBuffers));
+  buffers->count = count;
+  buffers->size = size;
+  buffers->mask = count - 1U;
+  buffers->group = group;
+  buffers->ringSize = count * sizeof(struct io_uring_buf);
+  buffers->ring = mmap(NULL, buffers->ringSize, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if ((buffers->ring) == MAP_FAILED) {
+    buffers->ring = NULL;
+    return -1;
+  }
+  buffers->data = (uint8_t *)(malloc(((size_t)(count)) * size));
+  if (!(buffers->data)) {
+    uringBuffersFree(buffers);
+    return -1;
+  }
+  memset(&reg, 0, sizeof reg);
+  reg.ring_addr = (uint64_t)((uintptr_t)(buffers->ring));
+  reg.ring_entries = count;
+  reg.bgid = group;
+  if (uringRegister(uring->fd, IORING_REGISTER_PBUF_RING, &reg, 1U) < 0) {
+    uringBuffersFree(buffers);
+    return -1;
+  }
+  for (i = 0U; i < count; i++)
+    uringBufferPut(buffers, i);
+  return 0;
+}
+
+/* Only once the ring they were registered with is gone. */
+void uringBuffersFree(struct UringBuffers *buffers)
+{
+  assert(buffers);
+  if (buffers->ring)
+    munmap(buffers->ring, buffers->ringSize);
+  buffers->ring = NULL;
+  free(buffers->data);
+  buffers->data = NULL;
+}
+
+const uint8_t *uringBuffer(const struct UringBuffers *buffers, unsigned id)
+{
+  assert(buffers);
+  assert(id < (buffers->count));
+  return (buffers->data) + (((size_t)(id)) * (buffers->size));
+}
+
+/* Give a buffer a completion came with back to the kernel. */
+void uringBufferPut(struct UringBuffers *buffers, unsigned id)
+{
+  struct io_uring_buf *buf = NULL;
+
+  assert(buffers);
+  assert(id < (buffers->count));
+  buf = &(buffers->ring->bufs[(buffers->tail) & (buffers->mask)]);
+  buf->addr = (uint64_t)((uintptr_t)(uringBuffer(buffers, id)));
+  buf->len = buffers->size;
+  buf->bid = id;
+  buffers->tail++;
+  __atomic_store_n(&(buffers->ring->tail), buffers->tail, __ATOMIC_RELEASE);
+}
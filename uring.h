@@ -0,0 +1,93 @@
+/*
+ * uring.h - Minimal io_uring interface.
+ *
+ * Written in 2020 by Paul Osmialowski <pawelo@king.net.pl>.
+ *
+ * To the extent possible under law, the author(s) have dedicated all
+ * copyright and related and neighboring rights to this software to
+ * the public domain worldwide. This software is distributed without
+ * any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication
+ * along with this software. If not, see
+ * <http://creativecommons.org/publicdomain/zero/1.0>.
+ */
+
+#ifndef __URING_H
+#define __URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <signal.h>
+#include <linux/io_uring.h>
+
+#ifndef URING_ENTRIES
+#define URING_ENTRIES 256U
+#endif
+
+/* Buffers handed to the kernel for receives, a power of two of them. */
+#ifndef URING_BUFFERS
+#define URING_BUFFERS 256U
+#endif
+
+#ifndef URING_BUFFER_SIZE
+#define URING_BUFFER_SIZE 512U
+#endif
+
+/*
+ * Just enough of a ring to queue requests and reap their completions
+ * straight through the syscalls, no liburing needed.
+ */
+struct Uring
+{
+  int fd;
+  unsigned *sqHead;
+  unsigned *sqTail;
+  unsigned sqMask;
+  unsigned *sqArray;
+  unsigned sqLocal;
+  struct io_uring_sqe *sqes;
+  unsigned *cqHead;
+  unsigned *cqTail;
+  unsigned cqMask;
+  struct io_uring_cqe *cqes;
+  void *sqRing;
+  size_t sqRingSize;
+  void *cqRing;
+  size_t cqRingSize;
+  size_t sqesSize;
+  unsigned entries;
+  unsigned features;
+};
+
+/*
+ * Buffers the kernel picks one of whenever a receive made with
+ * IOSQE_BUFFER_SELECT gets its data, so that no memory is tied up by a
+ * peer that has nothing to say. Each comes back with uringBufferPut().
+ */
+struct UringBuffers
+{
+  struct io_uring_buf_ring *ring;
+  size_t ringSize;
+  uint8_t *data;
+  unsigned count;
+  unsigned size;
+  unsigned mask;
+  uint16_t tail;
+  uint16_t group;
+};
+
+int uringInit(struct Uring *uring, unsigned entries);
+void uringStop(struct Uring *uring);
+struct io_uring_sqe *uringSqe(struct Uring *uring);
+int uringEnter(struct Uring *uring, int wait, const sigset_t *sigmask,
+               int timeout);
+struct io_uring_cqe *uringPeek(struct Uring *uring);
+void uringSeen(struct Uring *uring);
+int uringBuffersInit(struct Uring *uring, struct UringBuffers *buffers,
+                     uint16_t group, unsigned count, unsigned size);
+void uringBuffersFree(struct UringBuffers *buffers);
+const uint8_t *uringBuffer(const struct UringBuffers *buffers, unsigned id);
+void uringBufferPut(struct UringBuffers *buffers, unsigned id);
+
+#endif /* __URING_H */
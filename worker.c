@@ -0,0 +1,458 @@
+/*
+ * worker.c - Connection worker threads implementation.
+ *
+ * Written in 2020 by Paul Osmialowski <pawelo@king.net.pl>.
+ *
+ * To the extent possible under law, the author(s) have dedicated all
+ * copyright and related and neighboring rights to this software to
+ * the public domain worldwide. This software is distributed without
+ * any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication
+ * along with this software. If not, see
+ * <http://creativecommons.org/publicdomain/zero/1.0>.
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+
+#include "debug.h"
+#include "log.h"
+#include "worker.h"
+#include "server.h"
+#include "reactor.h"
+#include "bcast.h"
+#include "mailbox.h"
+#include "encoder.h"
+#include "slab.h"
+#include "metrics.h"
+
+static void workerKick(int fd)
+{
+  uint64_t one = 1U;
+
+  while ((write(fd, &one, sizeof one) < 0) && (errno == EINTR))
+    ;
+}
+
+static void workerDrainFd(int fd)
+{
+  uint64_t count;
+
+  while ((read(fd, &count, sizeof count) < 0) && (errno == EINTR))
+    ;
+}
+
+/*
+ * A producer that ran out of room flags it and has another look, the
+ * consumer clears the flag after making room and kicks the producer
+ * when it was set. The fences keep the two from missing each other.
+ */
+static void workerBackOff(atomic_int *full)
+{
+  metricsAdd(METRIC_RING_FULL, 1U);
+  atomic_store(full, !0);
+  atomic_thread_fence(memory_order_seq_cst);
+}
+
+static int workerMadeRoom(atomic_int *full)
+{
+  atomic_thread_fence(memory_order_seq_cst);
+  return atomic_exchange(full, 0);
+}
+
+/* Worker thread side. */
+
+static int workerWake(struct Watch *watch, uint32_t events, void *ctx)
+{
+  struct Server *server = ((struct Server *)(ctx));
+  struct Worker *worker = ((struct Worker *)(watch->data));
+  struct WorkerConn *conn = NULL;
+  const void *data = NULL;
+  size_t size;
+  int consumed = 0;
+
+  workerDrainFd(worker->wakefd);
+  while ((conn = (struct WorkerConn *)(mailboxPop(&(worker->inbox))))) {
+    serverAdopt(server, conn->sock, conn->host, conn->acceptedAt);
+    free(conn);
+  }
+  /* Held back in the ring, the host side stalls once it is full. */
+  if (serverHostToNetStalled(server))
+    return 0;
+  while ((size = ringbuf_spsc_peek(worker->rbHostToNet, &data)) > 0U) {
+    /* Counted before it leaves the ring, so it is never out of sight. */
+    atomic_fetch_add(&(worker->backlog), size);
+    if (serverHostToNetPut(server, (const uint8_t *)(data), size) < 0)
+      return -1;
+    ringbuf_spsc_consume(worker->rbHostToNet, size);
+    consumed = !0;
+  }
+  if (consumed && workerMadeRoom(&(worker->hostToNetFull)))
+    workerKick(worker->pool->wakefd);
+  return 0;
+}
+
+static void workerForward(struct Worker *worker)
+{
+  struct Server *server = &(worker->server);
+  void *data = NULL;
+  size_t size;
+  size_t avail;
+  int kick = 0;
+
+  while ((size = serverNetToHostSize(server)) > 0U) {
+    avail = ringbuf_spsc_reserve(worker->rbNetToHost, &data);
+    if (!avail) {
+      workerBackOff(&(worker->netToHostFull));
+      avail = ringbuf_spsc_reserve(worker->rbNetToHost, &data);
+      if (!avail)
+        break;
+    }
+    if (size > avail)
+      size = avail;
+    serverNetToHostGet(server, (uint8_t *)(data), size);
+    ringbuf_spsc_commit(worker->rbNetToHost, size);
+    kick = !0;
+  }
+  if (kick)
+    workerKick(worker->pool->wakefd);
+}
+
+static void *workerMain(void *arg)
+{
+  struct Worker *worker = ((struct Worker *)(arg));
+
+  while (!(atomic_load(&(worker->stop)))) {
+    if (serverStep(&(worker->server)) < 0) {
+      atomic_store(&(worker->failed), !0);
+      workerKick(worker->pool->wakefd);
+      break;
+    }
+    atomic_store(&(worker->backlog), serverBacklog(&(worker->server)));
+    workerForward(worker);
+  }
+  slabTrim();
+  return NULL;
+}
+
+/* Host side. */
+
+static int workersWake(struct Watch *watch, uint32_t events, void *ctx)
+{
+  struct Server *server = ((struct Server *)(ctx));
+  struct Workers *pool = ((struct Workers *)(watch->data));
+  struct Worker *worker = NULL;
+  const void *data = NULL;
+  size_t size;
+  size_t room;
+  size_t i;
+  int consumed;
+
+  workerDrainFd(pool->wakefd);
+  pool->held = 0;
+  for (i = 0U; i < (pool->count); i++) {
+    worker = &(pool->workers[i]);
+    if (atomic_load(&(worker->failed))) {
+      logWrite(LOG_ERROR, "Worker %zu failed.", i);
+      return -1;
+    }
+    consumed = 0;
+    while ((size = ringbuf_spsc_peek(worker->rbNetToHost, &data)) > 0U) {
+      /* Leave the rest be until the host has taken some input in. */
+      room = ringbuf_bytes_free(server->rbNetToHost);
+      if (!room) {
+        pool->held = !0;
+        break;
+      }
+      if (size > room)
+        size = room;
+      serverNetToHostPut(server, (const uint8_t *)(data), size);
+      ringbuf_spsc_consume(worker->rbNetToHost, size);
+      consumed = !0;
+    }
+    if (consumed && workerMadeRoom(&(worker->netToHostFull)))
+      workerKick(worker->wakefd);
+  }
+  return 0;
+}
+
+static void workerStop(struct Worker *worker)
+{
+  struct WorkerConn *conn = NULL;
+
+  if (worker->running) {
+    atomic_store(&(worker->stop), !0);
+    workerKick(worker->wakefd);
+    pthread_join(worker->thread, NULL);
+    worker->running = 0;
+  }
+  serverStop(&(worker->server));
+  if (worker->inbox.slots) {
+    while ((conn = (struct WorkerConn *)(mailboxPop(&(worker->inbox))))) {
+      close(conn->sock);
+      free(conn);
+    }
+    mailboxFree(&(worker->inbox));
+  }
+  if (worker->rbHostToNet)
+    ringbuf_spsc_free(&(worker->rbHostToNet));
+  worker->rbHostToNet = NULL;
+  if (worker->rbNetToHost)
+    ringbuf_spsc_free(&(worker->rbNetToHost));
+  worker->rbNetToHost = NULL;
+  bcastLeave(&(worker->publish));
+  if (!((worker->wakefd) < 0))
+    close(worker->wakefd);
+  worker->wakefd = -1;
+}
+
+static int workerInit(struct Worker *worker, struct Workers *pool)
+{
+  memset(worker, 0, sizeof(struct Worker));
+  worker->pool = pool;
+  worker->wakefd = -1;
+  worker->running = 0;
+  worker->rbHostToNet = NULL;
+  worker->rbNetToHost = NULL;
+  atomic_init(&(worker->stop), 0);
+  atomic_init(&(worker->failed), 0);
+  atomic_init(&(worker->hostToNetFull), 0);
+  atomic_init(&(worker->netToHostFull), 0);
+  atomic_init(&(worker->backlog), 0U);
+  bcastJoin(encodersLog(&(pool->server->encoders), ENCODER_RAW),
+            &(worker->publish));
+  if (serverInit(&(worker->server), 0U) < 0)
+    return -1;
+  worker->server.sessions = pool->server->sessions;
+  if (mailboxInit(&(worker->inbox), WORKER_MAILBOX_SIZE) < 0)
+    return -1;
+  worker->rbHostToNet = ringbuf_spsc_new(WORKER_RING_CAPACITY);
+  if (!(worker->rbHostToNet))
+    return -1;
+  worker->rbNetToHost = ringbuf_spsc_new(WORKER_RING_CAPACITY);
+  if (!(worker->rbNetToHost))
+    return -1;
+  worker->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if ((worker->wakefd) < 0)
+    return -1;
+  worker->wake.fd = worker->wakefd;
+  worker->wake.events = EPOLLIN;
+  worker->wake.handler = workerWake;
+  worker->wake.data = worker;
+  if (reactorAdd(&(worker->server.reactor), &(worker->wake)) < 0)
+    return -1;
+  serverHostToNetWatch(&(worker->server), &(worker->wake));
+  /* The thread inherits the signal mask, the host side keeps them all. */
+  if (pthread_create(&(worker->thread), NULL, workerMain, worker))
+    return -1;
+  worker->running = !0;
+  return 0;
+}
+
+int workersInit(struct Workers *pool, struct Server *server, size_t count)
+{
+  size_t i;
+
+  assert(pool);
+  assert(server);
+  assert(count > 0U);
+  memset(pool, 0, sizeof(struct Workers));
+  pool->server = server;
+  pool->next = 0U;
+  pool->held = 0;
+  pool->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if ((pool->wakefd) < 0)
+    return -1;
+  pool->wake.fd = pool->wakefd;
+  pool->wake.events = EPOLLIN;
+  pool->wake.handler = workersWake;
+  pool->wake.data = pool;
+  if (reactorAdd(&(server->reactor), &(pool->wake)) < 0) {
+    close(pool->wakefd);
+    return -1;
+  }
+  pool->workers = (struct Worker *)(calloc(count, sizeof(struct Worker)));
+  if (!(pool->workers)) {
+    workersStop(pool);
+    return -1;
+  }
+  for (i = 0U; i < count; i++) {
+    pool->count++;
+    if (workerInit(&(pool->workers[i]), pool) < 0) {
+      workersStop(pool);
+      return -1;
+    }
+  }
+  server->workers = pool;
+  D("Started %zu worker threads.\n", count);
+  return 0;
+}
+
+void workersStop(struct Workers *pool)
+{
+  size_t i;
+
+  assert(pool);
+  for (i = 0U; i < (pool->count); i++)
+    workerStop(&(pool->workers[i]));
+  free(pool->workers);
+  pool->workers = NULL;
+  pool->count = 0U;
+  if (pool->server) {
+    pool->server->workers = NULL;
+    reactorDel(&(pool->server->reactor), &(pool->wake));
+  }
+  if (!((pool->wakefd) < 0))
+    close(pool->wakefd);
+  pool->wakefd = -1;
+}
+
+int workersAdopt(struct Workers *pool, int sock, const char *host,
+                 uint64_t acceptedAt)
+{
+  struct Worker *worker = NULL;
+  struct WorkerConn *conn = NULL;
+
+  assert(pool);
+  assert(pool->count > 0U);
+  assert(!(sock < 0));
+  assert(host);
+  worker = &(pool->workers[pool->next]);
+  pool->next = ((pool->next) + 1U) % (pool->count);
+  conn = (struct WorkerConn *)(malloc(sizeof(struct WorkerConn)));
+  if (!conn) {
+    close(sock);
+    return -1;
+  }
+  conn->sock = sock;
+  snprintf(conn->host, sizeof conn->host, "%s", host);
+  conn->acceptedAt = acceptedAt;
+  if (mailboxPush(&(worker->inbox), conn) < 0) {
+    logWrite(LOG_WARN, "No room for connection from [%s].", host);
+    close(sock);
+    free(conn);
+    return -1;
+  }
+  workerKick(worker->wakefd);
+  return 0;
+}
+
+/*
+ * Hand every worker the host output it has not seen yet. A worker that
+ * does not keep up is left behind in the log until it makes room.
+ */
+int workersPublish(struct Workers *pool)
+{
+  struct Worker *worker = NULL;
+  const uint8_t *data = NULL;
+  size_t size;
+  size_t copied;
+  size_t i;
+  int kick;
+
+  assert(pool);
+  for (i = 0U; i < (pool->count); i++) {
+    worker = &(pool->workers[i]);
+    kick = 0;
+    while ((size = bcastPeek(&(worker->publish), &data)) > 0U) {
+      copied = ringbuf_spsc_memcpy_into(worker->rbHostToNet, data, size);
+      if (!copied) {
+        workerBackOff(&(worker->hostToNetFull));
+        copied = ringbuf_spsc_memcpy_into(worker->rbHostToNet, data, size);
+        if (!copied)
+          break;
+      }
+      bcastConsume(&(worker->publish), copied);
+      kick = !0;
+    }
+    if (kick)
+      workerKick(worker->wakefd);
+  }
+  return 0;
+}
+
+/* The host has taken some input in, collect whatever was left behind. */
+void workersResume(struct Workers *pool)
+{
+  assert(pool);
+  if (!(pool->held))
+    return;
+  pool->held = 0;
+  workerKick(pool->wakefd);
+}
+
+/* How far behind the host output the slowest worker is. */
+uint64_t workersLag(const struct Workers *pool)
+{
+  uint64_t lag = 0U;
+  size_t i;
+
+  assert(pool);
+  for (i = 0U; i < (pool->count); i++) {
+    if (bcastLag(&(pool->workers[i].publish)) > lag)
+      lag = bcastLag(&(pool->workers[i].publish));
+  }
+  return lag;
+}
+
+/*
+ * How much host output the workers have yet to get out to their peers,
+ * as far as they last told. The host side has no look at the peers.
+ */
+uint64_t workersBacklog(const struct Workers *pool)
+{
+  const struct Worker *worker = NULL;
+  uint64_t backlog = 0U;
+  size_t i;
+
+  assert(pool);
+  for (i = 0U; i < (pool->count); i++) {
+    worker = &(pool->workers[i]);
+    backlog += bcastLag(&(worker->publish));
+    backlog += ringbuf_spsc_bytes_used(worker->rbHostToNet);
+    backlog += atomic_load(&(worker->backlog));
+  }
+  return backlog;
+}
+
+/*
+ * How much is waiting in the rings of every worker, either way, and how
+ * far behind the host output each one is.
+ */
+void workersMetricsWrite(const struct Workers *pool, FILE *out)
+{
+  const struct Worker *worker = NULL;
+  size_t i;
+
+  assert(pool);
+  assert(out);
+  fprintf(out, "# TYPE " METRICS_PREFIX "worker_host_to_net_bytes gauge\n");
+  for (i = 0U; i < (pool->count); i++) {
+    worker = &(pool->workers[i]);
+    fprintf(out, METRICS_PREFIX "worker_host_to_net_bytes{worker=\"%zu\"} %zu"
+            "\n", i, ringbuf_spsc_bytes_used(worker->rbHostToNet));
+  }
+  fprintf(out, "# TYPE " METRICS_PREFIX "worker_net_to_host_bytes gauge\n");
+  for (i = 0U; i < (pool->count); i++) {
+    worker = &(pool->workers[i]);
+    fprintf(out, METRICS_PREFIX "worker_net_to_host_bytes{worker=\"%zu\"} %zu"
+            "\n", i, ringbuf_spsc_bytes_used(worker->rbNetToHost));
+  }
+  fprintf(out, "# TYPE " METRICS_PREFIX "worker_lag_bytes gauge\n");
+  for (i = 0U; i < (pool->count); i++) {
+    worker = &(pool->workers[i]);
+    fprintf(out, METRICS_PREFIX "worker_lag_bytes{worker=\"%zu\"} %llu\n", i,
+            (unsigned long long)(bcastLag(&(worker->publish))));
+  }
+}
@@ -0,0 +1,102 @@
+/*
+ * worker.h - Connection worker threads interface.
+ *
+ * Written in 2020 by Paul Osmialowski <pawelo@king.net.pl>.
+ *
+ * To the extent possible under law, the author(s) have dedicated all
+ * copyright and related and neighboring rights to this software to
+ * the public domain worldwide. This software is distributed without
+ * any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication
+ * along with this software. If not, see
+ * <http://creativecommons.org/publicdomain/zero/1.0>.
+ */
+
+#ifndef __WORKER_H
+#define __WORKER_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "ringbuf.h"
+
+#include "server.h"
+#include "reactor.h"
+#include "bcast.h"
+#include "mailbox.h"
+#include "connection.h"
+
+#ifndef WORKER_MAILBOX_SIZE
+#define WORKER_MAILBOX_SIZE 64U
+#endif
+
+#ifndef WORKER_RING_CAPACITY
+#define WORKER_RING_CAPACITY 65536U
+#endif
+
+#define WORKER_MAX 64U
+
+/* A freshly accepted socket on its way to a worker. */
+struct WorkerConn
+{
+  int sock;
+  char host[MAX_HOST_LEN + 1U];
+  uint64_t acceptedAt;
+};
+
+struct Workers;
+
+/*
+ * A worker owns a shard of the connections and runs a server of its own
+ * with no listening socket. The thread that owns the host descriptors
+ * keeps a cursor per worker in its host output log and copies what the
+ * worker has not seen yet into the worker's host-to-net ring, the worker
+ * hands client input back through the net-to-host ring. Each side kicks
+ * the other's eventfd, and flags it when it had to back off from a full
+ * ring.
+ */
+struct Worker
+{
+  struct Server server;
+  struct Workers *pool;
+  pthread_t thread;
+  int running;
+  int wakefd;
+  struct Watch wake;
+  struct Mailbox inbox;
+  ringbuf_spsc_t rbHostToNet;
+  ringbuf_spsc_t rbNetToHost;
+  struct BcastCursor publish;
+  atomic_int stop;
+  atomic_int failed;
+  atomic_int hostToNetFull;
+  atomic_int netToHostFull;
+  atomic_ullong backlog; /* still due for the worker's peers */
+};
+
+struct Workers
+{
+  struct Server *server;
+  struct Worker *workers;
+  size_t count;
+  size_t next;
+  int wakefd;
+  struct Watch wake;
+  int held;
+};
+
+int workersInit(struct Workers *pool, struct Server *server, size_t count);
+void workersStop(struct Workers *pool);
+int workersAdopt(struct Workers *pool, int sock, const char *host,
+                 uint64_t acceptedAt);
+int workersPublish(struct Workers *pool);
+void workersResume(struct Workers *pool);
+uint64_t workersLag(const struct Workers *pool);
+uint64_t workersBacklog(const struct Workers *pool);
+void workersMetricsWrite(const struct Workers *pool, FILE *out);
+
+#endif /* __WORKER_H */